@@ -33,30 +33,486 @@
 
 #define PENTER_STACK_WALK_ON 1
 
+//
+// Function traces are kept in fixed size segments that are allocated as
+// new functions show up. Segments are never moved or freed, so a pointer to a
+// FUNC_TRACE stays valid forever. The debugger finds entry N in segment
+// (N >> FUNC_TRACE_SEGMENT_SHIFT) of the FuncTraceSegments directory.
+//
+#define FUNC_TRACE_SEGMENT_SHIFT 9
+#define FUNC_TRACE_SEGMENT_SIZE  (1 << FUNC_TRACE_SEGMENT_SHIFT)
+#define FUNC_TRACE_SEGMENT_MASK  (FUNC_TRACE_SEGMENT_SIZE - 1)
+
 //
 // Cap the max number of functions that we'll monitor to
-// something insane (like 2,000). This makes everything
+// something insane (like 16,000). This makes everything
 // easier...
 //
-#define MAX_FUNC_TRACES 2000
+#define MAX_FUNC_TRACE_SEGMENTS  32
+#define MAX_FUNC_TRACES          (MAX_FUNC_TRACE_SEGMENTS * FUNC_TRACE_SEGMENT_SIZE)
 
-#define MAX_CALL_FRAMES    5
+//
+// Max frames kept for a stack and max distinct stacks tracked per function.
+// See StackCaptureFrames in stacktable.c for how to turn capture on.
+//
+#define MAX_CALL_FRAMES    16
 #define MAX_CALL_HISTORY   50
 
+//
+// Unique stacks are interned in a global table so that a stack that shows up
+// for a bunch of functions is only stored once. Entries are never freed.
+//
+#define STACK_TABLE_SHIFT  12
+#define STACK_TABLE_SIZE   (1 << STACK_TABLE_SHIFT)
+#define STACK_INDEX_NONE   ((ULONG)-1)
+
+typedef struct _STACK_TABLE_ENTRY {
+    //
+    // Hash of the frames, zero if the slot is empty
+    //
+    volatile ULONG  Hash;
+
+    //
+    // Zero until the owner has filled in the frames
+    //
+    volatile USHORT FramesCount;
+
+    PVOID           Frames[MAX_CALL_FRAMES];
+}STACK_TABLE_ENTRY, *PSTACK_TABLE_ENTRY;
+
+//
+// One stack seen by a function. StackSeenCount may be too high by as much
+// as Error, see StackCaptureRecord
+//
 typedef struct _CALL_HISTORY {
-    PVOID  Frames[MAX_CALL_HISTORY];
-    USHORT FramesCount;
+    ULONG  StackIndex;
     LONG   StackSeenCount;
-    volatile LONG  Epoch;
+    LONG   Error;
 }CALL_HISTORY, *PCALL_HISTORY;
 
+//
+// Most frequent stacks seen by a function. This is big, so it's only
+// allocated for functions that actually record a stack.
+//
+typedef struct _CALL_HISTORY_LOG {
+    volatile LONG  Lock;
+
+    //
+    // Contents are stale if this doesn't match CurrentEpoch
+    //
+    LONG           Epoch;
+
+    LONG           EntriesCount;
+
+    //
+    // Number of stacks recorded this epoch
+    //
+    LONG           Total;
+
+    CALL_HISTORY   Entries[MAX_CALL_HISTORY];
+}CALL_HISTORY_LOG, *PCALL_HISTORY_LOG;
+
 // 
 // Entries are invalidated by updating the global epoch
 // 
 extern volatile LONG CurrentEpoch;
 
 //
-// Tracking structure for each function.
+// Where the tick counts come from. TimeCalibration says which source the
+// library picked and how fast it ticks, so the debugger can turn ticks into
+// nanoseconds.
+//
+#define PENTER_TIME_SOURCE_QPC  0
+#define PENTER_TIME_SOURCE_TSC  1
+
+#define HOOK_OVERHEAD_CALLS     1024
+
+typedef struct _TIME_CALIBRATION {
+    //
+    // One of the PENTER_TIME_SOURCE values
+    //
+    ULONG          TimeSource;
+
+    //
+    // Ticks per second of the time source, zero until the library is
+    // initialized
+    //
+    ULONGLONG      TicksPerSecond;
+
+    //
+    // Measured cost of one instrumented call (_penter plus _pexit) as seen
+    // by the caller, in ticks per HOOK_OVERHEAD_CALLS calls. The hooks of
+    // a leaf function go through the cheaper _penter_leaf path on the x64,
+    // so those are measured separately. Both are charged to the callers
+    // in FUNC_COUNTERS.DescendantHookOverhead.
+    //
+    ULONGLONG      HookOverhead;
+    ULONGLONG      HookOverheadLeaf;
+
+}TIME_CALIBRATION, *PTIME_CALIBRATION;
+
+//
+// Calls are also counted by the IRQL that they were entered at, one class
+// per IRQL up to DISPATCH_LEVEL and one more for everything above it
+//
+#define FUNC_IRQL_CLASSES        4
+
+typedef struct _FUNC_IRQL_COUNTERS {
+    //
+    // Same as the FUNC_COUNTERS fields of the same name, for the calls
+    // entered at this IRQL
+    //
+    volatile LONGLONG CallCount;
+
+    volatile LONGLONG SampledCount;
+
+    volatile LONGLONG CallTicks;
+
+    volatile LONGLONG SelfTicks;
+
+}FUNC_IRQL_COUNTERS, *PFUNC_IRQL_COUNTERS;
+
+//
+// Per IRQL counters for each function, kept in segments parallel to the
+// trace segments like the histograms. Few calls come in above 
+// PASSIVE_LEVEL, so one copy per function is shared by all of the 
+// processors and updated with interlocked operations. 
+//
+// There's no entry for PASSIVE_LEVEL, Irql[C - 1] holds class C. The
+// PASSIVE_LEVEL numbers are whatever is left of the FUNC_COUNTERS totals
+// once the other classes are taken out, so the common case doesn't pay
+// for them.
+//
+typedef struct _FUNC_IRQL_STATS {
+
+    FUNC_IRQL_COUNTERS Irql[FUNC_IRQL_CLASSES - 1];
+
+}FUNC_IRQL_STATS, *PFUNC_IRQL_STATS;
+
+//
+// Counters for each function. These are touched on every call, so they're
+// kept out of the FUNC_TRACE in their own segments of tightly packed
+// entries, one cache line each. Counter segment N covers the same 
+// functions as trace segment N.
+//
+// Every processor gets its own copy of the counters so that it can update
+// them without interlocked operations. Each processor has its own 
+// directory of counter segments in its PER_CPU_DATA, and a processor's 
+// segment is allocated on its own, so processor P's counters for entry I 
+// are at:
+//
+//      PerCpuData[P].CounterSegments[I >> FUNC_TRACE_SEGMENT_SHIFT]
+//          [I & FUNC_TRACE_SEGMENT_MASK]
+//
+// The real totals are the sum over all of the processors.
+//
+typedef struct _FUNC_COUNTERS {
+    //
+    // Number of clock ticks spent in the function, including its callees.
+    // Instrumented DPCs and ISRs that came in on top of the function are
+    // taken back out.
+    //
+    LARGE_INTEGER  CallTicks;
+
+    //
+    // Number of clock ticks spent in the function itself. This is CallTicks
+    // less the time spent in instrumented callees.
+    //
+    LARGE_INTEGER  SelfTicks;
+
+    //
+    // Number of times the function has been called.
+    //
+    ULONGLONG      CallCount;
+
+    //
+    // Cost of the hooks of the instrumented calls made while the function
+    // was running, at any depth, in ticks per HOOK_OVERHEAD_CALLS calls.
+    // Used to take the hook overhead back out of CallTicks.
+    //
+    ULONGLONG      DescendantHookOverhead;
+
+    //
+    // Longest single call
+    //
+    ULONGLONG      MaxTicks;
+
+    //
+    // Number of clock ticks that the thread actually ran for in the
+    // function, including its callees. The rest of CallTicks was spent
+    // off of the thread: blocked, waiting for a processor or in DPCs and
+    // ISRs that aren't instrumented. Only kept with the TSC time source
+    // and for calls entered below DISPATCH_LEVEL, calls at or above that
+    // can't block so all of their time counts.
+    //
+    ULONGLONG      CpuTicks;
+
+    //
+    // Number of calls that were sampled, see SampleRate. Everything else
+    // in here but CallCount only covers the sampled calls, scale by
+    // CallCount / SampledCount to estimate the real totals.
+    //
+    ULONGLONG      SampledCount;
+
+    //
+    // Calls left until the next sample on this processor
+    //
+    ULONG          SampleCountdown;
+
+}FUNC_COUNTERS, *PFUNC_COUNTERS;
+
+//
+// Latency histogram for each function, kept in segments parallel to the
+// trace segments like the counters. One histogram per function is shared by
+// all of the processors and updated with interlocked increments.
+//
+// The buckets are log-linear: every power of two range is split into
+// FUNC_HISTOGRAM_SUB_BUCKETS equal buckets, so each bucket is at most 25%
+// wide. Values below FUNC_HISTOGRAM_SUB_BUCKETS get a bucket each. Bucket B
+// (B >= FUNC_HISTOGRAM_SUB_BUCKETS) covers ticks in:
+//
+//      M = (B >> FUNC_HISTOGRAM_SUB_BUCKET_BITS) + 
+//          FUNC_HISTOGRAM_SUB_BUCKET_BITS - 1
+//      S = B & (FUNC_HISTOGRAM_SUB_BUCKETS - 1)
+//
+//      [(FUNC_HISTOGRAM_SUB_BUCKETS + S) << (M - FUNC_HISTOGRAM_SUB_BUCKET_BITS),
+//       (FUNC_HISTOGRAM_SUB_BUCKETS + S + 1) << (M - FUNC_HISTOGRAM_SUB_BUCKET_BITS))
+//
+// The last bucket also takes everything bigger than that (2^41 ticks, over
+// ten minutes with a 3GHz TSC).
+//
+#define FUNC_HISTOGRAM_SUB_BUCKET_BITS 2
+#define FUNC_HISTOGRAM_SUB_BUCKETS     (1 << FUNC_HISTOGRAM_SUB_BUCKET_BITS)
+#define FUNC_HISTOGRAM_BUCKETS         160
+
+typedef struct _FUNC_HISTOGRAM {
+    volatile LONG64 Buckets[FUNC_HISTOGRAM_BUCKETS];
+}FUNC_HISTOGRAM, *PFUNC_HISTOGRAM;
+
+//
+// Slowest calls seen by each function, again in segments parallel to the
+// trace segments. Entries are in no particular order.
+//
+#define MAX_SLOW_CALLS 8
+
+typedef struct _SLOW_CALL {
+    //
+    // How long the call took and when it started, in time source ticks
+    //
+    ULONGLONG      Ticks;
+    LONGLONG       StartTicks;
+
+    //
+    // Who made the call. Kept as ULONGLONG so the debugger doesn't care if
+    // the target is 32-bit or 64-bit.
+    //
+    ULONGLONG      ThreadId;
+    ULONGLONG      ProcessId;
+    ULONG          Processor;
+
+    //
+    // IRQL that the call was entered at
+    //
+    ULONG          Irql;
+
+}SLOW_CALL, *PSLOW_CALL;
+
+typedef struct _FUNC_SLOW_CALLS {
+    volatile LONG  Lock;
+    LONG           EntriesCount;
+
+    //
+    // Shortest call in Entries once it's full, zero until then. A call has
+    // to beat this to get in, this is all that a normal call looks at.
+    //
+    volatile LONGLONG ThresholdTicks;
+
+    SLOW_CALL      Entries[MAX_SLOW_CALLS];
+
+}FUNC_SLOW_CALLS, *PFUNC_SLOW_CALLS;
+
+//
+// Caller to callee edges of the call graph, in one table allocated at init.
+// An edge is keyed by the indexes of the two functions' FUNC_TRACE entries,
+// plus one so that zero can mean an empty slot:
+//
+//      Key = ((CallerIndex + 1) << CALL_EDGE_INDEX_BITS) | (CalleeIndex + 1)
+//
+// MAX_FUNC_TRACES has to fit in CALL_EDGE_INDEX_BITS. Edges are never freed.
+//
+#define CALL_EDGE_TABLE_SHIFT  13
+#define CALL_EDGE_TABLE_SIZE   (1 << CALL_EDGE_TABLE_SHIFT)
+#define CALL_EDGE_INDEX_BITS   16
+#define CALL_EDGE_INDEX_MASK   ((1 << CALL_EDGE_INDEX_BITS) - 1)
+
+typedef struct _CALL_EDGE {
+    //
+    // Zero if the slot is empty
+    //
+    volatile LONG   Key;
+
+    //
+    // Number of calls made along the edge and the time spent in the callee
+    // for them. Like CallTicks, recursive calls of the callee don't add
+    // any time.
+    //
+    volatile LONG64 CallCount;
+    volatile LONG64 CallTicks;
+
+}CALL_EDGE, *PCALL_EDGE;
+
+//
+// Calling-context tree, in one table allocated at init. Each node is a
+// function reached through one particular path of calls, and the path is
+// the chain of parents back to a top level call. A node is keyed by its
+// parent's node index and the index of its function's FUNC_TRACE, plus one
+// so that zero can mean an empty slot and a top level call:
+//
+//      Key = ((ParentNode + 1) << CALL_TREE_INDEX_BITS) | (FunctionIndex + 1)
+//
+// The key of a node whose function was called from the top level has zero
+// in the parent bits. Nodes are never freed.
+//
+// Calls that weren't sampled or are filtered don't get a frame, so they
+// don't get a node either. A call made under one of them gets the node of
+// CALL_TREE_FUNCTION_UNTIMED in the function bits as its parent, which
+// stands for one or more of those calls between it and the nearest caller
+// that was timed.
+//
+#define CALL_TREE_SHIFT            14
+#define CALL_TREE_SIZE             (1 << CALL_TREE_SHIFT)
+#define CALL_TREE_INDEX_BITS       16
+#define CALL_TREE_INDEX_MASK       ((1 << CALL_TREE_INDEX_BITS) - 1)
+#define CALL_TREE_FUNCTION_UNTIMED 0
+
+typedef struct _CALL_TREE_NODE {
+    //
+    // Zero if the slot is empty
+    //
+    volatile LONG   Key;
+
+    //
+    // Number of calls made along this path, the time spent in them, and
+    // the time spent in them less their instrumented callees
+    //
+    volatile LONG64 CallCount;
+    volatile LONG64 CallTicks;
+    volatile LONG64 SelfTicks;
+
+}CALL_TREE_NODE, *PCALL_TREE_NODE;
+
+//
+// Time spent in each function by each process, off by default. Set
+// ProcessStatsEnabled from the debugger to turn it on:
+//
+//      ed module!ProcessStatsEnabled 1
+//
+// A call is counted against the process of the thread that made it, in one
+// table allocated at init. An entry is keyed by the process ID and the index
+// of the function's FUNC_TRACE, plus one so that zero can mean an empty
+// slot:
+//
+//      Key = (ProcessId << 32) | (FunctionIndex + 1)
+//
+// DPCs and ISRs run in whatever process they interrupted, so their calls go
+// to PROCESS_STATS_DPC_ISR_ID instead. That's not a process ID that can be 
+// handed out, those are multiples of four, and it keeps them apart from the 
+// Idle process, which is process ID zero. Calls that don't fit in the table
+// are added to the ProcessStatsOverflow entry instead. Entries are never 
+// freed.
+//
+#define PROCESS_STATS_SHIFT       12
+#define PROCESS_STATS_SIZE        (1 << PROCESS_STATS_SHIFT)
+#define PROCESS_STATS_NAME_LENGTH 16
+#define PROCESS_STATS_DPC_ISR_ID  ((ULONG)-2)
+
+typedef struct _PROCESS_STATS {
+    //
+    // Zero if the slot is empty
+    //
+    volatile LONG64 Key;
+
+    //
+    // Same as the FUNC_COUNTERS fields of the same name, for the calls
+    // made by this process
+    //
+    volatile LONG64 CallCount;
+    volatile LONG64 SampledCount;
+    volatile LONG64 CallTicks;
+    volatile LONG64 SelfTicks;
+
+    //
+    // Image name of the process, filled in by whoever claimed the slot. 
+    // Can still be empty right after the slot was claimed.
+    //
+    CHAR            ImageName[PROCESS_STATS_NAME_LENGTH];
+
+}PROCESS_STATS, *PPROCESS_STATS;
+
+//
+// Timeline of every enter and exit, off by default. Each processor appends
+// to its own ring buffer, allocated the first time that it has something to
+// record. Set TimelineMode from the debugger to turn it on:
+//
+//      ed module!TimelineMode 1
+//
+// In TIMELINE_MODE_OVERWRITE the newest events replace the oldest ones. In
+// TIMELINE_MODE_STOP a buffer stops taking events once it's full, so you
+// keep the start of the run.
+//
+#define TIMELINE_MODE_OFF        0
+#define TIMELINE_MODE_OVERWRITE  1
+#define TIMELINE_MODE_STOP       2
+
+#define TIMELINE_BUFFER_SHIFT    14
+#define TIMELINE_BUFFER_SIZE     (1 << TIMELINE_BUFFER_SHIFT)
+#define TIMELINE_BUFFER_MASK     (TIMELINE_BUFFER_SIZE - 1)
+
+//
+// Set in FunctionIndex for an exit
+//
+#define TIMELINE_EVENT_EXIT      0x80000000
+
+typedef struct _TIMELINE_EVENT {
+    //
+    // Time source ticks, same as StartTicks in SLOW_CALL
+    //
+    LONGLONG       Timestamp;
+
+    //
+    // Index of the function's FUNC_TRACE, plus TIMELINE_EVENT_EXIT for an
+    // exit
+    //
+    ULONG          FunctionIndex;
+
+    ULONG          ThreadId;
+
+}TIMELINE_EVENT, *PTIMELINE_EVENT;
+
+typedef struct _TIMELINE_BUFFER {
+    //
+    // Number of events ever recorded in the buffer, including the ones
+    // that were overwritten or didn't fit. Event N lives in slot
+    // (N & TIMELINE_BUFFER_MASK).
+    //
+    volatile LONG64 Next;
+
+    TIMELINE_EVENT  Events[TIMELINE_BUFFER_SIZE];
+
+}TIMELINE_BUFFER, *PTIMELINE_BUFFER;
+
+//
+// What the hooks do with the calls of a function. Set from the debugger
+// with !filter. Calls that are only counted or ignored don't get a frame on
+// the shadow stack, so their time shows up as their caller's self time.
+//
+#define FUNC_FILTER_TRACE        0
+#define FUNC_FILTER_COUNT        1
+#define FUNC_FILTER_IGNORE       2
+
+//
+// Tracking structure for each function. Nothing in here changes on a
+// normal call.
 //
 typedef struct _FUNC_TRACE {
     //
@@ -65,23 +521,63 @@ typedef struct _FUNC_TRACE {
     ULONGLONG      StartAddress;
 
     //
-    // Number of clock ticks spent in the function
+    // Index of this entry in the segments
     //
-    LARGE_INTEGER  CallTicks;
+    ULONG          Index;
 
     //
-    // Number of times the function has been called.
+    // This function's counters broken down by IRQL
     //
-    ULONG          CallCount;
+    PFUNC_IRQL_STATS IrqlStats;
+
+    //
+    // This function's latency histogram
+    //
+    PFUNC_HISTOGRAM Histogram;
+
+    //
+    // This function's slowest calls
+    //
+    PFUNC_SLOW_CALLS SlowCalls;
+
+    //
+    // Time only one in this many calls of the function, zero to use the
+    // global SampleRate
+    //
+    ULONG          SampleRate;
+
+    //
+    // One of the FUNC_FILTER_XXX values
+    //
+    volatile ULONG FilterState;
+
+    //
+    // Deepest recursion seen, zero if the function never called itself.
+    // Only the outermost call of a recursion counts towards CallTicks.
+    //
+    volatile LONG  MaxRecursionDepth;
 
 #ifdef PENTER_STACK_WALK_ON
-    CALL_HISTORY   CallHistory[MAX_CALL_HISTORY];
-    volatile LONG  CallHistoryIndex;
-    volatile LONG  CallHistoryTotal;
+    //
+    // NULL until the function records its first stack
+    //
+    PCALL_HISTORY_LOG volatile CallHistory;
 #endif
 
 }FUNC_TRACE, *PFUNC_TRACE;
 
+//
+// Turns tracing on or off from the instrumented driver, like !tracing does
+// from the debugger. While it's off the _penter and _pexit hooks return right
+// away. The calls that were in flight when it was turned off aren't counted,
+// !tracing shows how many were dropped. Don't set the library's
+// TracingEnabled global directly, that skips starting a new generation and
+// mixes up the frames of those calls with new ones.
+//
+VOID
+PenterSetTracing(
+    BOOLEAN Enable);
+
 #endif __FUNC_TRACE_H__
 
 
@@ -0,0 +1,194 @@
+//
+// Copyright 2008-2017 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+// CONSEQUENTIAL DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+// POSSIBILITY OF SUCH DAMAGE
+#ifndef __TIME_CALIBRATION_H__
+#define __TIME_CALIBRATION_H__
+
+#include "func_trace.h"
+
+//
+// The arithmetic behind TimeSourceInitialize. The library reads the clocks
+// and CPUID, these work out what the readings mean. Nothing in here calls
+// the kernel, so the test in test\timecalibration can build it in user
+// mode.
+//
+
+//
+// CPUID.80000007H:EDX[8] says that the TSC runs at a constant rate in all
+// P-, C- and T-states, same bit on Intel and AMD. The leaf is only there 
+// if CPUID.80000000H:EAX is at least 80000007H.
+//
+#define TSC_INVARIANT_CPUID_LEAF 0x80000007
+#define TSC_INVARIANT_EDX_BIT    (1 << 8)
+
+static __inline
+BOOLEAN
+TimeCalibrationTscIsInvariant(
+    ULONG MaxExtendedLeaf,
+    ULONG InvariantLeafEdx
+    )
+{
+    if (MaxExtendedLeaf < TSC_INVARIANT_CPUID_LEAF) {
+
+        return FALSE;
+
+    }
+
+    return ((InvariantLeafEdx & TSC_INVARIANT_EDX_BIT) != 0) ? TRUE : FALSE;
+}
+
+//
+// Value * Multiplier / Divisor, for a Value less than Divisor, without 
+// overflowing. The product is worked out in 128 bits from 32 bit halves 
+// and divided a bit at a time. Slow, but only used once at init, and it's 
+// the same code on the x86 and the x64. The result is less than 
+// Multiplier, so it always fits.
+//
+static __inline
+ULONGLONG
+TimeCalibrationMulDiv(
+    ULONGLONG Value,
+    ULONGLONG Multiplier,
+    ULONGLONG Divisor
+    )
+{
+    ULONGLONG lowLow;
+    ULONGLONG lowHigh;
+    ULONGLONG highLow;
+    ULONGLONG middle;
+    ULONGLONG productHigh;
+    ULONGLONG productLow;
+    ULONGLONG remainder;
+    ULONGLONG quotient = 0;
+    ULONGLONG carry;
+    ULONG     bit;
+
+    lowLow  = (Value & 0xFFFFFFFF) * (Multiplier & 0xFFFFFFFF);
+    lowHigh = (Value & 0xFFFFFFFF) * (Multiplier >> 32);
+    highLow = (Value >> 32) * (Multiplier & 0xFFFFFFFF);
+
+    middle = (lowLow >> 32) + (lowHigh & 0xFFFFFFFF) + (highLow & 0xFFFFFFFF);
+
+    productLow  = (middle << 32) | (lowLow & 0xFFFFFFFF);
+    productHigh = ((Value >> 32) * (Multiplier >> 32)) + 
+                  (lowHigh >> 32) + (highLow >> 32) + (middle >> 32);
+
+    //
+    // Value < Divisor means that productHigh < Divisor, so the remainder 
+    // starts out in range and the quotient fits in 64 bits
+    //
+    remainder = productHigh;
+
+    for (bit = 0; bit < 64; bit++) {
+
+        carry      = remainder >> 63;
+        remainder  = (remainder << 1) | (productLow >> 63);
+        productLow = productLow << 1;
+        quotient   = quotient << 1;
+
+        if ((carry != 0) || (remainder >= Divisor)) {
+
+            remainder -= Divisor;
+            quotient  |= 1;
+
+        }
+
+    }
+
+    return quotient;
+}
+
+//
+// Work out how fast the TSC ticks from readings of the TSC and the QPC 
+// taken at both ends of a stall. Returns zero if the readings are no good.
+//
+// Divides before it multiplies, so that a QPC that runs at TSC speed 
+// can't overflow the product. The remainder times the frequency still can
+// over a long enough stall, so that part goes through 
+// TimeCalibrationMulDiv.
+//
+static __inline
+ULONGLONG
+TimeCalibrationTscTicksPerSecond(
+    ULONGLONG TscStart,
+    ULONGLONG TscEnd,
+    LONGLONG  QpcStart,
+    LONGLONG  QpcEnd,
+    LONGLONG  QpcFrequency
+    )
+{
+    ULONGLONG tscTicks;
+    ULONGLONG qpcTicks;
+
+    if ((QpcFrequency <= 0) || (QpcEnd <= QpcStart) || (TscEnd <= TscStart)) {
+
+        return 0;
+
+    }
+
+    tscTicks = TscEnd - TscStart;
+    qpcTicks = (ULONGLONG)(QpcEnd - QpcStart);
+
+    return ((tscTicks / qpcTicks) * (ULONGLONG)QpcFrequency) +
+           TimeCalibrationMulDiv(tscTicks % qpcTicks, 
+                                 (ULONGLONG)QpcFrequency, 
+                                 qpcTicks);
+}
+
+//
+// Pick the time source. The TSC only if it's the preference, it's 
+// invariant and it calibrated (TscTicksPerSecond isn't zero), otherwise 
+// fall back to the QPC.
+//
+static __inline
+VOID
+TimeCalibrationSelect(
+    ULONG             Preference,
+    BOOLEAN           TscIsInvariant,
+    ULONGLONG         TscTicksPerSecond,
+    LONGLONG          QpcFrequency,
+    PTIME_CALIBRATION Calibration
+    )
+{
+    if ((Preference == PENTER_TIME_SOURCE_TSC) &&
+        (TscIsInvariant != FALSE) &&
+        (TscTicksPerSecond != 0)) {
+
+        Calibration->TimeSource     = PENTER_TIME_SOURCE_TSC;
+        Calibration->TicksPerSecond = TscTicksPerSecond;
+
+        return;
+
+    }
+
+    Calibration->TimeSource     = PENTER_TIME_SOURCE_QPC;
+    Calibration->TicksPerSecond = (ULONGLONG)QpcFrequency;
+}
+
+#endif __TIME_CALIBRATION_H__
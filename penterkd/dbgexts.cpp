@@ -176,6 +176,8 @@ void
 CALLBACK
 DebugExtensionUninitialize(void)
 {
+    TraceWalkFreeCache();
+
     return;
 }
 
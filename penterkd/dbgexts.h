@@ -45,6 +45,7 @@ Module Name:
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include "func_trace.h"
 #include <strsafe.h>
 
@@ -89,6 +90,9 @@ ExtQuery(PDEBUG_CLIENT4 Client);
 void
 ExtRelease(void);
 
+void
+TraceWalkFreeCache(void);
+
 #ifdef __cplusplus
 }
 #endif
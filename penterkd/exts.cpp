@@ -43,158 +43,344 @@ Module:
 -----------------------------------------------------------------------------*/
 #include "dbgexts.h"
 
+//
+// Everything that we need to find the FUNC_TRACE and FUNC_COUNTERS entries
+// of a module
+//
+typedef struct _TRACE_WALK {
+    ULONG64 FuncTracesInUse;
+    ULONG64 Segments[MAX_FUNC_TRACE_SEGMENTS];
+    ULONG64 IrqlSegments[MAX_FUNC_TRACE_SEGMENTS];
+    ULONG64 HistogramSegments[MAX_FUNC_TRACE_SEGMENTS];
+    ULONG64 SlowCallsSegments[MAX_FUNC_TRACE_SEGMENTS];
+    ULONG64 FuncTraceSize;
+    ULONG64 FuncCountersSize;
+    ULONG   PerCpuCount;
+    ULONG64 PerCpuData;
+    ULONG64 PerCpuDataSize;
+    ULONG   TimelineOffset;
+    BOOL    HasSampling;
+    BOOL    HasCpuTicks;
+    ULONG64 TicksPerSecond;
+    ULONG64 HookOverhead;
+    ULONG   PtrSize;
+    char    FuncTraceType[512];
+    char    FuncCountersType[512];
+
+    //
+    // Where the fields that we read are, looked up once. See 
+    // TRACE_FIELD_MISSING.
+    //
+    ULONG   StartAddressOffset;
+    ULONG   MaxRecursionDepthOffset;
+    ULONG   CallTicksOffset;
+    ULONG   SelfTicksOffset;
+    ULONG   CallCountOffset;
+    ULONG   DescendantCallsOffset;
+    ULONG   DescendantHookOverheadOffset;
+    ULONG   MaxTicksOffset;
+    ULONG   SampledCountOffset;
+    ULONG   CpuTicksOffset;
+
+    //
+    // Every processor's counter segment directory, processor P's is at
+    // CounterSegments[P * MAX_FUNC_TRACE_SEGMENTS]
+    //
+    ULONG64 *CounterSegments;
+
+    //
+    // Local copies of the in use FUNC_TRACE entries, and of every 
+    // processor's FUNC_COUNTERS once TraceWalkReadCounters has been 
+    // called. These and CounterSegments point into the caches below.
+    //
+    PUCHAR  Traces;
+    PUCHAR  Counters;
+} TRACE_WALK, *PTRACE_WALK;
+
+//
+// Offset of a field that the module's build of the library doesn't
+// have. It reads as zero, same as with ReadField.
+//
+#define TRACE_FIELD_MISSING ((ULONG)-1)
+
+//
+// Buffers for the local copies of the trace entries and counters. 
+// Reading them in a few big chunks is a lot faster over a serial or 
+// network debugger connection than reading them field by field. They're 
+// kept from one command to the next so that the commands don't have to 
+// free them on every way out. TraceWalkFreeCache frees them when the 
+// extension is unloaded.
+//
+PUCHAR  TraceCache;
+ULONG64 TraceCacheSize;
+PUCHAR  CounterCache;
+ULONG64 CounterCacheSize;
+PUCHAR  CounterSegmentCache;
+ULONG64 CounterSegmentCacheSize;
+
+//
+// Longest path that !flamegraph will print. The library can't track
+// calls deeper than 64, so this is plenty.
+//
+#define FLAME_GRAPH_MAX_DEPTH 128
+
+//
+// Local copy of a TIMELINE_EVENT, with the processor that it came from
+//
+typedef struct _TIMELINE_ENTRY {
+    LONG64 Timestamp;
+    ULONG  FunctionIndex;
+    ULONG  ThreadId;
+    ULONG  Processor;
+} TIMELINE_ENTRY, *PTIMELINE_ENTRY;
+
+//
+// Everything that one process spent in the module, for !processstats
+//
+typedef struct _PROCESS_TOTAL {
+    ULONG   ProcessId;
+    CHAR    ImageName[PROCESS_STATS_NAME_LENGTH];
+    ULONG64 CallCount;
+    ULONG64 Ticks;
+    ULONG   TopFunction;
+    ULONG64 TopTicks;
+} PROCESS_TOTAL, *PPROCESS_TOTAL;
+
+//
+// Local copy of a CALL_HISTORY entry, for sorting
+//
+typedef struct _HISTORY_ENTRY {
+    ULONG StackIndex;
+    LONG  StackSeenCount;
+    LONG  Error;
+} HISTORY_ENTRY, *PHISTORY_ENTRY;
+
 void DumpSymbol64(ULONG64 Address);
+int __cdecl CompareHistoryEntries(const void *Entry1, const void *Entry2);
+int __cdecl CompareSlowCalls(const void *Entry1, const void *Entry2);
+int __cdecl CompareCallEdges(const void *Entry1, const void *Entry2);
+int __cdecl CompareTimelineEntries(const void *Entry1, const void *Entry2);
+int __cdecl CompareProcessStats(const void *Entry1, const void *Entry2);
+int __cdecl CompareProcessTotals(const void *Entry1, const void *Entry2);
+void GetSymbolName(ULONG64 Address, PSTR Buffer, size_t BufferSize);
+HRESULT BuildModuleSymbol(PSTR Buffer, size_t BufferSize, PCSTR Module, PCSTR Name);
+HRESULT TraceWalkInitialize(PCSTR Module, PTRACE_WALK Walk);
+ULONG64 ReadModulePointer(PCSTR Module, PCSTR Name);
+HRESULT ZeroModuleTable(PCSTR Module, PCSTR Name, ULONG Size);
+ULONG64 TraceWalkGetEntry(PTRACE_WALK Walk, ULONG64 Index);
+ULONG64 TraceWalkGetCounters(PTRACE_WALK Walk, ULONG64 Index, ULONG Processor);
+BOOL TraceWalkReadTraces(PTRACE_WALK Walk);
+BOOL TraceWalkReadCounters(PTRACE_WALK Walk);
+PUCHAR TraceWalkGetLocalTrace(PTRACE_WALK Walk, ULONG64 Index);
+PUCHAR TraceWalkGetLocalCounters(PTRACE_WALK Walk, ULONG64 Index, ULONG Processor);
+ULONG TraceWalkFieldOffset(PCSTR Type, PCSTR Field);
+ULONG64 LocalField(PUCHAR Base, ULONG Offset, ULONG Size);
+PUCHAR GrowCache(PUCHAR *Cache, ULONG64 *CacheSize, ULONG64 Size);
+HRESULT ZeroSegments(ULONG64 *Segments, ULONG64 InUse, ULONG64 EntrySize);
+void TraceWalkZeroRecursionDepths(PTRACE_WALK Walk);
+ULONG64 TraceWalkGetHistogram(PTRACE_WALK Walk, ULONG64 Index);
+BOOL TraceWalkReadHistogram(PTRACE_WALK Walk, ULONG64 Index, ULONG64 *Buckets);
+BOOL TraceWalkReadIrqlStats(PTRACE_WALK Walk, ULONG64 Index, PFUNC_IRQL_STATS IrqlStats);
+ULONG64 TraceWalkGetSlowCalls(PTRACE_WALK Walk, ULONG64 Index);
+ULONG64 TraceWalkGetStartAddress(PTRACE_WALK Walk, ULONG64 Index);
+ULONG64 TraceWalkFindFunction(PTRACE_WALK Walk, ULONG64 FunctionAddress);
+BOOL GetFunctionModule(PCSTR Function, PSTR Module, size_t ModuleSize);
+ULONG64 ScaleBySampling(ULONG64 Value, ULONG64 CallCount, ULONG64 SampledCount);
+ULONG64 TraceWalkGetTimeline(PTRACE_WALK Walk, ULONG Processor);
+void TraceWalkSumCounters(PTRACE_WALK Walk, ULONG64 Index, ULONG64 *CallCount, ULONG64 *CallTicks, LONG64 *SelfTicks);
+ULONG64 TicksToNs(ULONG64 Ticks, ULONG64 TicksPerSecond);
+ULONG64 HistogramBucketLow(ULONG Bucket);
+ULONG64 HistogramBucketHigh(ULONG Bucket);
+ULONG64 HistogramPercentile(ULONG64 *Buckets, ULONG64 Numerator, ULONG64 Denominator, ULONG64 MaxTicks);
+PCSTR GetModuleArg(PCSTR Args, PSTR Module, size_t ModuleSize);
+BOOL WildcardMatch(PCSTR Pattern, PCSTR String);
+BOOL ParseFilterState(PCSTR Args, ULONG *FilterState);
+PCSTR FilterStateName(ULONG FilterState);
 
 
 /*
-  modulestats <modulename>
+  modulestats <modulename> [-p]
 
-  Print out the module function trace data in CSV format.
+  Print out the module function trace data in CSV format. -p adds
+  latency percentiles from the histograms.
 
 */
 HRESULT CALLBACK
 modulestats(PDEBUG_CLIENT4 Client, PCSTR args)
 {
 
-    ULONG64 funcTracesInUsePtr;
-    ULONG64 funcTracesInUse;
-    ULONG64 funcTracesBase;
-    ULONG64 funcTrace;
-    ULONG64 funcTraceSize;
-    ULONG64 startAddress;
-    ULONG64 callTicks;
-    ULONG   callCount;
-    char    symbolBuffer[512];
-    ULONG64 i;
-    HRESULT hr;
-    ULONG64 ptrSize;
+    TRACE_WALK walk;
+    PUCHAR     funcTrace;
+    PUCHAR     funcCounters;
+    ULONG64    startAddress;
+    ULONG64    callTicks;
+    ULONG64    callCount;
+    ULONG64    sampledCount;
+    ULONG64    descendantCalls;
+    ULONG64    descendantHookOverhead;
+    ULONG64    overheadTicks;
+    ULONG64    compensatedTicks;
+    LONG64     selfTicks;
+    ULONG64    cpuTicks;
+    ULONG64    blockedTicks;
+    ULONG      maxRecursionDepth;
+    ULONG64    maxTicks;
+    ULONG64    shardMaxTicks;
+    ULONG64    buckets[FUNC_HISTOGRAM_BUCKETS];
+    ULONG64    p50;
+    ULONG64    p90;
+    ULONG64    p99;
+    ULONG64    p999;
+    ULONG64    i;
+    ULONG      processor;
+    HRESULT    hr;
+    char       module[256];
+    PCSTR      options;
+    BOOL       percentiles;
 
     UNREFERENCED_PARAMETER(Client);
 
 
-    // 
-    // Figure out the pointer size on the target
-    // 
-    ptrSize = GetExpression("@$ptrsize");
+    options = GetModuleArg(args, module, sizeof(module));
+
+    percentiles = (strstr(options, "-p") != NULL);
 
     //
-    // Generate module!FuncTracesInUse
+    // Find the trace entries and pull them and all of the counters
+    // over
     //
-    memset(symbolBuffer, 0, sizeof(symbolBuffer));
-    hr = StringCbPrintf(symbolBuffer, 
-                        sizeof(symbolBuffer)-1, 
-                        "%s!FuncTracesInUse", 
-                        args);
+    hr = TraceWalkInitialize(module, &walk);
     if (hr != S_OK) {
-        dprintf("String error (0x%x)\n", hr);
         return hr;
     }
 
-    //
-    // Get the pointer value of the FuncTracesInUse global
-    //
-    funcTracesInUsePtr = GetExpression(symbolBuffer);
-
-    //
-    // Read the pointer to get the number of traces in use.
-    //
-    ReadPointer(funcTracesInUsePtr, &funcTracesInUse);
-
-    //
-    // Generate module!FuncTraces
-    //
-    memset(symbolBuffer, 0, sizeof(symbolBuffer));
-    hr = StringCbPrintf(symbolBuffer, 
-                        sizeof(symbolBuffer)-1, 
-                        "%s!FuncTraces", 
-                        args);
-
-    if (hr != S_OK) {
-        dprintf("String error (0x%x)\n", hr);
-        return hr;
+    if (!TraceWalkReadCounters(&walk)) {
+        return S_OK;
     }
 
     //
-    // Get the base address of the func traces array.
+    // Print out the CSV header. Times are in nanoseconds if
+    // we know how fast the time source ticks.
     //
-    funcTracesBase = GetExpression(symbolBuffer);
-
+    // The Compensated columns have the cost of the hooks in
+    // instrumented callees taken back out. The Self columns
+    // leave out the time spent in instrumented callees. Only
+    // the outermost call of a recursion counts towards the
+    // inclusive (Call) time.
     //
-    // Generate module!_FUNC_TRACE
+    // If calls are sampled, the times are estimated from the
+    // SampledCalls calls that were timed.
     //
-    memset(symbolBuffer, 0, sizeof(symbolBuffer));
-    hr = StringCbPrintf(symbolBuffer, 
-                        sizeof(symbolBuffer)-1, 
-                        "%s!_FUNC_TRACE", 
-                        args);
-
-    if (hr != S_OK) {
-        dprintf("String error (0x%x)\n", hr);
-        return hr;
-    }
-
+    // The Cpu column is the part of the inclusive time that the
+    // thread actually ran for, the Blocked column the part that
+    // it didn't. That's mostly waiting, but it also has DPCs and
+    // ISRs that aren't instrumented, the instrumented ones are
+    // already out of the inclusive time. Older builds of the
+    // library don't keep those.
     //
-    // Get the size of the structure
+    // The percentiles are the upper end of the histogram bucket 
+    // that they fall in, so they can be up to 25% high.
     //
-    funcTraceSize = GetTypeSize(symbolBuffer);
-    if (funcTraceSize == 0) {
-        dprintf("Error getting type size\n");
-        return S_OK;
-
+    if (walk.TicksPerSecond != 0) {
+        dprintf("Function,CallCount,CallNs,NsPerCall,"
+                "CompensatedNs,CompensatedNsPerCall,"
+                "SelfNs,SelfNsPerCall,MaxRecursionDepth,SampledCalls");
+        if (walk.HasCpuTicks) {
+            dprintf(",CpuNs,BlockedNs");
+        }
+        if (percentiles) {
+            dprintf(",P50Ns,P90Ns,P99Ns,P99.9Ns,MaxNs");
+        }
+    } else {
+        dprintf("Function,CallCount,CallTicks,TicksPerCall,"
+                "CompensatedTicks,CompensatedTicksPerCall,"
+                "SelfTicks,SelfTicksPerCall,MaxRecursionDepth,SampledCalls");
+        if (walk.HasCpuTicks) {
+            dprintf(",CpuTicks,BlockedTicks");
+        }
+        if (percentiles) {
+            dprintf(",P50Ticks,P90Ticks,P99Ticks,P99.9Ticks,MaxTicks");
+        }
     }
-
-    //
-    // Print out the CSV header.
-    //
-    dprintf("Function,CallCount,CallTicks,TicksPerCall\n");
+    dprintf("\n");
 
     //
     // Loop over all the in use entries and print out the
     // information
     //
-    for (i = 0; i < funcTracesInUse; i++) {
+    for (i = 0; i < walk.FuncTracesInUse; i++) {
         if (CheckControlC()) {
             return S_OK;
         }
 
         //
-        // Calculate the base address of the entry
+        // Find our copy of the entry
         //
-        funcTrace = funcTracesBase + (i * funcTraceSize);
+        funcTrace = TraceWalkGetLocalTrace(&walk, i);
+        if (funcTrace == NULL) {
+            continue;
+        }
 
         //
-        // Set up the pointer so that we can do ReadField calls. This is
-        // the same as an InitTypeRead except we get to pass a string as
-        // the second parameter
+        // Read the start address
         //
-        if (GetShortField(funcTrace, symbolBuffer, 1) != 0) {
-            dprintf("Error in reading FUNC_TRACE at %p\n", funcTrace);
-            return S_OK;
-        }
+        startAddress = TraceWalkGetStartAddress(&walk, i);
+
+        maxRecursionDepth = (ULONG)LocalField(funcTrace, 
+                                              walk.MaxRecursionDepthOffset, 
+                                              sizeof(LONG));
 
         //
-        // Read the start address
+        // The counters are kept separately from the rest of the
+        // trace info, with a copy for every processor. Add them all
+        // up.
         //
-        startAddress = ReadField(StartAddress);
+        callTicks              = 0;
+        callCount              = 0;
+        sampledCount           = 0;
+        descendantCalls        = 0;
+        descendantHookOverhead = 0;
+        selfTicks              = 0;
+        cpuTicks               = 0;
+        maxTicks               = 0;
+
+        for (processor = 0; processor < walk.PerCpuCount; processor++) {
+
+            funcCounters = TraceWalkGetLocalCounters(&walk, i, processor);
+            if (funcCounters == NULL) {
+                break;
+            }
 
-        // 
-        // If the target is 32-bit, we must sign extend
-        // 
-        if (ptrSize == 4) {
+            //
+            // Read the tick count
+            //
+            callTicks += LocalField(funcCounters, walk.CallTicksOffset, sizeof(LONGLONG));
+
+            //
+            // Read the call count
+            //
+            callCount += LocalField(funcCounters, walk.CallCountOffset, sizeof(ULONGLONG));
 
-            startAddress = ((ULONG64)((LONG)(startAddress)));
+            if (walk.HasSampling) {
+                sampledCount += LocalField(funcCounters, walk.SampledCountOffset, sizeof(ULONGLONG));
+            }
 
-        }
+            descendantCalls += LocalField(funcCounters, walk.DescendantCallsOffset, sizeof(ULONGLONG));
 
-        //
-        // Read the tick count
-        //
-        callTicks = ReadField(CallTicks);
+            descendantHookOverhead += LocalField(funcCounters, walk.DescendantHookOverheadOffset, sizeof(ULONGLONG));
 
-        //
-        // Read the call count
-        //
-        callCount = (ULONG)ReadField(CallCount);
+            selfTicks += (LONG64)LocalField(funcCounters, walk.SelfTicksOffset, sizeof(LONGLONG));
+
+            if (walk.HasCpuTicks) {
+                cpuTicks += LocalField(funcCounters, walk.CpuTicksOffset, sizeof(ULONGLONG));
+            }
+
+            shardMaxTicks = LocalField(funcCounters, walk.MaxTicksOffset, sizeof(ULONGLONG));
+            if (shardMaxTicks > maxTicks) {
+                maxTicks = shardMaxTicks;
+            }
+
+        }
 
         if (callCount == 0) {
 
@@ -205,6 +391,79 @@ modulestats(PDEBUG_CLIENT4 Client, PCSTR args)
 
         }
 
+        //
+        // Take out the hooks of everything that we called. This
+        // is an estimate, don't let it go negative. The library
+        // adds up what they cost, older builds only counted the 
+        // calls and had a single cost for all of them. Whichever
+        // field the module doesn't have reads as zero.
+        //
+        overheadTicks = ((descendantCalls * walk.HookOverhead) + 
+                         descendantHookOverhead) / HOOK_OVERHEAD_CALLS;
+
+        if (overheadTicks < callTicks) {
+            compensatedTicks = callTicks - overheadTicks;
+        } else {
+            compensatedTicks = 0;
+        }
+
+        //
+        // Self time can come out a hair below zero if the clocks
+        // of the processors don't quite agree
+        //
+        if (selfTicks < 0) {
+            selfTicks = 0;
+        }
+
+        //
+        // Whatever the thread didn't run for it spent blocked, 
+        // waiting for a processor or under an uninstrumented DPC or 
+        // ISR
+        //
+        if (cpuTicks < callTicks) {
+            blockedTicks = callTicks - cpuTicks;
+        } else {
+            blockedTicks = 0;
+        }
+
+        //
+        // Scale the sampled times up to all of the calls
+        //
+        if (!walk.HasSampling) {
+            sampledCount = callCount;
+        }
+
+        callTicks        = ScaleBySampling(callTicks, callCount, sampledCount);
+        compensatedTicks = ScaleBySampling(compensatedTicks, callCount, sampledCount);
+        selfTicks        = (LONG64)ScaleBySampling((ULONG64)selfTicks, callCount, sampledCount);
+        cpuTicks         = ScaleBySampling(cpuTicks, callCount, sampledCount);
+        blockedTicks     = ScaleBySampling(blockedTicks, callCount, sampledCount);
+
+        p50  = 0;
+        p90  = 0;
+        p99  = 0;
+        p999 = 0;
+
+        if (percentiles && TraceWalkReadHistogram(&walk, i, buckets)) {
+            p50  = HistogramPercentile(buckets, 50, 100, maxTicks);
+            p90  = HistogramPercentile(buckets, 90, 100, maxTicks);
+            p99  = HistogramPercentile(buckets, 99, 100, maxTicks);
+            p999 = HistogramPercentile(buckets, 999, 1000, maxTicks);
+        }
+
+        if (walk.TicksPerSecond != 0) {
+            callTicks        = TicksToNs(callTicks, walk.TicksPerSecond);
+            compensatedTicks = TicksToNs(compensatedTicks, walk.TicksPerSecond);
+            selfTicks        = (LONG64)TicksToNs((ULONG64)selfTicks, walk.TicksPerSecond);
+            cpuTicks         = TicksToNs(cpuTicks, walk.TicksPerSecond);
+            blockedTicks     = TicksToNs(blockedTicks, walk.TicksPerSecond);
+            p50              = TicksToNs(p50, walk.TicksPerSecond);
+            p90              = TicksToNs(p90, walk.TicksPerSecond);
+            p99              = TicksToNs(p99, walk.TicksPerSecond);
+            p999             = TicksToNs(p999, walk.TicksPerSecond);
+            maxTicks         = TicksToNs(maxTicks, walk.TicksPerSecond);
+        }
+
         //
         // Get the symbol name for the start address and print it out.
         //
@@ -213,7 +472,33 @@ modulestats(PDEBUG_CLIENT4 Client, PCSTR args)
         //
         // And print out the other fields.
         //
-        dprintf(",%d,%I64d,%I64d\n", callCount, callTicks, (callTicks/callCount));
+        dprintf(",%I64d,%I64d,%I64d,%I64d,%I64d,%I64d,%I64d,%d,%I64d", 
+                callCount, 
+                callTicks, 
+                (callTicks/callCount),
+                compensatedTicks,
+                (compensatedTicks/callCount),
+                selfTicks,
+                (selfTicks/(LONG64)callCount),
+                maxRecursionDepth,
+                sampledCount);
+
+        if (walk.HasCpuTicks) {
+            dprintf(",%I64d,%I64d", 
+                    cpuTicks, 
+                    blockedTicks);
+        }
+
+        if (percentiles) {
+            dprintf(",%I64d,%I64d,%I64d,%I64d,%I64d", 
+                    p50, 
+                    p90, 
+                    p99, 
+                    p999, 
+                    maxTicks);
+        }
+
+        dprintf("\n");
 
     }
 
@@ -230,510 +515,3703 @@ modulestats(PDEBUG_CLIENT4 Client, PCSTR args)
 HRESULT CALLBACK
 resettrace(PDEBUG_CLIENT4 Client, PCSTR args)
 {
-    ULONG64 funcTracesInUsePtr;
-    ULONG64 funcTracesInUse;
-    ULONG64 funcTracesBase;
-    ULONG64 funcTrace;
-    ULONG64 funcTraceSize;
-    ULONG   callTicksOffset;
-    ULONG   callCountOffset;
-    char    symbolBuffer[512];
-    ULONG64 i;
-    HRESULT hr;
-    ULONG64 ptrSize;
+    TRACE_WALK walk;
+    ULONG64    timeline;
+    LONG64     zeroNext = 0;
+    char       symbolBuffer[512];
+    ULONG64    currentEpochPtr;
+    LONG       currentEpochVal = 0;
+    ULONG64    processStatsOverflowPtr;
+    PROCESS_STATS zeroProcessStats;
+    ULONG      processor;
+    HRESULT    hr;
 
     UNREFERENCED_PARAMETER(Client);
 
 
-    // 
-    // Figure out the pointer size on the target
-    // 
-    ptrSize = GetExpression("@$ptrsize");
-
     //
-    // Generate module!FuncTracesInUse
+    // Find the trace entries
     //
-    memset(symbolBuffer, 0, sizeof(symbolBuffer));
-    hr = StringCbPrintf(symbolBuffer, 
-                        sizeof(symbolBuffer)-1, 
-                        "%s!FuncTracesInUse", 
-                        args);
+    hr = TraceWalkInitialize(args, &walk);
     if (hr != S_OK) {
-        dprintf("String error (0x%x)\n", hr);
         return hr;
     }
 
     //
-    // Get the pointer value of the FuncTracesInUse global
+    // Zero down every processor's counters, the per IRQL counters, the 
+    // histograms and the slow calls of all of the in use entries. 
+    // Everything in them gets reset, so just write the whole thing. The 
+    // in use entries of a segment are next to each other, so that's one 
+    // write per segment (per processor for the counters) and not one per
+    // entry.
     //
-    funcTracesInUsePtr = GetExpression(symbolBuffer);
+    for (processor = 0; processor < walk.PerCpuCount; processor++) {
 
-    //
-    // Read the pointer to get the number of traces in use.
-    //
-    ReadPointer(funcTracesInUsePtr, &funcTracesInUse);
+        hr = ZeroSegments(&walk.CounterSegments[(ULONG64)processor * MAX_FUNC_TRACE_SEGMENTS], 
+                          walk.FuncTracesInUse, 
+                          walk.FuncCountersSize);
+        if (hr != S_OK) {
+            return hr;
+        }
 
-    //
-    // Generate module!FuncTraces
-    //
-    memset(symbolBuffer, 0, sizeof(symbolBuffer));
-    hr = StringCbPrintf(symbolBuffer, 
-                        sizeof(symbolBuffer)-1, 
-                        "%s!FuncTraces", 
-                        args);
+    }
 
+    hr = ZeroSegments(walk.IrqlSegments, 
+                      walk.FuncTracesInUse, 
+                      sizeof(FUNC_IRQL_STATS));
     if (hr != S_OK) {
-        dprintf("String error (0x%x)\n", hr);
         return hr;
     }
 
-    //
-    // Get the base address of the func traces array.
-    //
-    funcTracesBase = GetExpression(symbolBuffer);
-
-    //
-    // Generate module!_FUNC_TRACE
-    //
-    memset(symbolBuffer, 0, sizeof(symbolBuffer));
-    hr = StringCbPrintf(symbolBuffer, 
-                        sizeof(symbolBuffer)-1, 
-                        "%s!_FUNC_TRACE", 
-                        args);
+    hr = ZeroSegments(walk.HistogramSegments, 
+                      walk.FuncTracesInUse, 
+                      sizeof(FUNC_HISTOGRAM));
+    if (hr != S_OK) {
+        return hr;
+    }
 
+    hr = ZeroSegments(walk.SlowCallsSegments, 
+                      walk.FuncTracesInUse, 
+                      sizeof(FUNC_SLOW_CALLS));
     if (hr != S_OK) {
-        dprintf("String error (0x%x)\n", hr);
         return hr;
     }
 
     //
-    // Get the size of the structure
+    // The deepest recursion lives in the trace entries themselves, 
+    // which hold a lot more than counts. Just that field gets reset.
     //
-    funcTraceSize = GetTypeSize(symbolBuffer);
-    if (funcTraceSize == 0) {
-        dprintf("Error getting type size\n");
-        return S_OK;
-
-    }
+    TraceWalkZeroRecursionDepths(&walk);
 
     //
-    // Loop over all the in use entries and zero down the
-    // call count and tick count
+    // Empty out the call edge table, the calling-context tree and the 
+    // per process table. This throws away the entries too, not just 
+    // their counts, they'll come back on the next call.
     //
-    for (i = 0; i < funcTracesInUse; i++) {
-
-        //
-        // Calculate the base address of the entry
-        //
-        funcTrace = funcTracesBase + (i * funcTraceSize);
-
-        // 
-        // And zero out the fields 
-        //  
-        GetFieldOffset(symbolBuffer, "CallTicks", &callTicksOffset);
-        GetFieldOffset(symbolBuffer, "CallCount", &callCountOffset);
-
-        WritePointer((funcTrace + callTicksOffset), 0);
-        WritePointer((funcTrace + callCountOffset), 0);
+    hr = ZeroModuleTable(args, "CallEdgeTable", CALL_EDGE_TABLE_SIZE * sizeof(CALL_EDGE));
+    if (hr != S_OK) {
+        return hr;
+    }
 
+    hr = ZeroModuleTable(args, "CallTree", CALL_TREE_SIZE * sizeof(CALL_TREE_NODE));
+    if (hr != S_OK) {
+        return hr;
     }
 
-    dprintf("Module tracing reset.\n");
-    return S_OK;
-}
+    hr = ZeroModuleTable(args, "ProcessStatsTable", PROCESS_STATS_SIZE * sizeof(PROCESS_STATS));
+    if (hr != S_OK) {
+        return hr;
+    }
 
-HRESULT CALLBACK
-callstacks(PDEBUG_CLIENT4 Client, PCSTR args)
-{
+    hr = BuildModuleSymbol(symbolBuffer, sizeof(symbolBuffer), args, "ProcessStatsOverflow");
+    if (hr != S_OK) {
+        return hr;
+    }
 
-    ULONG64 funcTracesInUsePtr;
-    ULONG64 funcTracesInUse;
-    ULONG64 funcTracesBase;
-    ULONG64 funcTrace;
-    ULONG64 funcTraceSize;
-    ULONG64 startAddress;
-    char    symbolBuffer[512];
-    char    funcTraceSymName[512];
-    char    callHistorySymName[512];
-    ULONG64 i;
-    ULONG64 j;
-    ULONG64 callIndex;
-    ULONG64 callTotal;
-    ULONG64 callHistoryBase;
-    ULONG64 callHistory;
-    ULONG64 callHistorySize;
-    ULONG64 frames;
-    ULONG64 framesCount;
-    ULONG64 frameAddress;
-    ULONG64 framesIndex;
-    ULONG64 stackSeenCount;
-    ULONG64 totalInvocations;
-    HRESULT hr;
-    ULONG64 currentEpochPtr;
-    LONG    currentEpochVal = 0;
-    LONG    epoch;
-    ULONG   ptrSize;
+    processStatsOverflowPtr = GetExpression(symbolBuffer);
 
-    UNREFERENCED_PARAMETER(Client);
+    if (processStatsOverflowPtr != 0) {
+        memset(&zeroProcessStats, 0, sizeof(zeroProcessStats));
 
-    // 
-    // Figure out the pointer size on the target
-    // 
-    if (IsPtr64()) {
-        ptrSize = 8;
-    } else {
-        ptrSize = 4;
-    }   
+        WriteMemory(processStatsOverflowPtr, 
+                    &zeroProcessStats, 
+                    sizeof(zeroProcessStats), 
+                    NULL);
+    }
 
     //
-    // Generate module!FuncTracesInUse
+    // Empty the timelines. Just resetting the count is enough, the 
+    // old events are never looked at again.
     //
-    memset(symbolBuffer, 0, sizeof(symbolBuffer));
-    hr = StringCbPrintf(symbolBuffer, 
-                        sizeof(symbolBuffer)-1, 
-                        "%s!FuncTracesInUse", 
-                        args); 
-    if (hr != S_OK) {
-        dprintf("String error (0x%x)\n", hr);
-        return hr;
-    }
+    for (processor = 0; processor < walk.PerCpuCount; processor++) {
 
+        timeline = TraceWalkGetTimeline(&walk, processor);
+        if (timeline == 0) {
+            continue;
+        }
 
-    //
-    // Get the pointer value of the FuncTracesInUse global
-    //
-    funcTracesInUsePtr = GetExpression(symbolBuffer);
+        WriteMemory(timeline, 
+                    &zeroNext, 
+                    sizeof(zeroNext), 
+                    NULL);
 
-    //
-    // Read the pointer to get the number of traces in use.
-    //
-    ReadPointer(funcTracesInUsePtr, &funcTracesInUse);
+    }
 
     //
-    // Generate module!CurrentEpoch
+    // Bump the epoch, this throws away the stack histories. The
+    // library resets each one the next time it records a stack.
     //
-    memset(symbolBuffer, 0, sizeof(symbolBuffer));
-    hr = StringCbPrintf(symbolBuffer, 
-                        sizeof(symbolBuffer)-1, 
-                        "%s!CurrentEpoch", 
-                        args);
+    hr = BuildModuleSymbol(symbolBuffer, sizeof(symbolBuffer), args, "CurrentEpoch");
     if (hr != S_OK) {
-        dprintf("String error (0x%x)\n", hr);
         return hr;
     }
 
-    //
-    // Get the pointer value of the CurrentEpoch global
-    //
     currentEpochPtr = GetExpression(symbolBuffer);
 
     if (currentEpochPtr != 0) {
-        //
-        // Read the pointer to get the current epoch
-        //
         ReadMemory(currentEpochPtr, 
                    &currentEpochVal,
                    sizeof(LONG),
                    NULL);
-    }
 
+        currentEpochVal++;
 
-    //
-    // Generate module!FuncTraces
-    //
-    memset(symbolBuffer, 0, sizeof(symbolBuffer));
-    hr = StringCbPrintf(symbolBuffer, 
-                        sizeof(symbolBuffer)-1, 
-                        "%s!FuncTraces", 
-                        args); 
-    if (hr != S_OK) {
-        dprintf("String error (0x%x)\n", hr);
-        return hr;
+        WriteMemory(currentEpochPtr, 
+                    &currentEpochVal,
+                    sizeof(LONG),
+                    NULL);
     }
 
+    dprintf("Module tracing reset.\n");
+    return S_OK;
+}
+
+/*
+  histogram <modulename>!<function>
 
-    //
-    // Get the base address of the func traces array.
-    //
-    funcTracesBase = GetExpression(symbolBuffer);
+  Print out the latency histogram of a single function in CSV format.
 
-    //
-    // Generate module!_FUNC_TRACE
-    //
-    memset(funcTraceSymName, 0, sizeof(funcTraceSymName));
-    hr = StringCbPrintf(funcTraceSymName, 
-                        sizeof(funcTraceSymName)-1, 
-                        "%s!_FUNC_TRACE", 
-                        args);
-    if (hr != S_OK) {
-        dprintf("String error (0x%x)\n", hr);
-        return hr;
-    }
+*/
+HRESULT CALLBACK
+histogram(PDEBUG_CLIENT4 Client, PCSTR args)
+{
+    TRACE_WALK walk;
+    ULONG64    funcCounters;
+    ULONG64    functionAddress;
+    ULONG64    buckets[FUNC_HISTOGRAM_BUCKETS];
+    ULONG64    total;
+    ULONG64    cumulative;
+    ULONG64    low;
+    ULONG64    high;
+    ULONG64    maxTicks;
+    ULONG64    shardMaxTicks;
+    ULONG64    i;
+    ULONG      bucket;
+    ULONG      processor;
+    char       function[256];
+    char       module[256];
+    HRESULT    hr;
+
+    UNREFERENCED_PARAMETER(Client);
 
 
-    //
-    // Get the size of the structure
-    //
-    funcTraceSize = GetTypeSize(funcTraceSymName);
-    if (funcTraceSize == 0) {
-        dprintf("Error getting type size\n");
+    GetModuleArg(args, function, sizeof(function));
+
+    if (!GetFunctionModule(function, module, sizeof(module))) {
+        dprintf("Usage: !histogram <module>!<function>\n");
         return S_OK;
+    }
 
+    functionAddress = GetExpression(function);
+    if (functionAddress == 0) {
+        dprintf("Can't resolve %s\n", function);
+        return S_OK;
     }
 
     //
-    // Generate module!_CALL_HISTORY
+    // Find the trace entries
     //
-    memset(callHistorySymName, 0, sizeof(callHistorySymName));
-    hr = StringCbPrintf(callHistorySymName, 
-                        sizeof(callHistorySymName)-1, 
-                        "%s!_CALL_HISTORY", 
-                        args);
+    hr = TraceWalkInitialize(module, &walk);
     if (hr != S_OK) {
-        dprintf("String error (0x%x)\n", hr);
         return hr;
     }
 
-
-    //
-    // Get the size of the structure
-    //
-    callHistorySize = GetTypeSize(callHistorySymName);
-    if (callHistorySize == 0) {
-        dprintf("Error getting type size\n");
+    i = TraceWalkFindFunction(&walk, functionAddress);
+    if (i == walk.FuncTracesInUse) {
+        dprintf("%s has not been called\n", function);
         return S_OK;
+    }
 
+    if (!TraceWalkReadHistogram(&walk, i, buckets)) {
+        dprintf("No histogram for %s\n", function);
+        return S_OK;
     }
 
-    //
-    // Loop over all the in use entries and print out the
-    // information
-    //
-    for (i = 0; i < funcTracesInUse; i++) {
-        if (CheckControlC()) {
-            return S_OK;
+    maxTicks = 0;
+
+    for (processor = 0; processor < walk.PerCpuCount; processor++) {
+
+        funcCounters = TraceWalkGetCounters(&walk, i, processor);
+        if ((funcCounters == 0) || (walk.MaxTicksOffset == TRACE_FIELD_MISSING)) {
+            break;
         }
 
         //
-        // Calculate the base address of the entry
+        // Only need the one field, don't pull the whole thing over
         //
-        funcTrace = funcTracesBase + (i * funcTraceSize);
+        shardMaxTicks = 0;
 
-        //
-        // Set up the pointer so that we can do ReadField calls. This is
-        // the same as an InitTypeRead except we get to pass a string as
-        // the second parameter
-        //
-        if (GetShortField(funcTrace, funcTraceSymName, 1) != 0) {
-            dprintf("Error in reading FUNC_TRACE at %p\n", funcTrace);
-            return S_OK;
+        ReadMemory(funcCounters + walk.MaxTicksOffset, 
+                   &shardMaxTicks, 
+                   sizeof(ULONG64), 
+                   NULL);
+
+        if (shardMaxTicks > maxTicks) {
+            maxTicks = shardMaxTicks;
+        }
+
+    }
+
+    total = 0;
+    for (bucket = 0; bucket < FUNC_HISTOGRAM_BUCKETS; bucket++) {
+        total += buckets[bucket];
+    }
+
+    if (total == 0) {
+        dprintf("%s has not been called\n", function);
+        return S_OK;
+    }
+
+    if (walk.TicksPerSecond != 0) {
+        dprintf("LowNs,HighNs,Count,CumulativePercent\n");
+    } else {
+        dprintf("LowTicks,HighTicks,Count,CumulativePercent\n");
+    }
+
+    cumulative = 0;
+
+    for (bucket = 0; bucket < FUNC_HISTOGRAM_BUCKETS; bucket++) {
+
+        if (buckets[bucket] == 0) {
+            continue;
         }
 
+        cumulative += buckets[bucket];
+
         //
-        // Read the start address
+        // Don't claim an upper end beyond the longest call seen
         //
-        startAddress = ReadField(StartAddress);
+        low  = HistogramBucketLow(bucket);
+        high = HistogramBucketHigh(bucket);
 
-        // 
-        // Current index in the history
-        // 
-        callIndex = ReadField(CallHistoryIndex);
+        if ((maxTicks != 0) && (high > maxTicks)) {
+            high = maxTicks;
+        }
 
-        // 
-        // Total history buffers
-        // 
-        callTotal = ReadField(CallHistoryTotal);
+        if (walk.TicksPerSecond != 0) {
+            low  = TicksToNs(low, walk.TicksPerSecond);
+            high = TicksToNs(high, walk.TicksPerSecond);
+        }
 
-        // 
-        // And the address of the structures...
-        // 
-        callHistoryBase = ReadField(CallHistory);
+        dprintf("%I64d,%I64d,%I64d,%I64d.%02I64d\n",
+                low,
+                high,
+                buckets[bucket],
+                (cumulative * 100) / total,
+                ((cumulative * 10000) / total) % 100);
+
+    }
+
+    return S_OK;
+}
+
+/*
+  slowcalls <modulename>
+
+  Print out the slowest calls of each function in the module in CSV format.
+
+*/
+HRESULT CALLBACK
+slowcalls(PDEBUG_CLIENT4 Client, PCSTR args)
+{
+    TRACE_WALK      walk;
+    ULONG64         funcTrace;
+    ULONG64         funcSlowCalls;
+    FUNC_SLOW_CALLS slowCalls;
+    ULONG64         startAddress;
+    ULONG64         ticks;
+    ULONG64         i;
+    LONG            entriesCount;
+    LONG            j;
+    ULONG           bytesRead;
+    HRESULT         hr;
+
+    UNREFERENCED_PARAMETER(Client);
+
+
+    //
+    // Find the trace entries
+    //
+    hr = TraceWalkInitialize(args, &walk);
+    if (hr != S_OK) {
+        return hr;
+    }
+
+    //
+    // StartTicks is the raw time source value, which lines up with
+    // KeQueryPerformanceCounter or RDTSC on the target depending on
+    // the time source.
+    //
+    if (walk.TicksPerSecond != 0) {
+        dprintf("Function,Ns,StartTicks,ThreadId,ProcessId,Processor,Irql\n");
+    } else {
+        dprintf("Function,Ticks,StartTicks,ThreadId,ProcessId,Processor,Irql\n");
+    }
+
+    for (i = 0; i < walk.FuncTracesInUse; i++) {
+
+        funcTrace     = TraceWalkGetEntry(&walk, i);
+        funcSlowCalls = TraceWalkGetSlowCalls(&walk, i);
+        if ((funcTrace == 0) || (funcSlowCalls == 0)) {
+            continue;
+        }
 
         //
-        // Get the symbol name for the start address and print it out.
+        // The whole thing is only a few hundred bytes, read it
+        // in one go
         //
-        DumpSymbol64(startAddress);
+        if (!ReadMemory(funcSlowCalls, 
+                        &slowCalls, 
+                        sizeof(slowCalls), 
+                        &bytesRead) ||
+            (bytesRead != sizeof(slowCalls))) {
+            dprintf("Error reading slow calls at %p\n", funcSlowCalls);
+            continue;
+        }
 
-        dprintf("\n");
+        entriesCount = slowCalls.EntriesCount;
+        if ((entriesCount <= 0) || (entriesCount > MAX_SLOW_CALLS)) {
+            continue;
+        }
 
-        totalInvocations = 0;
+        qsort(slowCalls.Entries, 
+              entriesCount, 
+              sizeof(SLOW_CALL), 
+              CompareSlowCalls);
 
-        if (callTotal > callIndex) {
-            //
-            // We've wrapped around our circular buffer...So, first we'll
-            // print index->max, then do 0->(index-1)
-            //
-            for (j = callIndex; j < MAX_CALL_HISTORY; j++) {
+        startAddress = TraceWalkGetStartAddress(&walk, i);
 
-                if (CheckControlC()) {
-                    return S_OK;
-                }
+        for (j = 0; j < entriesCount; j++) {
 
-                callHistory = callHistoryBase + (j * callHistorySize);
+            DumpSymbol64(startAddress);
 
-                if (GetShortField(callHistory, callHistorySymName, 1) != 0) {
-                    dprintf("Error in reading _CALL_HISTORY at %p\n", 
-                            callHistory);
-                    return S_OK;
-                }
+            ticks = slowCalls.Entries[j].Ticks;
 
-                if (currentEpochPtr != 0) {
-                    // 
-                    // Get the epoch
-                    // 
-                    epoch = (ULONG)ReadField(Epoch);
-    
-                    // 
-                    // If this isn't a valid entry (i.e. taken before the last
-                    // reset), then skip it
-                    // 
-                    if (epoch != currentEpochVal) {
-                        continue;
-                    }
-                }
+            if (walk.TicksPerSecond != 0) {
+                ticks = TicksToNs(ticks, walk.TicksPerSecond);
+            }
+
+            dprintf(",%I64d,%I64d,0x%I64x,0x%I64x,%d,%d\n",
+                    ticks,
+                    slowCalls.Entries[j].StartTicks,
+                    slowCalls.Entries[j].ThreadId,
+                    slowCalls.Entries[j].ProcessId,
+                    slowCalls.Entries[j].Processor,
+                    slowCalls.Entries[j].Irql);
+
+        }
+
+        if (CheckControlC()) {
+            break;
+        }
 
-                frames = ReadField(Frames);
+    }
 
-                framesCount = ReadField(FramesCount);
+    return S_OK;
+}
 
-                stackSeenCount = ReadField(StackSeenCount);
-                
-                totalInvocations += stackSeenCount;
+/*
+  irqlstats <modulename>
 
-                dprintf("Stack - Occurred %d times:\n", stackSeenCount);
-                for (framesIndex = 0; framesIndex < framesCount; framesIndex++) {
+  Print out the function trace data broken down by the IRQL that the
+  calls were entered at, in CSV format. The last IRQL covers everything
+  above DISPATCH_LEVEL.
 
-                    ReadPointer((frames + (ptrSize * framesIndex)),
-                                &frameAddress);
+*/
+HRESULT CALLBACK
+irqlstats(PDEBUG_CLIENT4 Client, PCSTR args)
+{
+    TRACE_WALK         walk;
+    PUCHAR             funcCounters;
+    ULONG64            startAddress;
+    ULONG64            callCount[FUNC_IRQL_CLASSES];
+    ULONG64            sampledCount[FUNC_IRQL_CLASSES];
+    LONG64             callTicks[FUNC_IRQL_CLASSES];
+    LONG64             selfTicks[FUNC_IRQL_CLASSES];
+    FUNC_IRQL_STATS    irqlStats;
+    ULONG64            scaledCallTicks;
+    ULONG64            scaledSelfTicks;
+    ULONG64            i;
+    ULONG              processor;
+    ULONG              irql;
+    HRESULT            hr;
 
-                    dprintf("\t");
-                    DumpSymbol64(frameAddress);
-                    dprintf("\n");
+    UNREFERENCED_PARAMETER(Client);
 
-                }
-                dprintf("\n");
 
-            }
+    hr = TraceWalkInitialize(args, &walk);
+    if (hr != S_OK) {
+        return hr;
+    }
+
+    if ((walk.FuncTracesInUse != 0) && (walk.IrqlSegments[0] == 0)) {
+        dprintf("Module doesn't keep per IRQL counters\n");
+        return S_OK;
+    }
+
+    if (!TraceWalkReadCounters(&walk)) {
+        return S_OK;
+    }
+
+    //
+    // Same columns as modulestats. Instrumented DPCs and ISRs that came
+    // in on top of a call are left out of its time.
+    //
+    if (walk.TicksPerSecond != 0) {
+        dprintf("Function,Irql,CallCount,CallNs,NsPerCall,SelfNs,SelfNsPerCall,SampledCalls\n");
+    } else {
+        dprintf("Function,Irql,CallCount,CallTicks,TicksPerCall,SelfTicks,SelfTicksPerCall,SampledCalls\n");
+    }
+
+    for (i = 0; i < walk.FuncTracesInUse; i++) {
+
+        if (CheckControlC()) {
+            break;
         }
 
-        for (j = 0; j < callIndex; j++) {
-            if (CheckControlC()) {
-                return S_OK;
-            }
+        memset(callCount, 0, sizeof(callCount));
+        memset(sampledCount, 0, sizeof(sampledCount));
+        memset(callTicks, 0, sizeof(callTicks));
+        memset(selfTicks, 0, sizeof(selfTicks));
 
-            callHistory = callHistoryBase + (j * callHistorySize);
+        //
+        // The totals go in the PASSIVE_LEVEL slot first
+        //
+        for (processor = 0; processor < walk.PerCpuCount; processor++) {
 
-            if (GetShortField(callHistory, callHistorySymName, 1) != 0) {
-                dprintf("Error in reading _CALL_HISTORY at %p\n", 
-                        callHistory);
-                return S_OK;
+            funcCounters = TraceWalkGetLocalCounters(&walk, i, processor);
+            if (funcCounters == NULL) {
+                break;
             }
 
-            if (currentEpochPtr != 0) {
-                // 
-                // Get the epoch
-                // 
-                epoch = (ULONG)ReadField(Epoch);
-    
-                // 
-                // If this isn't a valid entry (i.e. taken before the last
-                // reset), then skip it
-                // 
-                if (epoch != currentEpochVal) {
-                    continue;
-                }
-            }
+            callCount[0]    += LocalField(funcCounters, walk.CallCountOffset, sizeof(ULONGLONG));
+            sampledCount[0] += LocalField(funcCounters, walk.SampledCountOffset, sizeof(ULONGLONG));
+            callTicks[0]    += (LONG64)LocalField(funcCounters, walk.CallTicksOffset, sizeof(LONGLONG));
+            selfTicks[0]    += (LONG64)LocalField(funcCounters, walk.SelfTicksOffset, sizeof(LONGLONG));
 
-            frames = ReadField(Frames);
+        }
 
-            framesCount = ReadField(FramesCount);
+        if (callCount[0] == 0) {
+            continue;
+        }
 
-            stackSeenCount = ReadField(StackSeenCount);
+        //
+        // The module only keeps the classes above PASSIVE_LEVEL, the 
+        // PASSIVE_LEVEL calls are whatever is left of the totals
+        //
+        TraceWalkReadIrqlStats(&walk, i, &irqlStats);
 
-            totalInvocations += stackSeenCount;
+        for (irql = 1; irql < FUNC_IRQL_CLASSES; irql++) {
 
-            // 
-            // And the epoch
-            // 
-            epoch = (ULONG)ReadField(Epoch);
+            callCount[irql]    = (ULONG64)irqlStats.Irql[irql - 1].CallCount;
+            sampledCount[irql] = (ULONG64)irqlStats.Irql[irql - 1].SampledCount;
+            callTicks[irql]    = irqlStats.Irql[irql - 1].CallTicks;
+            selfTicks[irql]    = irqlStats.Irql[irql - 1].SelfTicks;
 
-            // 
-            // If this isn't a valid entry (i.e. taken before the last
-            // reset), then skip it
-            // 
-            if (epoch != currentEpochVal) {
+            callCount[0]    -= callCount[irql];
+            sampledCount[0] -= sampledCount[irql];
+            callTicks[0]    -= callTicks[irql];
+            selfTicks[0]    -= selfTicks[irql];
+
+        }
+
+        //
+        // The two are updated separately, so a call that's being 
+        // counted right now can be in one and not the other
+        //
+        if ((LONG64)callCount[0] < 0) {
+            callCount[0] = 0;
+        }
+
+        if ((LONG64)sampledCount[0] < 0) {
+            sampledCount[0] = 0;
+        }
+
+        startAddress = TraceWalkGetStartAddress(&walk, i);
+
+        for (irql = 0; irql < FUNC_IRQL_CLASSES; irql++) {
+
+            if (callCount[irql] == 0) {
                 continue;
             }
 
-            dprintf("Stack - Occurred %d times:\n", stackSeenCount);
-
-            for (framesIndex = 0; framesIndex < framesCount; framesIndex++) {
+            if (callTicks[irql] < 0) {
+                callTicks[irql] = 0;
+            }
 
-                ReadPointer((frames + (ptrSize * framesIndex)),
-                            &frameAddress);
+            if (selfTicks[irql] < 0) {
+                selfTicks[irql] = 0;
+            }
 
-                dprintf("\t");
-                DumpSymbol64(frameAddress);
-                dprintf("\n");
+            scaledCallTicks = ScaleBySampling((ULONG64)callTicks[irql], 
+                                              callCount[irql], 
+                                              sampledCount[irql]);
+            scaledSelfTicks = ScaleBySampling((ULONG64)selfTicks[irql], 
+                                              callCount[irql], 
+                                              sampledCount[irql]);
 
+            if (walk.TicksPerSecond != 0) {
+                scaledCallTicks = TicksToNs(scaledCallTicks, walk.TicksPerSecond);
+                scaledSelfTicks = TicksToNs(scaledSelfTicks, walk.TicksPerSecond);
             }
-            dprintf("\n");
-        }
 
-        dprintf("%d invocations total\n", totalInvocations);
-        dprintf("*****************************************************\n");
-        dprintf("-----------------------------------------------------\n");
-        dprintf("\n\n");
+            DumpSymbol64(startAddress);
+
+            dprintf(",%s,%I64d,%I64d,%I64d,%I64d,%I64d,%I64d\n",
+                    (irql == FUNC_IRQL_CLASSES - 1) ? "DIRQL" : 
+                        (irql == 2) ? "DISPATCH" : 
+                        (irql == 1) ? "APC" : "PASSIVE",
+                    callCount[irql],
+                    scaledCallTicks,
+                    scaledCallTicks / callCount[irql],
+                    scaledSelfTicks,
+                    scaledSelfTicks / callCount[irql],
+                    sampledCount[irql]);
+
+        }
 
     }
 
     return S_OK;
 }
 
-
 /*
-  A built-in help for the extension dll
+  processstats <modulename> [count]
+
+  Print out the time spent in the module by each process, most first, in
+  CSV format. Only the first count processes are printed if given. The
+  module only counts calls by process while ProcessStatsEnabled is set.
+
 */
 HRESULT CALLBACK
-help(PDEBUG_CLIENT4 Client, PCSTR args)
+processstats(PDEBUG_CLIENT4 Client, PCSTR args)
 {
-    INIT_API();
+    TRACE_WALK      walk;
+    char            module[256];
+    char            symbolBuffer[512];
+    char            functionName[256];
+    PCSTR           options;
+    ULONG64         processStatsTable;
+    ULONG64         overflowAddress;
+    ULONG64         enabledAddress;
+    ULONG           enabled;
+    PPROCESS_STATS  entries;
+    ULONG           entriesCount;
+    PROCESS_STATS   overflow;
+    PPROCESS_TOTAL  totals;
+    ULONG           totalsCount;
+    ULONG           maxCount;
+    ULONG           bytesRead;
+    ULONG           processId;
+    ULONG           j;
+    LONG64          selfTicks;
+    ULONG64         scaledTicks;
+    ULONG64         ticks;
+    ULONG64         topTicks;
+    HRESULT         hr;
 
-    UNREFERENCED_PARAMETER(args);
+    UNREFERENCED_PARAMETER(Client);
 
-    dprintf("Help for penterexts.dll\n"
-            "  modulestats <module> - Display the function stats for module\n"
-            "  callstacks  <module> - Display the call stack stats\n"
-            "  resettrace  <module> - Reset the function stats for module\n"
-            "  help                 - Shows this help\n"
-            );
-    EXIT_API();
 
-    return S_OK;
-}
+    options = GetModuleArg(args, module, sizeof(module));
 
-//
-// DumpSymbol
-//
-//  Find the symbol closest to Address and 
-//   display it.
-//
-void DumpSymbol64(ULONG64 Address) {
+    while ((*options == ' ') || (*options == '\t')) {
+        options++;
+    }
 
-    char    symbolBuffer[512];
-    ULONG64 offset;
+    //
+    // Always decimal, it's a count and not an address
+    //
+    maxCount = 0;
 
-    GetSymbol(Address, symbolBuffer, &offset);
-    if (symbolBuffer[0] != '\0') {
-        
-        dprintf("%s", symbolBuffer);
-        
-    } else {
+    if (*options != '\0') {
+        maxCount = strtoul(options, NULL, 10);
+    }
 
-        dprintf("%p", Address);
+    //
+    // Find the trace entries, we need them for the function names
+    //
+    hr = TraceWalkInitialize(module, &walk);
+    if (hr != S_OK) {
+        return hr;
+    }
 
+    //
+    // Get the table. If it's not there the module was built with an
+    // older library or the table couldn't be allocated
+    //
+    processStatsTable = ReadModulePointer(module, "ProcessStatsTable");
+    if (processStatsTable == 0) {
+        dprintf("No process stats table, process stats not available\n");
+        return S_OK;
     }
-   
-    return;   
-    
+
+    hr = BuildModuleSymbol(symbolBuffer, sizeof(symbolBuffer), module, "ProcessStatsEnabled");
+    if (hr != S_OK) {
+        return hr;
+    }
+
+    enabledAddress = GetExpression(symbolBuffer);
+
+    enabled = 0;
+
+    if (enabledAddress != 0) {
+        ReadMemory(enabledAddress, &enabled, sizeof(ULONG), NULL);
+    }
+
+    if (enabled == 0) {
+        dprintf("Process stats are off, turn them on with: ed %s\n", symbolBuffer);
+    }
+
+    hr = BuildModuleSymbol(symbolBuffer, sizeof(symbolBuffer), module, "ProcessStatsOverflow");
+    if (hr != S_OK) {
+        return hr;
+    }
+
+    memset(&overflow, 0, sizeof(overflow));
+
+    overflowAddress = GetExpression(symbolBuffer);
+
+    if (overflowAddress != 0) {
+        ReadMemory(overflowAddress, &overflow, sizeof(overflow), NULL);
+    }
+
+    //
+    // Pull the whole table over in one read, same as the call edges
+    //
+    entries = (PPROCESS_STATS)malloc(PROCESS_STATS_SIZE * sizeof(PROCESS_STATS));
+    totals  = (PPROCESS_TOTAL)malloc((PROCESS_STATS_SIZE + 1) * sizeof(PROCESS_TOTAL));
+    if ((entries == NULL) || (totals == NULL)) {
+        dprintf("Out of memory\n");
+        free(entries);
+        free(totals);
+        return E_OUTOFMEMORY;
+    }
+
+    if (!ReadMemory(processStatsTable, 
+                    entries, 
+                    PROCESS_STATS_SIZE * sizeof(PROCESS_STATS), 
+                    &bytesRead) ||
+        (bytesRead != PROCESS_STATS_SIZE * sizeof(PROCESS_STATS))) {
+        dprintf("Error reading process stats table at %p\n", processStatsTable);
+        free(entries);
+        free(totals);
+        return S_OK;
+    }
+
+    //
+    // Squeeze out the empty slots and bring the entries of each
+    // process together
+    //
+    entriesCount = 0;
+
+    for (j = 0; j < PROCESS_STATS_SIZE; j++) {
+
+        if ((entries[j].Key != 0) && (entries[j].CallCount != 0)) {
+            entries[entriesCount++] = entries[j];
+        }
+
+    }
+
+    qsort(entries, entriesCount, sizeof(PROCESS_STATS), CompareProcessStats);
+
+    //
+    // The time that a process spent in the module is the self time 
+    // of all of the functions that it called. The inclusive time 
+    // would count the callers of instrumented functions twice.
+    //
+    totalsCount = 0;
+
+    for (j = 0; j < entriesCount; j++) {
+
+        processId = (ULONG)((ULONG64)entries[j].Key >> 32);
+
+        if ((totalsCount == 0) || 
+            (totals[totalsCount - 1].ProcessId != processId)) {
+
+            memset(&totals[totalsCount], 0, sizeof(PROCESS_TOTAL));
+
+            totals[totalsCount].ProcessId   = processId;
+            totals[totalsCount].TopFunction = MAX_FUNC_TRACES;
+            totalsCount++;
+
+        }
+
+        //
+        // A process ID can be reused, keep the first name that we
+        // find
+        //
+        if (totals[totalsCount - 1].ImageName[0] == '\0') {
+            memcpy(totals[totalsCount - 1].ImageName, 
+                   entries[j].ImageName, 
+                   sizeof(entries[j].ImageName));
+            totals[totalsCount - 1].ImageName[PROCESS_STATS_NAME_LENGTH - 1] = '\0';
+        }
+
+        selfTicks = entries[j].SelfTicks;
+        if (selfTicks < 0) {
+            selfTicks = 0;
+        }
+
+        scaledTicks = ScaleBySampling((ULONG64)selfTicks, 
+                                      (ULONG64)entries[j].CallCount, 
+                                      (ULONG64)entries[j].SampledCount);
+
+        totals[totalsCount - 1].CallCount += (ULONG64)entries[j].CallCount;
+        totals[totalsCount - 1].Ticks     += scaledTicks;
+
+        if ((totals[totalsCount - 1].TopFunction == MAX_FUNC_TRACES) ||
+            (scaledTicks > totals[totalsCount - 1].TopTicks)) {
+            totals[totalsCount - 1].TopFunction = 
+                            ((ULONG)(ULONG64)entries[j].Key) - 1;
+            totals[totalsCount - 1].TopTicks    = scaledTicks;
+        }
+
+    }
+
+    //
+    // Calls that didn't fit in the table, we can't tell whose they 
+    // were
+    //
+    if (overflow.CallCount != 0) {
+
+        memset(&totals[totalsCount], 0, sizeof(PROCESS_TOTAL));
+
+        selfTicks = overflow.SelfTicks;
+        if (selfTicks < 0) {
+            selfTicks = 0;
+        }
+
+        totals[totalsCount].ProcessId   = (ULONG)-1;
+        totals[totalsCount].TopFunction = MAX_FUNC_TRACES;
+        totals[totalsCount].CallCount   = (ULONG64)overflow.CallCount;
+        totals[totalsCount].Ticks       = ScaleBySampling((ULONG64)selfTicks, 
+                                                          (ULONG64)overflow.CallCount, 
+                                                          (ULONG64)overflow.SampledCount);
+        StringCbCopy(totals[totalsCount].ImageName, 
+                     sizeof(totals[totalsCount].ImageName), 
+                     "<overflow>");
+        totalsCount++;
+
+    }
+
+    qsort(totals, totalsCount, sizeof(PROCESS_TOTAL), CompareProcessTotals);
+
+    if ((maxCount == 0) || (maxCount > totalsCount)) {
+        maxCount = totalsCount;
+    }
+
+    //
+    // Times are scaled up from the sampled calls, same as modulestats.
+    // The DPCs and ISRs get a row of their own with no process ID,
+    // whatever process they came in on. Process ID zero is the Idle 
+    // process.
+    //
+    if (walk.TicksPerSecond != 0) {
+        dprintf("Process,ProcessId,CallCount,Ns,NsPerCall,TopFunction,TopFunctionNs\n");
+    } else {
+        dprintf("Process,ProcessId,CallCount,Ticks,TicksPerCall,TopFunction,TopFunctionTicks\n");
+    }
+
+    for (j = 0; j < maxCount; j++) {
+
+        if (CheckControlC()) {
+            break;
+        }
+
+        ticks    = totals[j].Ticks;
+        topTicks = totals[j].TopTicks;
+
+        if (walk.TicksPerSecond != 0) {
+            ticks    = TicksToNs(ticks, walk.TicksPerSecond);
+            topTicks = TicksToNs(topTicks, walk.TicksPerSecond);
+        }
+
+        functionName[0] = '\0';
+
+        if (totals[j].TopFunction < walk.FuncTracesInUse) {
+            GetSymbolName(TraceWalkGetStartAddress(&walk, totals[j].TopFunction), 
+                          functionName, 
+                          sizeof(functionName));
+        }
+
+        if ((totals[j].ProcessId == (ULONG)-1) || 
+            (totals[j].ProcessId == PROCESS_STATS_DPC_ISR_ID)) {
+            dprintf("%s,,", totals[j].ImageName);
+        } else {
+            dprintf("%s,%d,", 
+                    (totals[j].ImageName[0] != '\0') ? totals[j].ImageName : "<unknown>",
+                    totals[j].ProcessId);
+        }
+
+        dprintf("%I64d,%I64d,%I64d,%s,%I64d\n",
+                totals[j].CallCount,
+                ticks,
+                ticks / totals[j].CallCount,
+                functionName,
+                topTicks);
+
+    }
+
+    free(entries);
+    free(totals);
+
+    return S_OK;
+}
+
+/*
+  callgraph <modulename> [-dot]
+
+  Print out the caller to callee edges of the module, gprof style: each
+  function with its callers above it and its callees below it. -dot
+  prints them as a Graphviz digraph instead. A call made under a call
+  that wasn't sampled or is filtered has no known caller, so it isn't
+  in the graph.
+
+*/
+HRESULT CALLBACK
+callgraph(PDEBUG_CLIENT4 Client, PCSTR args)
+{
+    TRACE_WALK walk;
+    char       module[256];
+    char       callerName[256];
+    char       calleeName[256];
+    char       indexBuffer[32];
+    PCSTR      options;
+    BOOL       dot;
+    ULONG64    callEdgeTable;
+    PCALL_EDGE edges;
+    ULONG      edgesCount;
+    ULONG      bytesRead;
+    ULONG      caller;
+    ULONG      callee;
+    ULONG      j;
+    ULONG64    i;
+    ULONG64    callCount;
+    ULONG64    callTicks;
+    LONG64     selfTicks;
+    ULONG64    edgeTicks;
+    BOOL       found;
+    HRESULT    hr;
+
+    UNREFERENCED_PARAMETER(Client);
+
+
+    options = GetModuleArg(args, module, sizeof(module));
+
+    dot = (strstr(options, "-dot") != NULL);
+
+    //
+    // Find the trace entries
+    //
+    hr = TraceWalkInitialize(module, &walk);
+    if (hr != S_OK) {
+        return hr;
+    }
+
+    //
+    // Get the edge table. If it's not there the module was built with an
+    // older library or the table couldn't be allocated
+    //
+    callEdgeTable = ReadModulePointer(module, "CallEdgeTable");
+    if (callEdgeTable == 0) {
+        dprintf("No call edge table, call graph not available\n");
+        return S_OK;
+    }
+
+    //
+    // Pull the whole table over in one read, it's only a couple
+    // of hundred KB
+    //
+    edges = (PCALL_EDGE)malloc(CALL_EDGE_TABLE_SIZE * sizeof(CALL_EDGE));
+    if (edges == NULL) {
+        dprintf("Out of memory\n");
+        return E_OUTOFMEMORY;
+    }
+
+    if (!ReadMemory(callEdgeTable, 
+                    edges, 
+                    CALL_EDGE_TABLE_SIZE * sizeof(CALL_EDGE), 
+                    &bytesRead) ||
+        (bytesRead != CALL_EDGE_TABLE_SIZE * sizeof(CALL_EDGE))) {
+        dprintf("Error reading call edge table at %p\n", callEdgeTable);
+        free(edges);
+        return S_OK;
+    }
+
+    //
+    // Squeeze out the empty slots and put the most expensive edges
+    // first
+    //
+    edgesCount = 0;
+
+    for (j = 0; j < CALL_EDGE_TABLE_SIZE; j++) {
+
+        if (edges[j].Key != 0) {
+            edges[edgesCount++] = edges[j];
+        }
+
+    }
+
+    qsort(edges, edgesCount, sizeof(CALL_EDGE), CompareCallEdges);
+
+    if (dot) {
+
+        dprintf("digraph callgraph {\n");
+        dprintf("    node [shape=box];\n");
+
+        for (j = 0; j < edgesCount; j++) {
+
+            caller = ((ULONG)edges[j].Key >> CALL_EDGE_INDEX_BITS) - 1;
+            callee = ((ULONG)edges[j].Key & CALL_EDGE_INDEX_MASK) - 1;
+
+            GetSymbolName(TraceWalkGetStartAddress(&walk, caller), 
+                          callerName, 
+                          sizeof(callerName));
+            GetSymbolName(TraceWalkGetStartAddress(&walk, callee), 
+                          calleeName, 
+                          sizeof(calleeName));
+
+            edgeTicks = (ULONG64)edges[j].CallTicks;
+
+            if (walk.TicksPerSecond != 0) {
+                edgeTicks = TicksToNs(edgeTicks, walk.TicksPerSecond);
+            }
+
+            dprintf("    \"%s\" -> \"%s\" [label=\"%I64d calls\\n%I64d %s\"];\n",
+                    callerName,
+                    calleeName,
+                    edges[j].CallCount,
+                    edgeTicks,
+                    (walk.TicksPerSecond != 0) ? "ns" : "ticks");
+
+            if (CheckControlC()) {
+                break;
+            }
+
+        }
+
+        dprintf("}\n");
+
+        free(edges);
+        return S_OK;
+
+    }
+
+    //
+    // gprof style: each function gets a block with its callers above 
+    // it and its callees below it
+    //
+    dprintf("%-8s%10s  %12s  %12s  %s\n",
+            "Index",
+            "Calls",
+            (walk.TicksPerSecond != 0) ? "CallNs" : "CallTicks",
+            (walk.TicksPerSecond != 0) ? "SelfNs" : "SelfTicks",
+            "Name");
+
+    for (i = 0; i < walk.FuncTracesInUse; i++) {
+
+        found = FALSE;
+
+        for (j = 0; j < edgesCount; j++) {
+
+            caller = ((ULONG)edges[j].Key >> CALL_EDGE_INDEX_BITS) - 1;
+            callee = ((ULONG)edges[j].Key & CALL_EDGE_INDEX_MASK) - 1;
+
+            if ((caller == i) || (callee == i)) {
+                found = TRUE;
+                break;
+            }
+
+        }
+
+        if (!found) {
+            continue;
+        }
+
+        dprintf("-----------------------------------------------"
+                "-----------------------------\n");
+
+        for (j = 0; j < edgesCount; j++) {
+
+            caller = ((ULONG)edges[j].Key >> CALL_EDGE_INDEX_BITS) - 1;
+            callee = ((ULONG)edges[j].Key & CALL_EDGE_INDEX_MASK) - 1;
+
+            if (callee != i) {
+                continue;
+            }
+
+            GetSymbolName(TraceWalkGetStartAddress(&walk, caller), 
+                          callerName, 
+                          sizeof(callerName));
+
+            edgeTicks = (ULONG64)edges[j].CallTicks;
+
+            if (walk.TicksPerSecond != 0) {
+                edgeTicks = TicksToNs(edgeTicks, walk.TicksPerSecond);
+            }
+
+            dprintf("%-8s%10I64d  %12I64d  %12s      %s [%d]\n",
+                    "",
+                    edges[j].CallCount,
+                    edgeTicks,
+                    "",
+                    callerName,
+                    caller);
+
+        }
+
+        TraceWalkSumCounters(&walk, i, &callCount, &callTicks, &selfTicks);
+
+        if (walk.TicksPerSecond != 0) {
+            callTicks = TicksToNs(callTicks, walk.TicksPerSecond);
+            selfTicks = (LONG64)TicksToNs((ULONG64)selfTicks, walk.TicksPerSecond);
+        }
+
+        GetSymbolName(TraceWalkGetStartAddress(&walk, i), 
+                      callerName, 
+                      sizeof(callerName));
+
+        StringCbPrintf(indexBuffer, sizeof(indexBuffer), "[%I64d]", i);
+
+        dprintf("%-8s%10I64d  %12I64d  %12I64d  %s\n",
+                indexBuffer,
+                callCount,
+                callTicks,
+                selfTicks,
+                callerName);
+
+        for (j = 0; j < edgesCount; j++) {
+
+            caller = ((ULONG)edges[j].Key >> CALL_EDGE_INDEX_BITS) - 1;
+            callee = ((ULONG)edges[j].Key & CALL_EDGE_INDEX_MASK) - 1;
+
+            if (caller != i) {
+                continue;
+            }
+
+            GetSymbolName(TraceWalkGetStartAddress(&walk, callee), 
+                          calleeName, 
+                          sizeof(calleeName));
+
+            edgeTicks = (ULONG64)edges[j].CallTicks;
+
+            if (walk.TicksPerSecond != 0) {
+                edgeTicks = TicksToNs(edgeTicks, walk.TicksPerSecond);
+            }
+
+            dprintf("%-8s%10I64d  %12I64d  %12s      %s [%d]\n",
+                    "",
+                    edges[j].CallCount,
+                    edgeTicks,
+                    "",
+                    calleeName,
+                    callee);
+
+        }
+
+        if (CheckControlC()) {
+            break;
+        }
+
+    }
+
+    free(edges);
+
+    return S_OK;
+}
+
+/*
+  flamegraph <modulename>
+
+  Print out the calling-context tree of the module as folded stacks, one
+  "caller;...;function selftime" line per path. Feed it to flamegraph.pl.
+  Calls that weren't sampled or are filtered show up as a single
+  "(untimed)" frame in the paths that go through them.
+
+*/
+HRESULT CALLBACK
+flamegraph(PDEBUG_CLIENT4 Client, PCSTR args)
+{
+    TRACE_WALK      walk;
+    ULONG64         callTree;
+    PCALL_TREE_NODE nodes;
+    ULONG           bytesRead;
+    ULONG           path[FLAME_GRAPH_MAX_DEPTH];
+    ULONG           pathDepth;
+    ULONG           node;
+    ULONG           parentBits;
+    ULONG           functionIndex;
+    ULONG           j;
+    char            functionName[256];
+    LONG64          selfTicks;
+    HRESULT         hr;
+
+    UNREFERENCED_PARAMETER(Client);
+
+
+    //
+    // Find the trace entries
+    //
+    hr = TraceWalkInitialize(args, &walk);
+    if (hr != S_OK) {
+        return hr;
+    }
+
+    //
+    // Get the tree. If it's not there the module was built with an
+    // older library or the tree couldn't be allocated
+    //
+    callTree = ReadModulePointer(args, "CallTree");
+    if (callTree == 0) {
+        dprintf("No call tree, flame graph not available\n");
+        return S_OK;
+    }
+
+    nodes = (PCALL_TREE_NODE)malloc(CALL_TREE_SIZE * sizeof(CALL_TREE_NODE));
+    if (nodes == NULL) {
+        dprintf("Out of memory\n");
+        return E_OUTOFMEMORY;
+    }
+
+    if (!ReadMemory(callTree, 
+                    nodes, 
+                    CALL_TREE_SIZE * sizeof(CALL_TREE_NODE), 
+                    &bytesRead) ||
+        (bytesRead != CALL_TREE_SIZE * sizeof(CALL_TREE_NODE))) {
+        dprintf("Error reading call tree at %p\n", callTree);
+        free(nodes);
+        return S_OK;
+    }
+
+    //
+    // Every node with self time gets a line. Walk the parents to
+    // build the path, it comes out backwards.
+    //
+    for (node = 0; node < CALL_TREE_SIZE; node++) {
+
+        selfTicks = nodes[node].SelfTicks;
+
+        if ((nodes[node].Key == 0) || (selfTicks <= 0)) {
+            continue;
+        }
+
+        pathDepth = 0;
+        j         = node;
+
+        while (pathDepth < FLAME_GRAPH_MAX_DEPTH) {
+
+            path[pathDepth++] = j;
+
+            parentBits = (ULONG)nodes[j].Key >> CALL_TREE_INDEX_BITS;
+
+            if ((parentBits == 0) || (parentBits > CALL_TREE_SIZE)) {
+                break;
+            }
+
+            j = parentBits - 1;
+
+        }
+
+        while (pathDepth > 0) {
+
+            pathDepth--;
+
+            functionIndex = (ULONG)nodes[path[pathDepth]].Key & 
+                                                CALL_TREE_INDEX_MASK;
+
+            if (functionIndex == CALL_TREE_FUNCTION_UNTIMED) {
+
+                StringCbCopy(functionName, sizeof(functionName), "(untimed)");
+
+            } else {
+
+                GetSymbolName(TraceWalkGetStartAddress(&walk, functionIndex - 1),
+                              functionName,
+                              sizeof(functionName));
+
+            }
+
+            dprintf("%s%s", functionName, (pathDepth != 0) ? ";" : " ");
+
+        }
+
+        if (walk.TicksPerSecond != 0) {
+            selfTicks = (LONG64)TicksToNs((ULONG64)selfTicks, walk.TicksPerSecond);
+        }
+
+        dprintf("%I64d\n", selfTicks);
+
+        if (CheckControlC()) {
+            break;
+        }
+
+    }
+
+    free(nodes);
+
+    return S_OK;
+}
+
+/*
+  timeline <modulename>
+
+  Print out the enter/exit timeline of every processor as Chrome trace
+  event JSON. Load it in chrome://tracing or https://ui.perfetto.dev.
+
+*/
+HRESULT CALLBACK
+timeline(PDEBUG_CLIENT4 Client, PCSTR args)
+{
+    TRACE_WALK       walk;
+    PTIMELINE_BUFFER buffer;
+    PTIMELINE_ENTRY  entries;
+    ULONG64          entriesCount;
+    ULONG64          timelineAddress;
+    ULONG64          timelineModePtr;
+    ULONG            timelineMode;
+    ULONG            bytesRead;
+    ULONG            processor;
+    LONG64           next;
+    LONG64           first;
+    LONG64           j;
+    LONG64           dropped;
+    LONG64           baseTimestamp;
+    ULONG64          ts;
+    ULONG64          i;
+    ULONG            functionIndex;
+    char           (*functionNames)[256];
+    BOOL             firstEvent = TRUE;
+    char             symbolBuffer[512];
+    HRESULT          hr;
+
+    UNREFERENCED_PARAMETER(Client);
+
+
+    //
+    // Find the trace entries
+    //
+    hr = TraceWalkInitialize(args, &walk);
+    if (hr != S_OK) {
+        return hr;
+    }
+
+    if (walk.PerCpuData == 0) {
+        dprintf("No per processor data, timeline not available\n");
+        return S_OK;
+    }
+
+    hr = BuildModuleSymbol(symbolBuffer, sizeof(symbolBuffer), args, "TimelineMode");
+    if (hr != S_OK) {
+        return hr;
+    }
+
+    timelineModePtr = GetExpression(symbolBuffer);
+
+    timelineMode = TIMELINE_MODE_OFF;
+
+    if (timelineModePtr != 0) {
+        ReadMemory(timelineModePtr, &timelineMode, sizeof(ULONG), NULL);
+    }
+
+    //
+    // There are lots more events than functions, so remember the
+    // names as we look them up
+    //
+    buffer        = (PTIMELINE_BUFFER)malloc(sizeof(TIMELINE_BUFFER));
+    entries       = (PTIMELINE_ENTRY)malloc((size_t)walk.PerCpuCount * 
+                                            TIMELINE_BUFFER_SIZE * 
+                                            sizeof(TIMELINE_ENTRY));
+    functionNames = (char (*)[256])calloc((size_t)walk.FuncTracesInUse + 1, 
+                                          sizeof(*functionNames));
+    if ((buffer == NULL) || (entries == NULL) || (functionNames == NULL)) {
+        dprintf("Out of memory\n");
+        free(buffer);
+        free(entries);
+        free(functionNames);
+        return E_OUTOFMEMORY;
+    }
+
+    //
+    // Pull every processor's buffer over in one read and merge
+    // them
+    //
+    entriesCount = 0;
+    dropped      = 0;
+
+    for (processor = 0; processor < walk.PerCpuCount; processor++) {
+
+        timelineAddress = TraceWalkGetTimeline(&walk, processor);
+        if (timelineAddress == 0) {
+            continue;
+        }
+
+        if (!ReadMemory(timelineAddress, 
+                        buffer, 
+                        sizeof(TIMELINE_BUFFER), 
+                        &bytesRead) ||
+            (bytesRead != sizeof(TIMELINE_BUFFER))) {
+            dprintf("Error reading timeline at %p\n", timelineAddress);
+            continue;
+        }
+
+        //
+        // If the buffer wrapped, overwrite mode kept the newest events
+        // and stop mode kept the oldest
+        //
+        next  = buffer->Next;
+        first = 0;
+
+        if (next > TIMELINE_BUFFER_SIZE) {
+
+            dropped += next - TIMELINE_BUFFER_SIZE;
+
+            if (timelineMode == TIMELINE_MODE_STOP) {
+                next = TIMELINE_BUFFER_SIZE;
+            } else {
+                first = next - TIMELINE_BUFFER_SIZE;
+            }
+
+        }
+
+        for (j = first; j < next; j++) {
+
+            entries[entriesCount].Timestamp     = 
+                            buffer->Events[j & TIMELINE_BUFFER_MASK].Timestamp;
+            entries[entriesCount].FunctionIndex = 
+                            buffer->Events[j & TIMELINE_BUFFER_MASK].FunctionIndex;
+            entries[entriesCount].ThreadId      = 
+                            buffer->Events[j & TIMELINE_BUFFER_MASK].ThreadId;
+            entries[entriesCount].Processor     = processor;
+
+            entriesCount++;
+
+        }
+
+    }
+
+    free(buffer);
+
+    qsort(entries, (size_t)entriesCount, sizeof(TIMELINE_ENTRY), CompareTimelineEntries);
+
+    //
+    // Timestamps are in microseconds from the first event. If the
+    // module isn't calibrated we can only give ticks.
+    //
+    baseTimestamp = (entriesCount != 0) ? entries[0].Timestamp : 0;
+
+    dprintf("{\"otherData\":{\"droppedEvents\":\"%I64d\",\"timeUnit\":\"%s\"},\n", 
+            dropped,
+            (walk.TicksPerSecond != 0) ? "us" : "ticks");
+    dprintf("\"traceEvents\":[\n");
+
+    for (i = 0; i < entriesCount; i++) {
+
+        functionIndex = entries[i].FunctionIndex & ~TIMELINE_EVENT_EXIT;
+
+        if (functionIndex >= walk.FuncTracesInUse) {
+            continue;
+        }
+
+        if (functionNames[functionIndex][0] == '\0') {
+            GetSymbolName(TraceWalkGetStartAddress(&walk, functionIndex),
+                          functionNames[functionIndex],
+                          sizeof(functionNames[functionIndex]));
+        }
+
+        ts = (ULONG64)(entries[i].Timestamp - baseTimestamp);
+
+        if (walk.TicksPerSecond != 0) {
+            ts = TicksToNs(ts, walk.TicksPerSecond);
+        } else {
+            ts *= 1000;
+        }
+
+        dprintf("%s{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%I64d.%03I64d,"
+                "\"pid\":0,\"tid\":%d,\"args\":{\"cpu\":%d}}",
+                firstEvent ? "" : ",\n",
+                functionNames[functionIndex],
+                (entries[i].FunctionIndex & TIMELINE_EVENT_EXIT) ? "E" : "B",
+                ts / 1000,
+                ts % 1000,
+                entries[i].ThreadId,
+                entries[i].Processor);
+
+        firstEvent = FALSE;
+
+        if (CheckControlC()) {
+            break;
+        }
+
+    }
+
+    dprintf("\n]}\n");
+
+    free(entries);
+    free(functionNames);
+
+    return S_OK;
+}
+
+/*
+  samplerate <modulename> [rate]
+  samplerate <modulename>!<function> [rate]
+
+  Show or set the sampling rate of the module, or of a single function.
+  A function's own rate of zero means that it uses the module's.
+
+*/
+HRESULT CALLBACK
+samplerate(PDEBUG_CLIENT4 Client, PCSTR args)
+{
+    TRACE_WALK walk;
+    char       target[256];
+    char       module[256];
+    char       symbolBuffer[512];
+    PCSTR      options;
+    ULONG64    rateAddress;
+    ULONG64    functionAddress;
+    ULONG64    funcTrace;
+    ULONG64    i;
+    ULONG      sampleRateOffset;
+    ULONG      rate;
+    HRESULT    hr;
+
+    UNREFERENCED_PARAMETER(Client);
+
+
+    options = GetModuleArg(args, target, sizeof(target));
+
+    if (GetFunctionModule(target, module, sizeof(module))) {
+
+        //
+        // Per function rate, it lives in the FUNC_TRACE
+        //
+        functionAddress = GetExpression(target);
+        if (functionAddress == 0) {
+            dprintf("Can't resolve %s\n", target);
+            return S_OK;
+        }
+
+        hr = TraceWalkInitialize(module, &walk);
+        if (hr != S_OK) {
+            return hr;
+        }
+
+        i = TraceWalkFindFunction(&walk, functionAddress);
+        if (i == walk.FuncTracesInUse) {
+            dprintf("%s has not been called\n", target);
+            return S_OK;
+        }
+
+        if (GetFieldOffset(walk.FuncTraceType, "SampleRate", &sampleRateOffset) != 0) {
+            dprintf("Module doesn't support sampling\n");
+            return S_OK;
+        }
+
+        funcTrace   = TraceWalkGetEntry(&walk, i);
+        rateAddress = funcTrace + sampleRateOffset;
+
+    } else {
+
+        //
+        // Module wide rate
+        //
+        StringCbCopy(module, sizeof(module), target);
+
+        hr = BuildModuleSymbol(symbolBuffer, sizeof(symbolBuffer), module, "SampleRate");
+        if (hr != S_OK) {
+            return hr;
+        }
+
+        rateAddress = GetExpression(symbolBuffer);
+        if (rateAddress == 0) {
+            dprintf("Module doesn't support sampling\n");
+            return S_OK;
+        }
+
+    }
+
+    while ((*options == ' ') || (*options == '\t')) {
+        options++;
+    }
+
+    if (*options != '\0') {
+
+        //
+        // Always decimal, it's a count and not an address
+        //
+        rate = strtoul(options, NULL, 10);
+
+        WriteMemory(rateAddress, &rate, sizeof(ULONG), NULL);
+
+    }
+
+    rate = 0;
+
+    ReadMemory(rateAddress, &rate, sizeof(ULONG), NULL);
+
+    if (rate == 0) {
+        dprintf("%s uses the module sample rate\n", target);
+    } else {
+        dprintf("%s sample rate: 1 in %d\n", target, rate);
+    }
+
+    return S_OK;
+}
+
+/*
+  tracing <modulename> [on|off]
+
+  Show or set whether the module is tracing. While it's off the hooks
+  return right away. Calls that were in flight when it was turned off
+  are dropped when it's turned back on, and counted.
+
+*/
+HRESULT CALLBACK
+tracing(PDEBUG_CLIENT4 Client, PCSTR args)
+{
+    char       module[256];
+    char       symbolBuffer[512];
+    PCSTR      options;
+    ULONG64    enabledAddress;
+    ULONG64    generationAddress;
+    ULONG64    droppedAddress;
+    LONG       enabled;
+    LONG       wasEnabled;
+    LONG       generation;
+    LONG       dropped;
+    HRESULT    hr;
+
+    UNREFERENCED_PARAMETER(Client);
+
+
+    options = GetModuleArg(args, module, sizeof(module));
+
+    hr = BuildModuleSymbol(symbolBuffer, sizeof(symbolBuffer), module, "TracingEnabled");
+    if (hr != S_OK) {
+        return hr;
+    }
+
+    enabledAddress = GetExpression(symbolBuffer);
+    if (enabledAddress == 0) {
+        dprintf("Module doesn't support turning tracing off\n");
+        return S_OK;
+    }
+
+    while ((*options == ' ') || (*options == '\t')) {
+        options++;
+    }
+
+    if (*options != '\0') {
+
+        if (_strnicmp(options, "off", 3) == 0) {
+            enabled = 0;
+        } else if (_strnicmp(options, "on", 2) == 0) {
+            enabled = 1;
+        } else {
+            dprintf("Usage: !tracing <module> [on|off]\n");
+            return S_OK;
+        }
+
+        wasEnabled = 0;
+
+        ReadMemory(enabledAddress, &wasEnabled, sizeof(LONG), NULL);
+
+        //
+        // Turning it back on starts a new generation, so that the 
+        // library throws away the frames of the calls that were in 
+        // flight when it was turned off. Do it before tracing is on 
+        // again, or those frames could get mixed up with new ones.
+        //
+        if ((enabled != 0) && (wasEnabled == 0)) {
+
+            hr = BuildModuleSymbol(symbolBuffer, sizeof(symbolBuffer), module, "TracingGeneration");
+            if (hr != S_OK) {
+                return hr;
+            }
+
+            generationAddress = GetExpression(symbolBuffer);
+
+            if (generationAddress != 0) {
+
+                generation = 0;
+
+                ReadMemory(generationAddress, &generation, sizeof(LONG), NULL);
+
+                generation++;
+
+                WriteMemory(generationAddress, &generation, sizeof(LONG), NULL);
+
+            }
+
+        }
+
+        WriteMemory(enabledAddress, &enabled, sizeof(LONG), NULL);
+
+    }
+
+    enabled = 0;
+
+    ReadMemory(enabledAddress, &enabled, sizeof(LONG), NULL);
+
+    dprintf("%s tracing: %s\n", module, (enabled != 0) ? "on" : "off");
+
+    hr = BuildModuleSymbol(symbolBuffer, sizeof(symbolBuffer), module, "TracingCallsDropped");
+    if (hr != S_OK) {
+        return hr;
+    }
+
+    droppedAddress = GetExpression(symbolBuffer);
+    if (droppedAddress == 0) {
+        return S_OK;
+    }
+
+    dropped = 0;
+
+    ReadMemory(droppedAddress, &dropped, sizeof(LONG), NULL);
+
+    //
+    // The library only finds out about them when the thread makes its next
+    // instrumented call, so this can lag behind
+    //
+    dprintf("Calls dropped by turning tracing off and on: %d\n", dropped);
+
+    return S_OK;
+}
+
+/*
+  filter <modulename> [trace|count|ignore]
+  filter <modulename>!<pattern> [trace|count|ignore]
+
+  Show or set what the hooks do with calls of the functions that match
+  the pattern, which can use * and ? wildcards. Only functions that have
+  been called have a filter of their own, the module's filter is what
+  the other ones start out with.
+
+*/
+HRESULT CALLBACK
+filter(PDEBUG_CLIENT4 Client, PCSTR args)
+{
+    TRACE_WALK walk;
+    char       target[256];
+    char       module[256];
+    char       symbolBuffer[512];
+    PCSTR      options;
+    ULONG64    stateAddress;
+    ULONG64    funcTrace;
+    ULONG64    i;
+    ULONG      filterStateOffset;
+    ULONG      filterState;
+    ULONG      newState;
+    ULONG      matches;
+    BOOL       setState;
+    HRESULT    hr;
+
+    UNREFERENCED_PARAMETER(Client);
+
+
+    options = GetModuleArg(args, target, sizeof(target));
+
+    while ((*options == ' ') || (*options == '\t')) {
+        options++;
+    }
+
+    setState = FALSE;
+    newState = FUNC_FILTER_TRACE;
+
+    if (*options != '\0') {
+
+        if (!ParseFilterState(options, &newState)) {
+            dprintf("Usage: !filter <module>[!<pattern>] [trace|count|ignore]\n");
+            return S_OK;
+        }
+
+        setState = TRUE;
+
+    }
+
+    if (!GetFunctionModule(target, module, sizeof(module))) {
+
+        //
+        // Module wide default for functions not called yet
+        //
+        hr = BuildModuleSymbol(symbolBuffer, sizeof(symbolBuffer), target, "FilterDefault");
+        if (hr != S_OK) {
+            return hr;
+        }
+
+        stateAddress = GetExpression(symbolBuffer);
+        if (stateAddress == 0) {
+            dprintf("Module doesn't support filters\n");
+            return S_OK;
+        }
+
+        if (setState) {
+            WriteMemory(stateAddress, &newState, sizeof(ULONG), NULL);
+        }
+
+        filterState = FUNC_FILTER_TRACE;
+
+        ReadMemory(stateAddress, &filterState, sizeof(ULONG), NULL);
+
+        dprintf("%s filter for new functions: %s\n", target, FilterStateName(filterState));
+
+        return S_OK;
+
+    }
+
+    hr = TraceWalkInitialize(module, &walk);
+    if (hr != S_OK) {
+        return hr;
+    }
+
+    if (GetFieldOffset(walk.FuncTraceType, "FilterState", &filterStateOffset) != 0) {
+        dprintf("Module doesn't support filters\n");
+        return S_OK;
+    }
+
+    matches = 0;
+
+    for (i = 0; i < walk.FuncTracesInUse; i++) {
+
+        if (CheckControlC()) {
+            break;
+        }
+
+        GetSymbolName(TraceWalkGetStartAddress(&walk, i), symbolBuffer, sizeof(symbolBuffer));
+
+        if (!WildcardMatch(target, symbolBuffer)) {
+            continue;
+        }
+
+        funcTrace    = TraceWalkGetEntry(&walk, i);
+        stateAddress = funcTrace + filterStateOffset;
+
+        if (setState) {
+            WriteMemory(stateAddress, &newState, sizeof(ULONG), NULL);
+        }
+
+        filterState = FUNC_FILTER_TRACE;
+
+        ReadMemory(stateAddress, &filterState, sizeof(ULONG), NULL);
+
+        dprintf("%s: %s\n", symbolBuffer, FilterStateName(filterState));
+
+        matches++;
+
+    }
+
+    if (matches == 0) {
+        dprintf("No called functions match %s\n", target);
+    }
+
+    return S_OK;
+}
+
+/*
+  callstacks <modulename>
+
+  Print out the most frequent stacks seen by each function in the module.
+
+*/
+HRESULT CALLBACK
+callstacks(PDEBUG_CLIENT4 Client, PCSTR args)
+{
+
+    TRACE_WALK       walk;
+    PUCHAR           funcTrace;
+    ULONG64          startAddress;
+    char             symbolBuffer[512];
+    char             stackEntrySymName[512];
+    ULONG64          i;
+    ULONG64          j;
+    ULONG64          callHistoryLog;
+    CALL_HISTORY_LOG callHistory;
+    ULONG            callHistoryOffset;
+    ULONG64          stackTablePtr;
+    ULONG64          stackTable;
+    ULONG64          stackEntrySize;
+    ULONG            framesCountOffset;
+    ULONG            framesOffset;
+    ULONG64          stackEntry;
+    UCHAR            stackEntryBuffer[sizeof(STACK_TABLE_ENTRY)];
+    ULONG64          entriesCount;
+    ULONG64          callTotal;
+    ULONG64          frameAddress;
+    ULONG64          framesCount;
+    ULONG64          framesIndex;
+    HISTORY_ENTRY    history[MAX_CALL_HISTORY];
+    HRESULT          hr;
+    ULONG64          currentEpochPtr;
+    LONG             currentEpochVal = 0;
+    ULONG            bytesRead;
+
+    UNREFERENCED_PARAMETER(Client);
+
+    //
+    // Find the trace entries
+    //
+    hr = TraceWalkInitialize(args, &walk);
+    if (hr != S_OK) {
+        return hr;
+    }
+
+    //
+    // Get the unique stack table. If it's not there the module wasn't
+    // built with stack capture or the table couldn't be allocated
+    //
+    hr = BuildModuleSymbol(symbolBuffer, sizeof(symbolBuffer), args, "StackTable");
+    if (hr != S_OK) {
+        return hr;
+    }
+
+    stackTablePtr = GetExpression(symbolBuffer);
+
+    stackTable = 0;
+
+    if (stackTablePtr != 0) {
+        ReadPointer(stackTablePtr, &stackTable);
+    }
+
+    if (stackTable == 0) {
+        dprintf("No stack table, stack capture not available\n");
+        return S_OK;
+    }
+
+    //
+    // Get the pointer value of the CurrentEpoch global and read it
+    //
+    hr = BuildModuleSymbol(symbolBuffer, sizeof(symbolBuffer), args, "CurrentEpoch");
+    if (hr != S_OK) {
+        return hr;
+    }
+
+    currentEpochPtr = GetExpression(symbolBuffer);
+
+    if (currentEpochPtr != 0) {
+        ReadMemory(currentEpochPtr, 
+                   &currentEpochVal,
+                   sizeof(LONG),
+                   NULL);
+    }
+
+    //
+    // Get the layout of the structures that we need. The history 
+    // log has no pointers in it, so ours matches the target's. The 
+    // stack table entries don't.
+    //
+    hr = BuildModuleSymbol(stackEntrySymName, 
+                           sizeof(stackEntrySymName), 
+                           args, 
+                           "_STACK_TABLE_ENTRY");
+    if (hr != S_OK) {
+        return hr;
+    }
+
+    stackEntrySize = GetTypeSize(stackEntrySymName);
+    if ((stackEntrySize == 0) || (stackEntrySize > sizeof(stackEntryBuffer))) {
+        dprintf("Error getting type size\n");
+        return S_OK;
+    }
+
+    if ((GetFieldOffset(walk.FuncTraceType, "CallHistory", &callHistoryOffset) != 0) ||
+        (GetFieldOffset(stackEntrySymName, "FramesCount", &framesCountOffset) != 0) ||
+        (GetFieldOffset(stackEntrySymName, "Frames", &framesOffset) != 0)) {
+        dprintf("Error getting field offsets\n");
+        return S_OK;
+    }
+
+    //
+    // Loop over all the in use entries and print out the
+    // information
+    //
+    for (i = 0; i < walk.FuncTracesInUse; i++) {
+        if (CheckControlC()) {
+            return S_OK;
+        }
+
+        //
+        // Find our copy of the entry
+        //
+        funcTrace = TraceWalkGetLocalTrace(&walk, i);
+        if (funcTrace == NULL) {
+            continue;
+        }
+
+        //
+        // Read the start address
+        //
+        startAddress = TraceWalkGetStartAddress(&walk, i);
+
+        // 
+        // The history is only allocated once the function records
+        // a stack. Nothing to show if it hasn't.
+        // 
+        callHistoryLog = LocalField(funcTrace, callHistoryOffset, walk.PtrSize);
+        if (callHistoryLog == 0) {
+            continue;
+        }
+
+        if (walk.PtrSize == 4) {
+            callHistoryLog = ((ULONG64)((LONG)(callHistoryLog)));
+        }
+
+        //
+        // The whole log is only a few hundred bytes, read it in 
+        // one go
+        //
+        if (!ReadMemory(callHistoryLog, 
+                        &callHistory, 
+                        sizeof(callHistory), 
+                        &bytesRead) ||
+            (bytesRead != sizeof(callHistory))) {
+            dprintf("Error in reading _CALL_HISTORY_LOG at %p\n", 
+                    callHistoryLog);
+            return S_OK;
+        }
+
+        // 
+        // If the history was recorded before the last reset, then 
+        // skip it
+        // 
+        if (callHistory.Epoch != currentEpochVal) {
+            continue;
+        }
+
+        entriesCount = (ULONG64)callHistory.EntriesCount;
+        callTotal    = (ULONG64)callHistory.Total;
+
+        if (entriesCount > MAX_CALL_HISTORY) {
+            entriesCount = MAX_CALL_HISTORY;
+        }
+
+        //
+        // Grab all of the stacks and sort them so that the most 
+        // frequent comes first
+        //
+        for (j = 0; j < entriesCount; j++) {
+
+            history[j].StackIndex     = callHistory.Entries[j].StackIndex;
+            history[j].StackSeenCount = callHistory.Entries[j].StackSeenCount;
+            history[j].Error          = callHistory.Entries[j].Error;
+
+        }
+
+        qsort(history, 
+              (size_t)entriesCount, 
+              sizeof(HISTORY_ENTRY), 
+              CompareHistoryEntries);
+
+        //
+        // Get the symbol name for the start address and print it out.
+        //
+        DumpSymbol64(startAddress);
+
+        dprintf("\n");
+
+        for (j = 0; j < entriesCount; j++) {
+
+            if (CheckControlC()) {
+                return S_OK;
+            }
+
+            if (history[j].StackIndex >= STACK_TABLE_SIZE) {
+                continue;
+            }
+
+            stackEntry = stackTable + (history[j].StackIndex * stackEntrySize);
+
+            if (!ReadMemory(stackEntry, 
+                            stackEntryBuffer, 
+                            (ULONG)stackEntrySize, 
+                            &bytesRead) ||
+                (bytesRead != stackEntrySize)) {
+                dprintf("Error in reading _STACK_TABLE_ENTRY at %p\n", 
+                        stackEntry);
+                return S_OK;
+            }
+
+            framesCount = LocalField(stackEntryBuffer, framesCountOffset, sizeof(USHORT));
+
+            if (framesCount > MAX_CALL_FRAMES) {
+                framesCount = MAX_CALL_FRAMES;
+            }
+
+            if (history[j].Error != 0) {
+                dprintf("Stack - Occurred %d times (may be over by %d):\n", 
+                        history[j].StackSeenCount,
+                        history[j].Error);
+            } else {
+                dprintf("Stack - Occurred %d times:\n", 
+                        history[j].StackSeenCount);
+            }
+
+            for (framesIndex = 0; framesIndex < framesCount; framesIndex++) {
+
+                frameAddress = LocalField(stackEntryBuffer, 
+                                          framesOffset + (ULONG)(walk.PtrSize * framesIndex), 
+                                          walk.PtrSize);
+
+                if (walk.PtrSize == 4) {
+                    frameAddress = ((ULONG64)((LONG)(frameAddress)));
+                }
+
+                dprintf("\t");
+                DumpSymbol64(frameAddress);
+                dprintf("\n");
+
+            }
+            dprintf("\n");
+        }
+
+        dprintf("%I64d invocations total\n", callTotal);
+        dprintf("*****************************************************\n");
+        dprintf("-----------------------------------------------------\n");
+        dprintf("\n\n");
+
+    }
+
+    return S_OK;
+}
+
+
+/*
+  cachestats <modulename>
+
+  Print out the per processor function cache hit/miss counts in CSV format.
+
+*/
+HRESULT CALLBACK
+cachestats(PDEBUG_CLIENT4 Client, PCSTR args)
+{
+
+    ULONG64 perCpuDataPtr;
+    ULONG64 perCpuData;
+    ULONG64 perCpuCountPtr;
+    ULONG   perCpuCount = 0;
+    ULONG64 perCpuSize;
+    ULONG64 perCpu;
+    ULONG   hitsOffset;
+    ULONG   missesOffset;
+    ULONG64 hits;
+    ULONG64 misses;
+    ULONG64 totalHits = 0;
+    ULONG64 totalMisses = 0;
+    char    symbolBuffer[512];
+    ULONG   i;
+    HRESULT hr;
+
+    UNREFERENCED_PARAMETER(Client);
+
+    //
+    // Get the per processor array and the number of entries in it
+    //
+    hr = BuildModuleSymbol(symbolBuffer, sizeof(symbolBuffer), args, "PerCpuData");
+    if (hr != S_OK) {
+        return hr;
+    }
+
+    perCpuDataPtr = GetExpression(symbolBuffer);
+
+    ReadPointer(perCpuDataPtr, &perCpuData);
+
+    hr = BuildModuleSymbol(symbolBuffer, sizeof(symbolBuffer), args, "PerCpuCount");
+    if (hr != S_OK) {
+        return hr;
+    }
+
+    perCpuCountPtr = GetExpression(symbolBuffer);
+
+    ReadMemory(perCpuCountPtr, &perCpuCount, sizeof(ULONG), NULL);
+
+    if ((perCpuData == 0) || (perCpuCount == 0)) {
+        dprintf("Tracing library not initialized\n");
+        return S_OK;
+    }
+
+    //
+    // Get the layout of the per processor structure
+    //
+    hr = BuildModuleSymbol(symbolBuffer, sizeof(symbolBuffer), args, "_PER_CPU_DATA");
+    if (hr != S_OK) {
+        return hr;
+    }
+
+    perCpuSize = GetTypeSize(symbolBuffer);
+    if (perCpuSize == 0) {
+        dprintf("Error getting type size\n");
+        return S_OK;
+    }
+
+    if ((GetFieldOffset(symbolBuffer, "FunctionCacheHits", &hitsOffset) != 0) ||
+        (GetFieldOffset(symbolBuffer, "FunctionCacheMisses", &missesOffset) != 0)) {
+        dprintf("Error getting field offsets\n");
+        return S_OK;
+    }
+
+    dprintf("Processor,CacheHits,CacheMisses,HitPercent\n");
+
+    for (i = 0; i < perCpuCount; i++) {
+        if (CheckControlC()) {
+            return S_OK;
+        }
+
+        perCpu = perCpuData + (i * perCpuSize);
+
+        hits   = 0;
+        misses = 0;
+
+        ReadMemory(perCpu + hitsOffset, &hits, sizeof(ULONG64), NULL);
+        ReadMemory(perCpu + missesOffset, &misses, sizeof(ULONG64), NULL);
+
+        if ((hits + misses) == 0) {
+            //
+            // Processor never ran any of our code
+            //
+            continue;
+        }
+
+        totalHits   += hits;
+        totalMisses += misses;
+
+        dprintf("%d,%I64d,%I64d,%I64d\n", 
+                i, hits, misses, ((hits * 100) / (hits + misses)));
+
+    }
+
+    if ((totalHits + totalMisses) != 0) {
+        dprintf("Total,%I64d,%I64d,%I64d\n", 
+                totalHits, 
+                totalMisses, 
+                ((totalHits * 100) / (totalHits + totalMisses)));
+    }
+
+    return S_OK;
+}
+
+
+/*
+  A built-in help for the extension dll
+*/
+HRESULT CALLBACK
+help(PDEBUG_CLIENT4 Client, PCSTR args)
+{
+    INIT_API();
+
+    UNREFERENCED_PARAMETER(args);
+
+    dprintf("Help for penterexts.dll\n"
+            "  modulestats <module> [-p] - Display the function stats for module\n"
+            "  callstacks  <module> - Display the call stack stats\n"
+            "  resettrace  <module> - Reset the function stats for module\n"
+            "  cachestats  <module> - Display the function cache hit rates\n"
+            "  histogram   <module>!<function> - Display a function's latency histogram\n"
+            "  slowcalls   <module> - Display the slowest calls of each function\n"
+            "  irqlstats   <module> - Display the function stats for each IRQL\n"
+            "  processstats <module> [count] - Display the time spent in the module by each process\n"
+            "  callgraph   <module> [-dot] - Display the caller/callee call graph\n"
+            "  flamegraph  <module> - Display the call tree as folded stacks\n"
+            "  timeline    <module> - Display the enter/exit timeline as Chrome trace JSON\n"
+            "  samplerate  <module>[!<function>] [rate] - Show or set the sampling rate\n"
+            "  tracing     <module> [on|off] - Show or turn tracing on or off\n"
+            "  filter      <module>[!<pattern>] [trace|count|ignore] - Show or set function filters\n"
+            "  help                 - Shows this help\n"
+            );
+    EXIT_API();
+
+    return S_OK;
+}
+
+//
+// DumpSymbol
+//
+//  Find the symbol closest to Address and 
+//   display it.
+//
+void DumpSymbol64(ULONG64 Address) {
+
+    char    symbolBuffer[512];
+    ULONG64 offset;
+
+    GetSymbol(Address, symbolBuffer, &offset);
+    if (symbolBuffer[0] != '\0') {
+        
+        dprintf("%s", symbolBuffer);
+        
+    } else {
+
+        dprintf("%p", Address);
+
+    }
+   
+    return;   
+    
+}
+
+//
+// BuildModuleSymbol
+//
+//  Generate module!Name in the supplied buffer.
+//
+HRESULT BuildModuleSymbol(PSTR Buffer, size_t BufferSize, PCSTR Module, PCSTR Name) {
+
+    HRESULT hr;
+
+    memset(Buffer, 0, BufferSize);
+    hr = StringCbPrintf(Buffer, 
+                        BufferSize-1, 
+                        "%s!%s", 
+                        Module,
+                        Name);
+    if (hr != S_OK) {
+        dprintf("String error (0x%x)\n", hr);
+    }
+
+    return hr;
+
+}
+
+//
+// TraceWalkInitialize
+//
+//  Read the FUNC_TRACE segment directory of the module and
+//  figure out the layout of the entries.
+//
+HRESULT TraceWalkInitialize(PCSTR Module, PTRACE_WALK Walk) {
+
+    char    symbolBuffer[512];
+    ULONG64 funcTracesInUsePtr;
+    ULONG64 segmentsBase;
+    ULONG64 segmentCount;
+    ULONG64 calibrationPtr;
+    ULONG   ticksPerSecondOffset;
+    ULONG   hookOverheadOffset;
+    ULONG   counterSegmentsOffset = 0;
+    ULONG   ptrSize;
+    ULONG64 processor;
+    ULONG64 i;
+    HRESULT hr;
+
+    memset(Walk, 0, sizeof(TRACE_WALK));
+
+    // 
+    // Figure out the pointer size on the target
+    // 
+    if (IsPtr64()) {
+        ptrSize = 8;
+    } else {
+        ptrSize = 4;
+    }   
+
+    Walk->PtrSize = ptrSize;
+
+    //
+    // Get the pointer value of the FuncTracesInUse global
+    //
+    hr = BuildModuleSymbol(symbolBuffer, sizeof(symbolBuffer), Module, "FuncTracesInUse");
+    if (hr != S_OK) {
+        return hr;
+    }
+
+    funcTracesInUsePtr = GetExpression(symbolBuffer);
+
+    //
+    // Read the pointer to get the number of traces in use.
+    //
+    ReadPointer(funcTracesInUsePtr, &Walk->FuncTracesInUse);
+
+    if (Walk->FuncTracesInUse > MAX_FUNC_TRACES) {
+        dprintf("Bogus FuncTracesInUse (%I64d)\n", Walk->FuncTracesInUse);
+        return E_FAIL;
+    }
+
+    //
+    // Get the base address of the segment directory and read
+    // the pointers for the segments that are in use
+    //
+    hr = BuildModuleSymbol(symbolBuffer, sizeof(symbolBuffer), Module, "FuncTraceSegments");
+    if (hr != S_OK) {
+        return hr;
+    }
+
+    segmentsBase = GetExpression(symbolBuffer);
+
+    segmentCount = ((Walk->FuncTracesInUse + FUNC_TRACE_SEGMENT_MASK) >> 
+                                                    FUNC_TRACE_SEGMENT_SHIFT);
+
+    for (i = 0; i < segmentCount; i++) {
+
+        ReadPointer(segmentsBase + (i * ptrSize), &Walk->Segments[i]);
+
+    }
+
+    //
+    // The counter segments have a copy for every processor, each with 
+    // its own directory in the per processor data
+    //
+    hr = BuildModuleSymbol(symbolBuffer, sizeof(symbolBuffer), Module, "PerCpuCount");
+    if (hr != S_OK) {
+        return hr;
+    }
+
+    ReadMemory(GetExpression(symbolBuffer), &Walk->PerCpuCount, sizeof(ULONG), NULL);
+
+    if ((Walk->FuncTracesInUse != 0) && (Walk->PerCpuCount == 0)) {
+        dprintf("Bogus PerCpuCount\n");
+        return E_FAIL;
+    }
+
+    Walk->PerCpuData = ReadModulePointer(Module, "PerCpuData");
+
+    hr = BuildModuleSymbol(symbolBuffer, sizeof(symbolBuffer), Module, "_PER_CPU_DATA");
+    if (hr != S_OK) {
+        return hr;
+    }
+
+    Walk->PerCpuDataSize = GetTypeSize(symbolBuffer);
+
+    if ((Walk->FuncTracesInUse != 0) &&
+        ((Walk->PerCpuData == 0) ||
+         (Walk->PerCpuDataSize == 0) ||
+         (GetFieldOffset(symbolBuffer, "CounterSegments", &counterSegmentsOffset) != 0))) {
+        dprintf("Can't find the per processor counter segments\n");
+        return E_FAIL;
+    }
+
+    Walk->CounterSegments = (ULONG64 *)GrowCache(&CounterSegmentCache, 
+                                                 &CounterSegmentCacheSize, 
+                                                 (ULONG64)Walk->PerCpuCount * 
+                                                    MAX_FUNC_TRACE_SEGMENTS * 
+                                                    sizeof(ULONG64));
+    if ((Walk->CounterSegments == NULL) && (Walk->PerCpuCount != 0)) {
+        dprintf("Out of memory\n");
+        return E_OUTOFMEMORY;
+    }
+
+    for (processor = 0; processor < Walk->PerCpuCount; processor++) {
+
+        for (i = 0; i < MAX_FUNC_TRACE_SEGMENTS; i++) {
+
+            Walk->CounterSegments[(processor * MAX_FUNC_TRACE_SEGMENTS) + i] = 0;
+
+            if (i < segmentCount) {
+
+                ReadPointer(Walk->PerCpuData + 
+                                (processor * Walk->PerCpuDataSize) + 
+                                counterSegmentsOffset + 
+                                (i * ptrSize), 
+                            &Walk->CounterSegments[(processor * MAX_FUNC_TRACE_SEGMENTS) + i]);
+
+            }
+
+        }
+
+    }
+
+    //
+    // The per processor data also has the timelines. Leave the offset
+    // missing if they're not there, only !timeline cares.
+    //
+    if ((Walk->PerCpuDataSize == 0) ||
+        (GetFieldOffset(symbolBuffer, "Timeline", &Walk->TimelineOffset) != 0)) {
+        Walk->TimelineOffset = TRACE_FIELD_MISSING;
+    }
+
+    //
+    // The per IRQL counters are shared by all of the processors. Older
+    // builds of the library keep them in the counters, leave these zero
+    // in that case.
+    //
+    hr = BuildModuleSymbol(symbolBuffer, sizeof(symbolBuffer), Module, "FuncIrqlSegments");
+    if (hr != S_OK) {
+        return hr;
+    }
+
+    segmentsBase = GetExpression(symbolBuffer);
+
+    for (i = 0; (segmentsBase != 0) && (i < segmentCount); i++) {
+
+        ReadPointer(segmentsBase + (i * ptrSize), &Walk->IrqlSegments[i]);
+
+    }
+
+    //
+    // And the histogram segments. Older builds of the library 
+    // don't have them, just leave them zero in that case.
+    //
+    hr = BuildModuleSymbol(symbolBuffer, sizeof(symbolBuffer), Module, "FuncHistogramSegments");
+    if (hr != S_OK) {
+        return hr;
+    }
+
+    segmentsBase = GetExpression(symbolBuffer);
+
+    for (i = 0; (segmentsBase != 0) && (i < segmentCount); i++) {
+
+        ReadPointer(segmentsBase + (i * ptrSize), &Walk->HistogramSegments[i]);
+
+    }
+
+    hr = BuildModuleSymbol(symbolBuffer, sizeof(symbolBuffer), Module, "FuncSlowCallsSegments");
+    if (hr != S_OK) {
+        return hr;
+    }
+
+    segmentsBase = GetExpression(symbolBuffer);
+
+    for (i = 0; (segmentsBase != 0) && (i < segmentCount); i++) {
+
+        ReadPointer(segmentsBase + (i * ptrSize), &Walk->SlowCallsSegments[i]);
+
+    }
+
+    //
+    // Get the size of the structure
+    //
+    hr = BuildModuleSymbol(Walk->FuncTraceType, 
+                           sizeof(Walk->FuncTraceType), 
+                           Module, 
+                           "_FUNC_TRACE");
+    if (hr != S_OK) {
+        return hr;
+    }
+
+    Walk->FuncTraceSize = GetTypeSize(Walk->FuncTraceType);
+    if (Walk->FuncTraceSize == 0) {
+        dprintf("Error getting type size\n");
+        return E_FAIL;
+    }
+
+    hr = BuildModuleSymbol(Walk->FuncCountersType, 
+                           sizeof(Walk->FuncCountersType), 
+                           Module, 
+                           "_FUNC_COUNTERS");
+    if (hr != S_OK) {
+        return hr;
+    }
+
+    Walk->FuncCountersSize = GetTypeSize(Walk->FuncCountersType);
+    if (Walk->FuncCountersSize == 0) {
+        dprintf("Error getting type size\n");
+        return E_FAIL;
+    }
+
+    //
+    // Look up the fields that we read once, rather than for every
+    // entry
+    //
+    Walk->StartAddressOffset           = TraceWalkFieldOffset(Walk->FuncTraceType, "StartAddress");
+    Walk->MaxRecursionDepthOffset      = TraceWalkFieldOffset(Walk->FuncTraceType, "MaxRecursionDepth");
+    Walk->CallTicksOffset              = TraceWalkFieldOffset(Walk->FuncCountersType, "CallTicks");
+    Walk->SelfTicksOffset              = TraceWalkFieldOffset(Walk->FuncCountersType, "SelfTicks");
+    Walk->CallCountOffset              = TraceWalkFieldOffset(Walk->FuncCountersType, "CallCount");
+    Walk->DescendantCallsOffset        = TraceWalkFieldOffset(Walk->FuncCountersType, "DescendantCalls");
+    Walk->DescendantHookOverheadOffset = TraceWalkFieldOffset(Walk->FuncCountersType, "DescendantHookOverhead");
+    Walk->MaxTicksOffset               = TraceWalkFieldOffset(Walk->FuncCountersType, "MaxTicks");
+    Walk->SampledCountOffset           = TraceWalkFieldOffset(Walk->FuncCountersType, "SampledCount");
+    Walk->CpuTicksOffset               = TraceWalkFieldOffset(Walk->FuncCountersType, "CpuTicks");
+
+    if (Walk->StartAddressOffset == TRACE_FIELD_MISSING) {
+        dprintf("Error getting field offsets\n");
+        return E_FAIL;
+    }
+
+    //
+    // Older builds of the library time every call and don't count
+    // the samples
+    //
+    Walk->HasSampling = (Walk->SampledCountOffset != TRACE_FIELD_MISSING);
+
+    //
+    // Same for the on-CPU time
+    //
+    Walk->HasCpuTicks = (Walk->CpuTicksOffset != TRACE_FIELD_MISSING);
+
+    //
+    // And how fast the time source ticks and what the hooks
+    // cost. Leave them zero if the module doesn't have a
+    // calibration record, the callers stick to raw ticks then.
+    //
+    hr = BuildModuleSymbol(symbolBuffer, sizeof(symbolBuffer), Module, "TimeCalibration");
+    if (hr != S_OK) {
+        return hr;
+    }
+
+    calibrationPtr = GetExpression(symbolBuffer);
+
+    hr = BuildModuleSymbol(symbolBuffer, sizeof(symbolBuffer), Module, "_TIME_CALIBRATION");
+    if (hr != S_OK) {
+        return hr;
+    }
+
+    if ((calibrationPtr != 0) &&
+        (GetFieldOffset(symbolBuffer, "TicksPerSecond", &ticksPerSecondOffset) == 0)) {
+
+        ReadMemory(calibrationPtr + ticksPerSecondOffset, 
+                   &Walk->TicksPerSecond, 
+                   sizeof(ULONG64), 
+                   NULL);
+
+    }
+
+    if ((calibrationPtr != 0) &&
+        (GetFieldOffset(symbolBuffer, "HookOverhead", &hookOverheadOffset) == 0)) {
+
+        ReadMemory(calibrationPtr + hookOverheadOffset, 
+                   &Walk->HookOverhead, 
+                   sizeof(ULONG64), 
+                   NULL);
+
+    }
+
+    //
+    // Pull the trace entries over. Every command needs at least their
+    // start addresses.
+    //
+    if (!TraceWalkReadTraces(Walk)) {
+        return E_FAIL;
+    }
+
+    return S_OK;
+
+}
+
+//
+// ReadModulePointer
+//
+//  Read the value of a pointer global of the module. Returns zero if
+//  the global isn't there.
+//
+ULONG64 ReadModulePointer(PCSTR Module, PCSTR Name) {
+
+    char    symbolBuffer[512];
+    ULONG64 pointerAddress;
+    ULONG64 pointerValue;
+
+    if (BuildModuleSymbol(symbolBuffer, sizeof(symbolBuffer), Module, Name) != S_OK) {
+        return 0;
+    }
+
+    pointerAddress = GetExpression(symbolBuffer);
+    if (pointerAddress == 0) {
+        return 0;
+    }
+
+    pointerValue = 0;
+
+    if (!ReadPointer(pointerAddress, &pointerValue)) {
+        return 0;
+    }
+
+    return pointerValue;
+
+}
+
+//
+// ZeroModuleTable
+//
+//  Write zeros over the table that a pointer global of the module 
+//  points to. Does nothing if the table isn't there.
+//
+HRESULT ZeroModuleTable(PCSTR Module, PCSTR Name, ULONG Size) {
+
+    ULONG64 table;
+    PVOID   zeroTable;
+
+    table = ReadModulePointer(Module, Name);
+    if (table == 0) {
+        return S_OK;
+    }
+
+    zeroTable = calloc(1, Size);
+    if (zeroTable == NULL) {
+        dprintf("Out of memory\n");
+        return E_OUTOFMEMORY;
+    }
+
+    WriteMemory(table, zeroTable, Size, NULL);
+
+    free(zeroTable);
+
+    return S_OK;
+
+}
+
+//
+// TraceWalkGetEntry
+//
+//  Get the address of the FUNC_TRACE at the given index. Returns
+//  zero if the segment holding it was never allocated.
+//
+ULONG64 TraceWalkGetEntry(PTRACE_WALK Walk, ULONG64 Index) {
+
+    ULONG64 segment;
+
+    segment = Walk->Segments[Index >> FUNC_TRACE_SEGMENT_SHIFT];
+
+    if (segment == 0) {
+        return 0;
+    }
+
+    return segment + ((Index & FUNC_TRACE_SEGMENT_MASK) * Walk->FuncTraceSize);
+
+}
+
+//
+// TraceWalkGetCounters
+//
+//  Get the address of a processor's FUNC_COUNTERS at the given index.
+//  Returns zero if the segment holding it was never allocated.
+//
+ULONG64 TraceWalkGetCounters(PTRACE_WALK Walk, ULONG64 Index, ULONG Processor) {
+
+    ULONG64 segment;
+
+    if (Processor >= Walk->PerCpuCount) {
+        return 0;
+    }
+
+    segment = Walk->CounterSegments[((ULONG64)Processor * MAX_FUNC_TRACE_SEGMENTS) + 
+                                    (Index >> FUNC_TRACE_SEGMENT_SHIFT)];
+
+    if (segment == 0) {
+        return 0;
+    }
+
+    return segment + ((Index & FUNC_TRACE_SEGMENT_MASK) * Walk->FuncCountersSize);
+
+}
+
+//
+// TraceWalkReadTraces
+//
+//  Read the in use FUNC_TRACE entries into Walk->Traces, one
+//  read per segment. Entries of a segment that was never allocated
+//  are left zero.
+//
+BOOL TraceWalkReadTraces(PTRACE_WALK Walk) {
+
+    ULONG64 segment;
+    ULONG64 count;
+    ULONG   size;
+    ULONG   bytesRead;
+
+    if (Walk->FuncTracesInUse == 0) {
+        return TRUE;
+    }
+
+    Walk->Traces = GrowCache(&TraceCache, 
+                             &TraceCacheSize, 
+                             Walk->FuncTracesInUse * Walk->FuncTraceSize);
+    if (Walk->Traces == NULL) {
+        dprintf("Out of memory\n");
+        return FALSE;
+    }
+
+    memset(Walk->Traces, 0, (size_t)(Walk->FuncTracesInUse * Walk->FuncTraceSize));
+
+    for (segment = 0; 
+         (segment << FUNC_TRACE_SEGMENT_SHIFT) < Walk->FuncTracesInUse; 
+         segment++) {
+
+        if (Walk->Segments[segment] == 0) {
+            continue;
+        }
+
+        count = Walk->FuncTracesInUse - (segment << FUNC_TRACE_SEGMENT_SHIFT);
+        if (count > FUNC_TRACE_SEGMENT_SIZE) {
+            count = FUNC_TRACE_SEGMENT_SIZE;
+        }
+
+        size = (ULONG)(count * Walk->FuncTraceSize);
+
+        if (!ReadMemory(Walk->Segments[segment], 
+                        Walk->Traces + 
+                            ((segment << FUNC_TRACE_SEGMENT_SHIFT) * Walk->FuncTraceSize), 
+                        size, 
+                        &bytesRead) ||
+            (bytesRead != size)) {
+            dprintf("Error reading FUNC_TRACE segment at %p\n", Walk->Segments[segment]);
+            Walk->Traces = NULL;
+            return FALSE;
+        }
+
+    }
+
+    return TRUE;
+
+}
+
+//
+// TraceWalkReadCounters
+//
+//  Read every processor's copy of the in use FUNC_COUNTERS entries
+//  into Walk->Counters, one read per segment per processor. Locally,
+//  processor P's counters for entry I are at:
+//
+//      Counters[(P * FuncTracesInUse) + I]
+//
+BOOL TraceWalkReadCounters(PTRACE_WALK Walk) {
+
+    ULONG64 address;
+    PUCHAR  local;
+    ULONG64 segment;
+    ULONG64 count;
+    ULONG   processor;
+    ULONG   size;
+    ULONG   bytesRead;
+
+    if (Walk->FuncTracesInUse == 0) {
+        return TRUE;
+    }
+
+    Walk->Counters = GrowCache(&CounterCache, 
+                               &CounterCacheSize, 
+                               Walk->PerCpuCount * 
+                                    Walk->FuncTracesInUse * 
+                                    Walk->FuncCountersSize);
+    if (Walk->Counters == NULL) {
+        dprintf("Out of memory\n");
+        return FALSE;
+    }
+
+    for (segment = 0; 
+         (segment << FUNC_TRACE_SEGMENT_SHIFT) < Walk->FuncTracesInUse; 
+         segment++) {
+
+        count = Walk->FuncTracesInUse - (segment << FUNC_TRACE_SEGMENT_SHIFT);
+        if (count > FUNC_TRACE_SEGMENT_SIZE) {
+            count = FUNC_TRACE_SEGMENT_SIZE;
+        }
+
+        size = (ULONG)(count * Walk->FuncCountersSize);
+
+        for (processor = 0; processor < Walk->PerCpuCount; processor++) {
+
+            address = TraceWalkGetCounters(Walk, 
+                                           segment << FUNC_TRACE_SEGMENT_SHIFT, 
+                                           processor);
+            local   = TraceWalkGetLocalCounters(Walk, 
+                                                segment << FUNC_TRACE_SEGMENT_SHIFT, 
+                                                processor);
+
+            //
+            // A processor that never got its copy of the segment has 
+            // nothing in it
+            //
+            if (address == 0) {
+                memset(local, 0, size);
+                continue;
+            }
+
+            if (!ReadMemory(address, local, size, &bytesRead) ||
+                (bytesRead != size)) {
+                dprintf("Error reading FUNC_COUNTERS segment at %p\n", address);
+                Walk->Counters = NULL;
+                return FALSE;
+            }
+
+        }
+
+    }
+
+    return TRUE;
+
+}
+
+//
+// TraceWalkGetLocalTrace
+//
+//  Get our copy of the FUNC_TRACE at the given index. Returns NULL
+//  if the segment holding it was never allocated.
+//
+PUCHAR TraceWalkGetLocalTrace(PTRACE_WALK Walk, ULONG64 Index) {
+
+    if ((Walk->Traces == NULL) || 
+        (Index >= Walk->FuncTracesInUse) ||
+        (Walk->Segments[Index >> FUNC_TRACE_SEGMENT_SHIFT] == 0)) {
+        return NULL;
+    }
+
+    return Walk->Traces + (Index * Walk->FuncTraceSize);
+
+}
+
+//
+// TraceWalkGetLocalCounters
+//
+//  Get our copy of a processor's FUNC_COUNTERS at the given index.
+//  Returns NULL if the counters haven't been read. The counters of a
+//  segment that the processor never got a copy of read as zero.
+//
+PUCHAR TraceWalkGetLocalCounters(PTRACE_WALK Walk, ULONG64 Index, ULONG Processor) {
+
+    if ((Walk->Counters == NULL) || 
+        (Index >= Walk->FuncTracesInUse) ||
+        (Processor >= Walk->PerCpuCount)) {
+        return NULL;
+    }
+
+    return Walk->Counters + 
+           ((((ULONG64)Processor * Walk->FuncTracesInUse) + Index) * 
+                                                    Walk->FuncCountersSize);
+
+}
+
+//
+// TraceWalkFieldOffset
+//
+//  Get the offset of a field of one of the module's types, or
+//  TRACE_FIELD_MISSING if its build of the library doesn't have it.
+//
+ULONG TraceWalkFieldOffset(PCSTR Type, PCSTR Field) {
+
+    ULONG offset;
+
+    if (GetFieldOffset(Type, Field, &offset) != 0) {
+        return TRACE_FIELD_MISSING;
+    }
+
+    return offset;
+
+}
+
+//
+// LocalField
+//
+//  Read a field out of a local copy of a structure. Size is the size
+//  of the field on the target, 8 bytes at most. A missing field reads
+//  as zero.
+//
+ULONG64 LocalField(PUCHAR Base, ULONG Offset, ULONG Size) {
+
+    ULONG64 value;
+
+    value = 0;
+
+    if (Offset != TRACE_FIELD_MISSING) {
+        memcpy(&value, Base + Offset, Size);
+    }
+
+    return value;
+
+}
+
+//
+// GrowCache
+//
+//  Make sure that one of the local caches holds at least Size bytes.
+//  Returns NULL if we couldn't, the old contents are gone either way.
+//
+PUCHAR GrowCache(PUCHAR *Cache, ULONG64 *CacheSize, ULONG64 Size) {
+
+    if (Size <= *CacheSize) {
+        return *Cache;
+    }
+
+    free(*Cache);
+
+    *Cache     = (PUCHAR)malloc((size_t)Size);
+    *CacheSize = (*Cache != NULL) ? Size : 0;
+
+    return *Cache;
+
+}
+
+//
+// TraceWalkFreeCache
+//
+//  Free the local copies of the trace entries, counters and counter
+//  segment directories.
+//
+void TraceWalkFreeCache(void) {
+
+    free(TraceCache);
+    free(CounterCache);
+    free(CounterSegmentCache);
+
+    TraceCache              = NULL;
+    TraceCacheSize          = 0;
+    CounterCache            = NULL;
+    CounterCacheSize        = 0;
+    CounterSegmentCache     = NULL;
+    CounterSegmentCacheSize = 0;
+
+}
+
+//
+// ZeroSegments
+//
+//  Write zeros over the in use entries of a set of segments that are
+//  parallel to the trace segments, one write per segment.
+//
+HRESULT ZeroSegments(ULONG64 *Segments, ULONG64 InUse, ULONG64 EntrySize) {
+
+    ULONG64 segment;
+    ULONG64 count;
+    PVOID   zeroEntries;
+
+    zeroEntries = calloc(FUNC_TRACE_SEGMENT_SIZE, (size_t)EntrySize);
+    if (zeroEntries == NULL) {
+        dprintf("Out of memory\n");
+        return E_OUTOFMEMORY;
+    }
+
+    for (segment = 0; 
+         (segment << FUNC_TRACE_SEGMENT_SHIFT) < InUse; 
+         segment++) {
+
+        if (Segments[segment] == 0) {
+            continue;
+        }
+
+        count = InUse - (segment << FUNC_TRACE_SEGMENT_SHIFT);
+        if (count > FUNC_TRACE_SEGMENT_SIZE) {
+            count = FUNC_TRACE_SEGMENT_SIZE;
+        }
+
+        WriteMemory(Segments[segment], 
+                    zeroEntries, 
+                    (ULONG)(count * EntrySize), 
+                    NULL);
+
+    }
+
+    free(zeroEntries);
+
+    return S_OK;
+
+}
+
+//
+// TraceWalkZeroRecursionDepths
+//
+//  Reset MaxRecursionDepth of the in use trace entries, a segment at
+//  a time. Our copy of the entries says which ones recursed, the
+//  others are already zero and are left alone.
+//
+void TraceWalkZeroRecursionDepths(PTRACE_WALK Walk) {
+
+    ULONG64 segment;
+    ULONG64 index;
+    ULONG64 end;
+    PUCHAR  funcTrace;
+    LONG    zeroDepth = 0;
+
+    if (Walk->MaxRecursionDepthOffset == TRACE_FIELD_MISSING) {
+        return;
+    }
+
+    for (segment = 0; 
+         (segment << FUNC_TRACE_SEGMENT_SHIFT) < Walk->FuncTracesInUse; 
+         segment++) {
+
+        if (Walk->Segments[segment] == 0) {
+            continue;
+        }
+
+        end = (segment + 1) << FUNC_TRACE_SEGMENT_SHIFT;
+        if (end > Walk->FuncTracesInUse) {
+            end = Walk->FuncTracesInUse;
+        }
+
+        for (index = segment << FUNC_TRACE_SEGMENT_SHIFT; index < end; index++) {
+
+            funcTrace = TraceWalkGetLocalTrace(Walk, index);
+
+            if ((funcTrace == NULL) ||
+                (LocalField(funcTrace, Walk->MaxRecursionDepthOffset, sizeof(LONG)) == 0)) {
+                continue;
+            }
+
+            WriteMemory(TraceWalkGetEntry(Walk, index) + Walk->MaxRecursionDepthOffset, 
+                        &zeroDepth, 
+                        sizeof(zeroDepth), 
+                        NULL);
+
+        }
+
+    }
+
+}
+
+//
+// TraceWalkGetHistogram
+//
+//  Get the address of the FUNC_HISTOGRAM at the given index.
+//  Returns zero if the segment holding it was never allocated.
+//
+ULONG64 TraceWalkGetHistogram(PTRACE_WALK Walk, ULONG64 Index) {
+
+    ULONG64 segment;
+
+    segment = Walk->HistogramSegments[Index >> FUNC_TRACE_SEGMENT_SHIFT];
+
+    if (segment == 0) {
+        return 0;
+    }
+
+    return segment + 
+           ((Index & FUNC_TRACE_SEGMENT_MASK) * sizeof(FUNC_HISTOGRAM));
+
+}
+
+//
+// TraceWalkGetStartAddress
+//
+//  Get the address of the function traced by the FUNC_TRACE at the
+//  given index, sign extended on 32-bit targets.
+//
+ULONG64 TraceWalkGetStartAddress(PTRACE_WALK Walk, ULONG64 Index) {
+
+    PUCHAR  funcTrace;
+    ULONG64 startAddress;
+
+    funcTrace = TraceWalkGetLocalTrace(Walk, Index);
+    if (funcTrace == NULL) {
+        return 0;
+    }
+
+    startAddress = LocalField(funcTrace, Walk->StartAddressOffset, sizeof(ULONGLONG));
+
+    if (Walk->PtrSize == 4) {
+        startAddress = ((ULONG64)((LONG)(startAddress)));
+    }
+
+    return startAddress;
+
+}
+
+//
+// TraceWalkFindFunction
+//
+//  Find the index of the FUNC_TRACE for a function. Returns
+//  FuncTracesInUse if the function has never been called.
+//
+ULONG64 TraceWalkFindFunction(PTRACE_WALK Walk, ULONG64 FunctionAddress) {
+
+    ULONG64 i;
+
+    for (i = 0; i < Walk->FuncTracesInUse; i++) {
+
+        if (TraceWalkGetStartAddress(Walk, i) == FunctionAddress) {
+            break;
+        }
+
+    }
+
+    return i;
+
+}
+
+//
+// TraceWalkGetTimeline
+//
+//  Get the address of a processor's TIMELINE_BUFFER. Returns zero
+//  if the processor never recorded an event.
+//
+ULONG64 TraceWalkGetTimeline(PTRACE_WALK Walk, ULONG Processor) {
+
+    ULONG64 timeline;
+
+    if ((Walk->PerCpuData == 0) || 
+        (Walk->TimelineOffset == TRACE_FIELD_MISSING) || 
+        (Processor >= Walk->PerCpuCount)) {
+        return 0;
+    }
+
+    timeline = 0;
+
+    ReadPointer(Walk->PerCpuData + 
+                    (Processor * Walk->PerCpuDataSize) + 
+                    Walk->TimelineOffset,
+                &timeline);
+
+    return timeline;
+
+}
+
+//
+// TraceWalkSumCounters
+//
+//  Add up every processor's copy of the counters at the given index.
+//
+void TraceWalkSumCounters(PTRACE_WALK Walk, ULONG64 Index, ULONG64 *CallCount, ULONG64 *CallTicks, LONG64 *SelfTicks) {
+
+    PUCHAR funcCounters;
+    ULONG  processor;
+
+    *CallCount = 0;
+    *CallTicks = 0;
+    *SelfTicks = 0;
+
+    //
+    // Callers go through all of the entries, so read all of the
+    // counters the first time
+    //
+    if ((Walk->Counters == NULL) && !TraceWalkReadCounters(Walk)) {
+        return;
+    }
+
+    for (processor = 0; processor < Walk->PerCpuCount; processor++) {
+
+        funcCounters = TraceWalkGetLocalCounters(Walk, Index, processor);
+        if (funcCounters == NULL) {
+            break;
+        }
+
+        *CallCount += LocalField(funcCounters, Walk->CallCountOffset, sizeof(ULONGLONG));
+        *CallTicks += LocalField(funcCounters, Walk->CallTicksOffset, sizeof(LONGLONG));
+        *SelfTicks += (LONG64)LocalField(funcCounters, Walk->SelfTicksOffset, sizeof(LONGLONG));
+
+    }
+
+    if (*SelfTicks < 0) {
+        *SelfTicks = 0;
+    }
+
+}
+
+//
+// TraceWalkGetSlowCalls
+//
+//  Get the address of the FUNC_SLOW_CALLS at the given index.
+//  Returns zero if the segment holding it was never allocated.
+//
+ULONG64 TraceWalkGetSlowCalls(PTRACE_WALK Walk, ULONG64 Index) {
+
+    ULONG64 segment;
+
+    segment = Walk->SlowCallsSegments[Index >> FUNC_TRACE_SEGMENT_SHIFT];
+
+    if (segment == 0) {
+        return 0;
+    }
+
+    return segment + 
+           ((Index & FUNC_TRACE_SEGMENT_MASK) * sizeof(FUNC_SLOW_CALLS));
+
+}
+
+//
+// TraceWalkReadHistogram
+//
+//  Read the FUNC_HISTOGRAM buckets at the given index in one go.
+//  Buckets must have room for FUNC_HISTOGRAM_BUCKETS entries.
+//
+BOOL TraceWalkReadHistogram(PTRACE_WALK Walk, ULONG64 Index, ULONG64 *Buckets) {
+
+    ULONG64 histogram;
+    ULONG   bytesRead;
+
+    memset(Buckets, 0, FUNC_HISTOGRAM_BUCKETS * sizeof(ULONG64));
+
+    histogram = TraceWalkGetHistogram(Walk, Index);
+    if (histogram == 0) {
+        return FALSE;
+    }
+
+    if (!ReadMemory(histogram, 
+                    Buckets, 
+                    FUNC_HISTOGRAM_BUCKETS * sizeof(ULONG64), 
+                    &bytesRead)) {
+        return FALSE;
+    }
+
+    return (bytesRead == FUNC_HISTOGRAM_BUCKETS * sizeof(ULONG64));
+
+}
+
+//
+// TraceWalkReadIrqlStats
+//
+//  Read the per IRQL counters of the function at the given index.
+//  Returns FALSE, with the counters zeroed, if they aren't there.
+//
+BOOL TraceWalkReadIrqlStats(PTRACE_WALK Walk, ULONG64 Index, PFUNC_IRQL_STATS IrqlStats) {
+
+    ULONG64 segment;
+    ULONG   bytesRead;
+
+    memset(IrqlStats, 0, sizeof(FUNC_IRQL_STATS));
+
+    segment = Walk->IrqlSegments[Index >> FUNC_TRACE_SEGMENT_SHIFT];
+    if (segment == 0) {
+        return FALSE;
+    }
+
+    if (!ReadMemory(segment + 
+                        ((Index & FUNC_TRACE_SEGMENT_MASK) * sizeof(FUNC_IRQL_STATS)), 
+                    IrqlStats, 
+                    sizeof(FUNC_IRQL_STATS), 
+                    &bytesRead)) {
+        return FALSE;
+    }
+
+    return (bytesRead == sizeof(FUNC_IRQL_STATS));
+
+}
+
+//
+// HistogramBucketLow
+//
+//  Smallest tick count that lands in the bucket. See the
+//  FUNC_HISTOGRAM comment in func_trace.h for the layout.
+//
+ULONG64 HistogramBucketLow(ULONG Bucket) {
+
+    ULONG msb;
+    ULONG subBucket;
+
+    if (Bucket < FUNC_HISTOGRAM_SUB_BUCKETS) {
+        return Bucket;
+    }
+
+    msb       = (Bucket >> FUNC_HISTOGRAM_SUB_BUCKET_BITS) + 
+                                        FUNC_HISTOGRAM_SUB_BUCKET_BITS - 1;
+    subBucket = Bucket & (FUNC_HISTOGRAM_SUB_BUCKETS - 1);
+
+    return ((ULONG64)(FUNC_HISTOGRAM_SUB_BUCKETS + subBucket)) << 
+                                        (msb - FUNC_HISTOGRAM_SUB_BUCKET_BITS);
+
+}
+
+//
+// HistogramBucketHigh
+//
+//  Largest tick count that lands in the bucket. The last bucket
+//  also takes everything bigger, so it has no real upper end.
+//
+ULONG64 HistogramBucketHigh(ULONG Bucket) {
+
+    ULONG msb;
+
+    if (Bucket >= (FUNC_HISTOGRAM_BUCKETS - 1)) {
+        return MAXULONGLONG;
+    }
+
+    if (Bucket < FUNC_HISTOGRAM_SUB_BUCKETS) {
+        return Bucket;
+    }
+
+    msb = (Bucket >> FUNC_HISTOGRAM_SUB_BUCKET_BITS) + 
+                                        FUNC_HISTOGRAM_SUB_BUCKET_BITS - 1;
+
+    return HistogramBucketLow(Bucket) + 
+           ((1ULL << (msb - FUNC_HISTOGRAM_SUB_BUCKET_BITS)) - 1);
+
+}
+
+//
+// HistogramPercentile
+//
+//  Find the bucket that holds the Numerator/Denominator percentile
+//  and return its upper end. Never reports more than the longest
+//  call that we actually saw.
+//
+ULONG64 HistogramPercentile(ULONG64 *Buckets, ULONG64 Numerator, ULONG64 Denominator, ULONG64 MaxTicks) {
+
+    ULONG64 total;
+    ULONG64 target;
+    ULONG64 cumulative;
+    ULONG64 high;
+    ULONG   i;
+
+    total = 0;
+    for (i = 0; i < FUNC_HISTOGRAM_BUCKETS; i++) {
+        total += Buckets[i];
+    }
+
+    if (total == 0) {
+        return 0;
+    }
+
+    target = ((total * Numerator) + Denominator - 1) / Denominator;
+    if (target == 0) {
+        target = 1;
+    }
+
+    cumulative = 0;
+    for (i = 0; i < FUNC_HISTOGRAM_BUCKETS; i++) {
+
+        cumulative += Buckets[i];
+
+        if (cumulative >= target) {
+            break;
+        }
+
+    }
+
+    high = HistogramBucketHigh(i);
+
+    if ((MaxTicks != 0) && (high > MaxTicks)) {
+        high = MaxTicks;
+    }
+
+    return high;
+
+}
+
+//
+// GetFunctionModule
+//
+//  Copy out the module part of a module!function argument. Returns
+//  FALSE if there's no bang.
+//
+BOOL GetFunctionModule(PCSTR Function, PSTR Module, size_t ModuleSize) {
+
+    PCSTR  bang;
+    size_t length;
+
+    bang = strchr(Function, '!');
+    if (bang == NULL) {
+        return FALSE;
+    }
+
+    length = bang - Function;
+    if (length >= ModuleSize) {
+        length = ModuleSize - 1;
+    }
+
+    memcpy(Module, Function, length);
+    Module[length] = '\0';
+
+    return TRUE;
+
+}
+
+//
+// WildcardMatch
+//
+//  Case insensitive match of a string against a pattern with *
+//  (any run of characters) and ? (any one character) in it.
+//
+BOOL WildcardMatch(PCSTR Pattern, PCSTR String) {
+
+    PCSTR starPattern = NULL;
+    PCSTR starString = NULL;
+
+    while (*String != '\0') {
+
+        if (*Pattern == '*') {
+
+            //
+            // Remember where we were. If the rest doesn't match we come
+            // back and let the star eat one more character.
+            //
+            starPattern = ++Pattern;
+            starString  = String;
+
+        } else if ((*Pattern == '?') ||
+                   (tolower((unsigned char)*Pattern) == tolower((unsigned char)*String))) {
+
+            Pattern++;
+            String++;
+
+        } else if (starPattern != NULL) {
+
+            Pattern = starPattern;
+            String  = ++starString;
+
+        } else {
+
+            return FALSE;
+
+        }
+
+    }
+
+    while (*Pattern == '*') {
+        Pattern++;
+    }
+
+    return (*Pattern == '\0');
+
+}
+
+//
+// ParseFilterState
+//
+//  Turn trace, count or ignore into its FUNC_FILTER_XXX value.
+//
+BOOL ParseFilterState(PCSTR Args, ULONG *FilterState) {
+
+    if (_strnicmp(Args, "trace", 5) == 0) {
+        *FilterState = FUNC_FILTER_TRACE;
+    } else if (_strnicmp(Args, "count", 5) == 0) {
+        *FilterState = FUNC_FILTER_COUNT;
+    } else if (_strnicmp(Args, "ignore", 6) == 0) {
+        *FilterState = FUNC_FILTER_IGNORE;
+    } else {
+        return FALSE;
+    }
+
+    return TRUE;
+
+}
+
+//
+// FilterStateName
+//
+//  The other way around.
+//
+PCSTR FilterStateName(ULONG FilterState) {
+
+    switch (FilterState) {
+    case FUNC_FILTER_TRACE:
+        return "trace";
+    case FUNC_FILTER_COUNT:
+        return "count";
+    case FUNC_FILTER_IGNORE:
+        return "ignore";
+    default:
+        return "unknown";
+    }
+
+}
+
+//
+// ScaleBySampling
+//
+//  Estimate the total for all of the calls from the total for the
+//  calls that were sampled.
+//
+ULONG64 ScaleBySampling(ULONG64 Value, ULONG64 CallCount, ULONG64 SampledCount) {
+
+    if ((SampledCount == 0) || (SampledCount == CallCount)) {
+        return (SampledCount == 0) ? 0 : Value;
+    }
+
+    return ((Value / SampledCount) * CallCount) +
+           (((Value % SampledCount) * CallCount) / SampledCount);
+
+}
+
+//
+// GetModuleArg
+//
+//  Copy the first word of the arguments out as the module name
+//  and return a pointer to whatever options follow it.
+//
+PCSTR GetModuleArg(PCSTR Args, PSTR Module, size_t ModuleSize) {
+
+    size_t length;
+    size_t copyLength;
+
+    while ((*Args == ' ') || (*Args == '\t')) {
+        Args++;
+    }
+
+    length = 0;
+    while ((Args[length] != '\0') && 
+           (Args[length] != ' ') && 
+           (Args[length] != '\t')) {
+        length++;
+    }
+
+    copyLength = length;
+    if (copyLength >= ModuleSize) {
+        copyLength = ModuleSize - 1;
+    }
+
+    memcpy(Module, Args, copyLength);
+    Module[copyLength] = '\0';
+
+    return Args + length;
+
+}
+
+//
+// CompareHistoryEntries
+//
+//  qsort callback to put the most frequent stacks first.
+//
+int __cdecl CompareHistoryEntries(const void *Entry1, const void *Entry2) {
+
+    const HISTORY_ENTRY *history1 = (const HISTORY_ENTRY *)Entry1;
+    const HISTORY_ENTRY *history2 = (const HISTORY_ENTRY *)Entry2;
+
+    if (history1->StackSeenCount > history2->StackSeenCount) {
+        return -1;
+    }
+
+    if (history1->StackSeenCount < history2->StackSeenCount) {
+        return 1;
+    }
+
+    return 0;
+
+}
+
+//
+// CompareSlowCalls
+//
+//  qsort callback to put the slowest calls first.
+//
+int __cdecl CompareSlowCalls(const void *Entry1, const void *Entry2) {
+
+    const SLOW_CALL *slowCall1 = (const SLOW_CALL *)Entry1;
+    const SLOW_CALL *slowCall2 = (const SLOW_CALL *)Entry2;
+
+    if (slowCall1->Ticks > slowCall2->Ticks) {
+        return -1;
+    }
+
+    if (slowCall1->Ticks < slowCall2->Ticks) {
+        return 1;
+    }
+
+    return 0;
+
+}
+
+//
+// CompareCallEdges
+//
+//  qsort callback to put the most expensive edges first.
+//
+int __cdecl CompareCallEdges(const void *Entry1, const void *Entry2) {
+
+    const CALL_EDGE *edge1 = (const CALL_EDGE *)Entry1;
+    const CALL_EDGE *edge2 = (const CALL_EDGE *)Entry2;
+
+    if (edge1->CallTicks > edge2->CallTicks) {
+        return -1;
+    }
+
+    if (edge1->CallTicks < edge2->CallTicks) {
+        return 1;
+    }
+
+    if (edge1->CallCount > edge2->CallCount) {
+        return -1;
+    }
+
+    if (edge1->CallCount < edge2->CallCount) {
+        return 1;
+    }
+
+    return 0;
+
+}
+
+//
+// CompareTimelineEntries
+//
+//  qsort callback to put the timeline in time order.
+//
+int __cdecl CompareTimelineEntries(const void *Entry1, const void *Entry2) {
+
+    const TIMELINE_ENTRY *entry1 = (const TIMELINE_ENTRY *)Entry1;
+    const TIMELINE_ENTRY *entry2 = (const TIMELINE_ENTRY *)Entry2;
+
+    if (entry1->Timestamp < entry2->Timestamp) {
+        return -1;
+    }
+
+    if (entry1->Timestamp > entry2->Timestamp) {
+        return 1;
+    }
+
+    //
+    // Same tick, keep enters before exits so that zero length
+    // calls still nest
+    //
+    if ((entry1->FunctionIndex & TIMELINE_EVENT_EXIT) < 
+        (entry2->FunctionIndex & TIMELINE_EVENT_EXIT)) {
+        return -1;
+    }
+
+    if ((entry1->FunctionIndex & TIMELINE_EVENT_EXIT) > 
+        (entry2->FunctionIndex & TIMELINE_EVENT_EXIT)) {
+        return 1;
+    }
+
+    return 0;
+
+}
+
+//
+// CompareProcessStats
+//
+//  qsort callback to bring the PROCESS_STATS entries of each
+//  process together.
+//
+int __cdecl CompareProcessStats(const void *Entry1, const void *Entry2) {
+
+    const PROCESS_STATS *entry1 = (const PROCESS_STATS *)Entry1;
+    const PROCESS_STATS *entry2 = (const PROCESS_STATS *)Entry2;
+
+    if ((ULONG64)entry1->Key < (ULONG64)entry2->Key) {
+        return -1;
+    }
+
+    if ((ULONG64)entry1->Key > (ULONG64)entry2->Key) {
+        return 1;
+    }
+
+    return 0;
+
+}
+
+//
+// CompareProcessTotals
+//
+//  qsort callback to put the processes that spent the most time
+//  in the module first.
+//
+int __cdecl CompareProcessTotals(const void *Entry1, const void *Entry2) {
+
+    const PROCESS_TOTAL *total1 = (const PROCESS_TOTAL *)Entry1;
+    const PROCESS_TOTAL *total2 = (const PROCESS_TOTAL *)Entry2;
+
+    if (total1->Ticks > total2->Ticks) {
+        return -1;
+    }
+
+    if (total1->Ticks < total2->Ticks) {
+        return 1;
+    }
+
+    return 0;
+
+}
+
+//
+// GetSymbolName
+//
+//  Same as DumpSymbol64, but into a buffer.
+//
+void GetSymbolName(ULONG64 Address, PSTR Buffer, size_t BufferSize) {
+
+    char    symbolBuffer[512];
+    ULONG64 offset;
+
+    symbolBuffer[0] = '\0';
+
+    GetSymbol(Address, symbolBuffer, &offset);
+    if (symbolBuffer[0] != '\0') {
+
+        StringCbCopy(Buffer, BufferSize, symbolBuffer);
+
+    } else {
+
+        StringCbPrintf(Buffer, BufferSize, "0x%I64x", Address);
+
+    }
+
+}
+
+//
+// TicksToNs
+//
+//  Convert a tick count to nanoseconds without overflowing
+//  the intermediate result.
+//
+ULONG64 TicksToNs(ULONG64 Ticks, ULONG64 TicksPerSecond) {
+
+    return ((Ticks / TicksPerSecond) * 1000000000ULL) +
+           (((Ticks % TicksPerSecond) * 1000000000ULL) / TicksPerSecond);
+
 }
@@ -0,0 +1,275 @@
+//
+// Copyright 2008-2017 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+// CONSEQUENTIAL DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+// POSSIBILITY OF SUCH DAMAGE
+// 
+#include "penterlib.h"
+
+/////////////////
+// GLOBAL DATA //
+/////////////////
+
+//
+// Table of caller to callee edges, allocated at init. See func_trace.h
+//
+PCALL_EDGE    CallEdgeTable;
+
+//
+// Number of calls that we couldn't count because the edge table was full
+//
+volatile LONG CallGraphDrops;
+
+//
+// Set if we've told the user that the edge table is full
+//
+BOOLEAN       CallEdgeTableFullReported;
+
+//
+// Max number of slots that we look at before giving up on an edge. Keeps a 
+// full table from costing us a walk of the whole thing on every call.
+//
+#define CALL_EDGE_MAX_PROBES 64
+
+C_ASSERT((MAX_FUNC_TRACES + 1) <= CALL_EDGE_INDEX_MASK);
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  CallGraphInitialize
+//
+//      Allocate the call edge table.
+//
+//  INPUTS:
+//
+//      None.
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      STATUS_SUCCESS or STATUS_INSUFFICIENT_RESOURCES
+//
+//  IRQL:
+//
+//      IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      This is one allocation for the life of the driver, never freed.
+//
+///////////////////////////////////////////////////////////////////////////////
+NTSTATUS
+CallGraphInitialize(
+    VOID) 
+{
+
+#pragma warning(suppress: 30030)
+    CallEdgeTable = (PCALL_EDGE)ExAllocatePoolWithTag(
+                                NonPagedPool,
+                                CALL_EDGE_TABLE_SIZE * sizeof(CALL_EDGE),
+                                'eCep');
+
+    if (CallEdgeTable == NULL) {
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    }
+
+    RtlZeroMemory(CallEdgeTable,
+                  CALL_EDGE_TABLE_SIZE * sizeof(CALL_EDGE));
+
+    return STATUS_SUCCESS;
+
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  CallGraphRecord
+//
+//      Count a call against the edge between a caller and a callee.
+//
+//  INPUTS:
+//
+//      Caller       - Trace entry of the calling function.
+//
+//      Callee       - Trace entry of the function that was called.
+//
+//      ElapsedTicks - Time spent in the callee, zero for recursive calls.
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None
+//
+//  IRQL:
+//
+//      IRQL <= SynchronizeIrql
+//
+//  NOTES:
+//
+//      Lock free. The key is all there is to an edge, so claiming a slot
+//      with a compare exchange is also publishing it. Nobody has to wait
+//      for anyone else to fill anything in.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+CallGraphRecord(
+    PFUNC_TRACE Caller,
+    PFUNC_TRACE Callee,
+    LONGLONG    ElapsedTicks) 
+{
+
+    LONG       key;
+    LONG       slotKey;
+    ULONG      index;
+    ULONG      probes;
+    PCALL_EDGE edge;
+
+    key = (LONG)(((Caller->Index + 1) << CALL_EDGE_INDEX_BITS) | 
+                  (Callee->Index + 1));
+
+    index = PenterHash((ULONG)key, CALL_EDGE_TABLE_SHIFT);
+
+    for (probes = 0; probes < CALL_EDGE_MAX_PROBES; probes++) {
+
+        edge    = &CallEdgeTable[index];
+        slotKey = edge->Key;
+
+        if (slotKey == 0) {
+
+            slotKey = InterlockedCompareExchange(&edge->Key, key, 0);
+
+            if (slotKey == 0) {
+
+                slotKey = key;
+
+            }
+
+        }
+
+        if (slotKey == key) {
+
+            InterlockedIncrement64(&edge->CallCount);
+
+            if (ElapsedTicks != 0) {
+
+                InterlockedAdd64(&edge->CallTicks, ElapsedTicks);
+
+            }
+
+            return;
+
+        }
+
+        index = (index + 1) & (CALL_EDGE_TABLE_SIZE - 1);
+
+    }
+
+    InterlockedIncrement(&CallGraphDrops);
+
+    //
+    // Only nag the user once.
+    //
+    if (CallEdgeTableFullReported == FALSE) {
+
+        DbgPrint("***Out Of Call Edge Table Entries. "\
+                 "No Longer Logging New Call Edges***\n"); 
+
+        CallEdgeTableFullReported = TRUE;
+
+    }
+
+    return;
+
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  CallGraphClearFunction
+//
+//      Zero the counts of every edge into or out of a function.
+//
+//  INPUTS:
+//
+//      FuncTrace - Trace entry of the function.
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None
+//
+//  IRQL:
+//
+//      IRQL <= SynchronizeIrql
+//
+//  NOTES:
+//
+//      The edges stay in the table. Nobody else can be calling the function,
+//      or the counts could come right back.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+CallGraphClearFunction(
+    PFUNC_TRACE FuncTrace) 
+{
+
+    ULONG      index;
+    ULONG      key;
+    PCALL_EDGE edge;
+
+    if (CallEdgeTable == NULL) {
+
+        return;
+
+    }
+
+    for (index = 0; index < CALL_EDGE_TABLE_SIZE; index++) {
+
+        edge = &CallEdgeTable[index];
+        key  = (ULONG)edge->Key;
+
+        if (((key >> CALL_EDGE_INDEX_BITS) == (FuncTrace->Index + 1)) ||
+            ((key & CALL_EDGE_INDEX_MASK) == (FuncTrace->Index + 1))) {
+
+            InterlockedExchange64(&edge->CallCount, 0);
+            InterlockedExchange64(&edge->CallTicks, 0);
+
+        }
+
+    }
+
+    return;
+
+}
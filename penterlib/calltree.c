@@ -0,0 +1,321 @@
+//
+// Copyright 2008-2017 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+// CONSEQUENTIAL DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+// POSSIBILITY OF SUCH DAMAGE
+// 
+#include "penterlib.h"
+
+/////////////////
+// GLOBAL DATA //
+/////////////////
+
+//
+// Calling-context tree, allocated at init. See func_trace.h
+//
+PCALL_TREE_NODE CallTree;
+
+//
+// Number of calls that we couldn't place in the tree because it was full
+//
+volatile LONG   CallTreeDrops;
+
+//
+// Set if we've told the user that the tree is full
+//
+BOOLEAN         CallTreeFullReported;
+
+//
+// Max number of slots that we look at before giving up on a node. Keeps a 
+// full tree from costing us a walk of the whole thing on every call.
+//
+#define CALL_TREE_MAX_PROBES 64
+
+C_ASSERT((MAX_FUNC_TRACES + 1) <= CALL_TREE_INDEX_MASK);
+C_ASSERT(CALL_TREE_SIZE < (1 << (31 - CALL_TREE_INDEX_BITS)));
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  CallTreeInitialize
+//
+//      Allocate the calling-context tree.
+//
+//  INPUTS:
+//
+//      None.
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      STATUS_SUCCESS or STATUS_INSUFFICIENT_RESOURCES
+//
+//  IRQL:
+//
+//      IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      This is one allocation for the life of the driver, never freed.
+//
+///////////////////////////////////////////////////////////////////////////////
+NTSTATUS
+CallTreeInitialize(
+    VOID) 
+{
+
+#pragma warning(suppress: 30030)
+    CallTree = (PCALL_TREE_NODE)ExAllocatePoolWithTag(
+                                NonPagedPool,
+                                CALL_TREE_SIZE * sizeof(CALL_TREE_NODE),
+                                'tCep');
+
+    if (CallTree == NULL) {
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    }
+
+    RtlZeroMemory(CallTree,
+                  CALL_TREE_SIZE * sizeof(CALL_TREE_NODE));
+
+    return STATUS_SUCCESS;
+
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  CallTreeLookupChild
+//
+//      Find the node for a function called from a given node, adding it if
+//      this is the first time that the path has been seen.
+//
+//  INPUTS:
+//
+//      ParentNode - Node of the caller, or CALL_TREE_NODE_ROOT for a top
+//                   level call.
+//
+//      FuncTrace  - Trace entry of the function being called, or NULL for
+//                   the calls between a parent and its children that have
+//                   no frame, see CALL_TREE_FUNCTION_UNTIMED.
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      The node's index or CALL_TREE_NODE_NONE if the tree is full
+//
+//  IRQL:
+//
+//      IRQL <= SynchronizeIrql
+//
+//  NOTES:
+//
+//      Lock free, same as the call edge table. The key is all there is to a
+//      node, so claiming a slot with a compare exchange also publishes it.
+//
+///////////////////////////////////////////////////////////////////////////////
+ULONG
+CallTreeLookupChild(
+    ULONG       ParentNode,
+    PFUNC_TRACE FuncTrace) 
+{
+
+    LONG            key;
+    LONG            slotKey;
+    ULONG           parentBits;
+    ULONG           index;
+    ULONG           probes;
+    PCALL_TREE_NODE node;
+
+    parentBits = (ParentNode == CALL_TREE_NODE_ROOT) ? 0 : (ParentNode + 1);
+
+    key = (LONG)((parentBits << CALL_TREE_INDEX_BITS) | 
+                 ((FuncTrace != NULL) ? (FuncTrace->Index + 1) : 
+                                        CALL_TREE_FUNCTION_UNTIMED));
+
+    index = PenterHash((ULONG)key, CALL_TREE_SHIFT);
+
+    for (probes = 0; probes < CALL_TREE_MAX_PROBES; probes++) {
+
+        node    = &CallTree[index];
+        slotKey = node->Key;
+
+        if (slotKey == 0) {
+
+            slotKey = InterlockedCompareExchange(&node->Key, key, 0);
+
+            if (slotKey == 0) {
+
+                return index;
+
+            }
+
+        }
+
+        if (slotKey == key) {
+
+            return index;
+
+        }
+
+        index = (index + 1) & (CALL_TREE_SIZE - 1);
+
+    }
+
+    InterlockedIncrement(&CallTreeDrops);
+
+    //
+    // Only nag the user once.
+    //
+    if (CallTreeFullReported == FALSE) {
+
+        DbgPrint("***Out Of Call Tree Entries. "\
+                 "No Longer Logging New Call Paths***\n"); 
+
+        CallTreeFullReported = TRUE;
+
+    }
+
+    return CALL_TREE_NODE_NONE;
+
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  CallTreeRecord
+//
+//      Count a call against its node in the calling-context tree.
+//
+//  INPUTS:
+//
+//      Node         - Index of the call's node.
+//
+//      ElapsedTicks - Time spent in the call.
+//
+//      SelfTicks    - Time spent in the call less its instrumented callees.
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None
+//
+//  IRQL:
+//
+//      IRQL <= SynchronizeIrql
+//
+//  NOTES:
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+CallTreeRecord(
+    ULONG    Node,
+    LONGLONG ElapsedTicks,
+    LONGLONG SelfTicks) 
+{
+
+    PCALL_TREE_NODE node = &CallTree[Node];
+
+    InterlockedIncrement64(&node->CallCount);
+    InterlockedAdd64(&node->CallTicks, ElapsedTicks);
+    InterlockedAdd64(&node->SelfTicks, SelfTicks);
+
+    return;
+
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  CallTreeClearFunction
+//
+//      Zero the counts of every node of a function.
+//
+//  INPUTS:
+//
+//      FuncTrace - Trace entry of the function.
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None
+//
+//  IRQL:
+//
+//      IRQL <= SynchronizeIrql
+//
+//  NOTES:
+//
+//      The nodes stay in the tree. Nobody else can be calling the function,
+//      or the counts could come right back.
+//
+//      Only used for the hook overhead dummies, see HookOverheadInitialize.
+//      HookOverheadOuter calls HookOverheadLeaf and HookOverheadNonLeaf and
+//      they don't call anything else. Each of them gets cleared, so just 
+//      clearing a function's own nodes covers every path through them.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+CallTreeClearFunction(
+    PFUNC_TRACE FuncTrace) 
+{
+
+    ULONG           index;
+    PCALL_TREE_NODE node;
+
+    if (CallTree == NULL) {
+
+        return;
+
+    }
+
+    for (index = 0; index < CALL_TREE_SIZE; index++) {
+
+        node = &CallTree[index];
+
+        if (((ULONG)node->Key & CALL_TREE_INDEX_MASK) == (FuncTrace->Index + 1)) {
+
+            InterlockedExchange64(&node->CallCount, 0);
+            InterlockedExchange64(&node->CallTicks, 0);
+            InterlockedExchange64(&node->SelfTicks, 0);
+
+        }
+
+    }
+
+    return;
+
+}
@@ -34,21 +34,43 @@
 // GLOBAL DATA //
 /////////////////
 
+//
+// The function address -> FUNC_TRACE lookup table. See penterlib.h
+//
+FUNCTION_TABLE_ENTRY FunctionTable[FUNCTION_TABLE_SIZE];
+
+//
+// Set if we've told the user that the function table is full
+//
+BOOLEAN FunctionTableFullReported;
 
 //////////////////////
 // MODULE FUNCTIONS //
 //////////////////////
 
+static
+PFUNC_TRACE
+FunctionTableAllocateTrace(
+    ULONGLONG FunctionAddress
+    );
+
+static
+PVOID
+FunctionTableGetSegment(
+    PVOID volatile *SegmentSlot,
+    SIZE_T          SegmentSize,
+    ULONG           Tag
+    );
+
 VOID
 FunctionTableInitialize(
     VOID) 
 {
 
-    RtlInitializeGenericTable(&FunctionTable,
-                              FunctionTableCompareRoutine,
-                              FunctionTableAllocateRoutine,
-                              FunctionTableFreeRoutine,
-                              NULL);
+    //
+    // Table is statically allocated and zero is an empty slot, so there's
+    // nothing to do.
+    //
     return;
 }
 
@@ -59,186 +81,432 @@ FunctionTableLookupEntry(
 {
 
     KIRQL                 oldIrql;
-    FUNCTION_TABLE_ENTRY  lookupEntry = {0};
+    KIRQL                 currentIrql;
+    ULONG                 index;
+    ULONG                 probes;
+    ULONG                 cacheIndex;
+    ULONGLONG             slotAddress;
+    PPER_CPU_DATA         perCpu;
     PFUNCTION_TABLE_ENTRY foundEntry = NULL;
-    PFUNC_TRACE           funcTrace = NULL;
-    BOOLEAN               createdEntry;
-    BOOLEAN               lockedShared;
+    PFUNC_TRACE           funcTrace;
 
+    // 
+    // Try this processor's cache first. Hot functions should pretty much 
+    // always be found here. 
+    //  
+    perCpu     = PerCpuGetCurrent();
+    cacheIndex = FunctionCacheHash(FunctionAddress);
+    foundEntry = perCpu->FunctionCache[cacheIndex];
 
-    lookupEntry.FunctionAddress = FunctionAddress;
-
-    KeRaiseIrql(SynchronizeIrql, &oldIrql);
-    ExAcquireSpinLockSharedAtDpcLevel(&FunctionTableLock);
-    lockedShared = TRUE;
+    if ((foundEntry != NULL) && 
+        (foundEntry->FunctionAddress == FunctionAddress)) {
 
-    foundEntry = 
-        (PFUNCTION_TABLE_ENTRY)RtlLookupElementGenericTable(&FunctionTable,
-                                                            &lookupEntry);
+        perCpu->FunctionCacheHits++;
 
-    if (foundEntry != NULL) {
-        // 
-        // Already in the table, nothing to do 
-        //  
-        goto Exit;
+        return foundEntry;
 
     }
 
-    ExReleaseSpinLockSharedFromDpcLevel(&FunctionTableLock);
-    lockedShared = FALSE;
+    perCpu->FunctionCacheMisses++;
 
-    ExAcquireSpinLockExclusiveAtDpcLevel(&FunctionTableLock);
+    currentIrql = KeGetCurrentIrql();
 
-    foundEntry = 
-        (PFUNCTION_TABLE_ENTRY)RtlInsertElementGenericTable(
-                                                   &FunctionTable,
-                                                   &lookupEntry,
-                                                   sizeof(FUNCTION_TABLE_ENTRY),
-                                                   &createdEntry);
+    index = FunctionTableHash(FunctionAddress);
 
-    if (createdEntry == FALSE) {
+    for (probes = 0; probes < FUNCTION_TABLE_SIZE; probes++) {
 
-        // 
-        // Someone beat us to, nothing to do 
-        //  
-        goto Exit;
+        foundEntry  = &FunctionTable[index];
+        slotAddress = foundEntry->FunctionAddress;
 
-    }
+        if (slotAddress == FunctionAddress) {
 
+            // 
+            // Already in the table. This is the path that every call but 
+            // the first one takes, no locks and no IRQL games 
+            //  
+            goto Found;
 
-    if (FuncTracesInUse >= MAX_FUNC_TRACES) {
+        }
 
-        // 
-        // Destroy the table entry 
-        //  
-        RtlDeleteElementGenericTable(&FunctionTable,
-                                     foundEntry);
+        if (slotAddress == 0) {
+
+            // 
+            // Hit an empty slot, so the function isn't in the table. 
+            // 
+            // Adding it means allocating pool, which an ISR can't do. The 
+            // function goes untracked until it gets called at or below 
+            // DISPATCH_LEVEL. 
+            //  
+            if (currentIrql > DISPATCH_LEVEL) {
+
+                return NULL;
+
+            }
+
+            // 
+            // Try to claim the slot for it. We raise while we own a slot 
+            // that doesn't have a trace entry yet. Anyone else that finds 
+            // the slot spins waiting for us to fill it in, so we can't let 
+            // a DPC on this processor come in and do that. 
+            //  
+            KeRaiseIrql(max(currentIrql, SynchronizeIrql), &oldIrql);
+
+            slotAddress = (ULONGLONG)InterlockedCompareExchange64(
+                                   (volatile LONG64 *)&foundEntry->FunctionAddress,
+                                   (LONG64)FunctionAddress,
+                                   0);
+
+            if (slotAddress == 0) {
+
+                // 
+                // Slot is ours. Now allocate a trace entry for it and make 
+                // it visible to everyone else 
+                //  
+                funcTrace = FunctionTableAllocateTrace(FunctionAddress);
+
+                if (funcTrace == NULL) {
+
+                    funcTrace = FUNC_TRACE_UNAVAILABLE;
+
+                }
+
+                InterlockedExchangePointer((PVOID volatile *)&foundEntry->TraceEntry,
+                                           funcTrace);
+
+                KeLowerIrql(oldIrql);
+
+                goto Found;
+
+            }
+
+            KeLowerIrql(oldIrql);
+
+            if (slotAddress == FunctionAddress) {
 
-        //
-        // Only nag the user once.
-        //
-        if (ErrorReported == FALSE) {
+                // 
+                // Someone beat us to it, nothing to do 
+                //  
+                goto Found;
 
-            DbgPrint("***Out Of Static Entries For Functions. "\
-                     "No Longer Logging***\n"); 
+            }
 
-            ErrorReported = TRUE;
+            // 
+            // Someone claimed the slot for a different function. Keep 
+            // probing. 
+            // 
 
         }
 
-        goto Exit;
+        index = (index + 1) & (FUNCTION_TABLE_SIZE - 1);
 
     }
 
+    //
+    // Every slot is in use. Only nag the user once.
+    //
+    if (FunctionTableFullReported == FALSE) {
+
+        DbgPrint("***Out Of Function Table Entries. "\
+                 "No Longer Logging New Functions***\n"); 
+
+        FunctionTableFullReported = TRUE;
+
+    }
+
+    return NULL;
+
+Found:
+
     // 
-    // Now allocate a slot in the function traces array to store the data... 
-    //  
-    // Why do it this way? Why not just store the data in the table entry? 
-    // Wellll we need to dump this data from the debugger, and I'll be damned if 
-    // I write a debugger extension that walks a generic table and dumps out 
-    // information about each entry in it. So, we use the array to store the 
-    // data, then use the table as a quick lookup to find the entry in the array
+    // If we found the slot while its owner was still filling it in wait for 
+    // the trace entry to show up. The owner is running at SynchronizeIrql on 
+    // another processor, so this isn't going to take long 
+    // 
+    // Unless we're an ISR. Then the owner could be the code that we 
+    // interrupted, and it's never going to finish while we spin. Leave the 
+    // call untracked. 
     //  
-    funcTrace = &FuncTraces[FuncTracesInUse];
+    funcTrace = foundEntry->TraceEntry;
 
-    RtlZeroMemory(funcTrace,
-                  sizeof(FUNC_TRACE));
+    if ((funcTrace == NULL) && (currentIrql > DISPATCH_LEVEL)) {
 
-    funcTrace->StartAddress = FunctionAddress;
+        return NULL;
+
+    }
+
+    while (funcTrace == NULL) {
+
+        YieldProcessor();
+
+        funcTrace = foundEntry->TraceEntry;
+
+    }
+
+    if (funcTrace == FUNC_TRACE_UNAVAILABLE) {
+
+        return NULL;
+
+    }
 
     // 
-    // Store the trace entry in the table entry
+    // Remember it for next time. Only entries with a valid trace entry go in 
+    // the cache, so a hit never needs to check. 
     //  
-    foundEntry->TraceEntry = funcTrace;
+    perCpu->FunctionCache[cacheIndex] = foundEntry;
 
-    //
-    // Update the number of in use entries.
-    //
-    FuncTracesInUse++;
+    return foundEntry;
+
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  FunctionTableAllocateTrace
+//
+//      Allocate and initialize the FUNC_TRACE entry for a function that was
+//      just added to the function table.
+//
+//  INPUTS:
+//
+//      FunctionAddress - Start address of the function.
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      The trace entry or NULL if we're out of entries
+//
+//  IRQL:
+//
+//      SynchronizeIrql
+//
+//  NOTES:
+//
+//      Why not just store the data in the table entry? Wellll we need to dump
+//      this data from the debugger, and I'll be damned if I write a debugger
+//      extension that walks a hash table and dumps out information about each
+//      entry in it. So, we use the segmented array to store the data, then use
+//      the table as a quick lookup to find the entry in the array
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+PFUNC_TRACE
+FunctionTableAllocateTrace(
+    ULONGLONG FunctionAddress) 
+{
 
+    ULONG_PTR       index;
+    ULONG_PTR       segmentIndex;
+    PFUNC_TRACE     segment;
+    PFUNC_IRQL_STATS irqlSegment;
+    PFUNC_HISTOGRAM histogramSegment;
+    PFUNC_SLOW_CALLS slowCallsSegment;
+    PFUNC_TRACE     funcTrace;
+    ULONG           processor;
 
+    // 
+    // Reserve the next slot in the function traces array. The debugger uses 
+    // FuncTracesInUse to know how much of the array to dump, so never let 
+    // it go past the end of the segment directory 
     //  
-    // Done! 
+    do {
+
+        index = FuncTracesInUse;
+
+        if (index >= MAX_FUNC_TRACES) {
+
+            //
+            // Only nag the user once.
+            //
+            if (ErrorReported == FALSE) {
+
+                DbgPrint("***Out Of Trace Entries For Functions. "\
+                         "No Longer Logging***\n"); 
+
+                ErrorReported = TRUE;
+
+            }
+
+            return NULL;
+
+        }
+
+    } while (InterlockedCompareExchangePointer((PVOID volatile *)&FuncTracesInUse,
+                                               (PVOID)(index + 1),
+                                               (PVOID)index) != (PVOID)index);
+
+    // 
+    // First entry in a segment? Then we might be the one that needs to 
+    // allocate it. The counters live in their own segment so that the 
+    // exit path doesn't drag the rest of the trace info into the cache, 
+    // with a separate allocation for every processor so that no one 
+    // allocation grows with the size of the machine 
     //  
+    segmentIndex = (index >> FUNC_TRACE_SEGMENT_SHIFT);
+
+    for (processor = 0; processor < PerCpuCount; processor++) {
+
+        if (FunctionTableGetSegment(
+                (PVOID volatile *)&PerCpuData[processor].CounterSegments[segmentIndex],
+                FUNC_TRACE_SEGMENT_SIZE * sizeof(FUNC_COUNTERS),
+                'cFep') == NULL) {
+
+            return NULL;
+
+        }
 
-Exit:
-    if (lockedShared) {
-        ExReleaseSpinLockSharedFromDpcLevel(&FunctionTableLock);
-    } else {
-        ExReleaseSpinLockExclusiveFromDpcLevel(&FunctionTableLock);
     }
-    
-    KeLowerIrql(oldIrql);
 
-    return foundEntry;
+    irqlSegment = (PFUNC_IRQL_STATS)FunctionTableGetSegment(
+                        (PVOID volatile *)&FuncIrqlSegments[segmentIndex],
+                        FUNC_TRACE_SEGMENT_SIZE * sizeof(FUNC_IRQL_STATS),
+                        'qIep');
 
-}
+    if (irqlSegment == NULL) {
 
-_Use_decl_annotations_
-RTL_GENERIC_COMPARE_RESULTS
-FunctionTableCompareRoutine(
-    PRTL_GENERIC_TABLE Table,
-    PVOID FirstStruct,
-    PVOID SecondStruct) 
-{
+        return NULL;
 
-    PFUNCTION_TABLE_ENTRY       firstEntry;
-    PFUNCTION_TABLE_ENTRY       secondEntry;
-    RTL_GENERIC_COMPARE_RESULTS compareResult;
+    }
+
+    histogramSegment = (PFUNC_HISTOGRAM)FunctionTableGetSegment(
+                        (PVOID volatile *)&FuncHistogramSegments[segmentIndex],
+                        FUNC_TRACE_SEGMENT_SIZE * sizeof(FUNC_HISTOGRAM),
+                        'gHep');
 
-    UNREFERENCED_PARAMETER(Table);
+    if (histogramSegment == NULL) {
 
-    firstEntry  = (PFUNCTION_TABLE_ENTRY)FirstStruct;
-    secondEntry = (PFUNCTION_TABLE_ENTRY)SecondStruct;
+        return NULL;
 
-    if (firstEntry->FunctionAddress == secondEntry->FunctionAddress) {
+    }
 
-        compareResult = GenericEqual;
+    slowCallsSegment = (PFUNC_SLOW_CALLS)FunctionTableGetSegment(
+                        (PVOID volatile *)&FuncSlowCallsSegments[segmentIndex],
+                        FUNC_TRACE_SEGMENT_SIZE * sizeof(FUNC_SLOW_CALLS),
+                        'lSep');
 
-    } else if (firstEntry->FunctionAddress > secondEntry->FunctionAddress) {
+    if (slowCallsSegment == NULL) {
 
-        compareResult = GenericGreaterThan;
+        return NULL;
+
+    }
 
-    } else {
+    segment = (PFUNC_TRACE)FunctionTableGetSegment(
+                        (PVOID volatile *)&FuncTraceSegments[segmentIndex],
+                        FUNC_TRACE_SEGMENT_SIZE * sizeof(FUNC_TRACE),
+                        'sFep');
 
-        compareResult = GenericLessThan;
+    if (segment == NULL) {
+
+        return NULL;
 
     }
 
-    return compareResult;
+    // 
+    // Entries in a new segment are already zero 
+    //  
+    funcTrace = &segment[index & FUNC_TRACE_SEGMENT_MASK];
+
+    funcTrace->IrqlStats = &irqlSegment[index & FUNC_TRACE_SEGMENT_MASK];
+    funcTrace->Histogram = &histogramSegment[index & FUNC_TRACE_SEGMENT_MASK];
+    funcTrace->SlowCalls = &slowCallsSegment[index & FUNC_TRACE_SEGMENT_MASK];
+    funcTrace->StartAddress = FunctionAddress;
+    funcTrace->Index        = (ULONG)index;
+    funcTrace->FilterState  = FilterDefault;
+
+    return funcTrace;
 
 }
 
-_Use_decl_annotations_
+///////////////////////////////////////////////////////////////////////////////
+//
+//  FunctionTableGetSegment
+//
+//      Return the segment in the given directory slot, allocating it if
+//      this is the first time anyone needed it.
+//
+//  INPUTS:
+//
+//      SegmentSlot - Entry in FuncTraceSegments or one of the other 
+//                    segment directories
+//
+//      SegmentSize - Size of the segment in bytes
+//
+//      Tag         - Pool tag for the allocation
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      The segment or NULL if we couldn't allocate it
+//
+//  IRQL:
+//
+//      SynchronizeIrql
+//
+//  NOTES:
+//
+//      Segments are a multiple of PAGE_SIZE, so the pool hands them back
+//      page (and therefore cache line) aligned.
+//
+///////////////////////////////////////////////////////////////////////////////
+static
 PVOID
-FunctionTableAllocateRoutine(
-    PRTL_GENERIC_TABLE Table,
-    CLONG ByteSize) 
+FunctionTableGetSegment(
+    PVOID volatile *SegmentSlot,
+    SIZE_T          SegmentSize,
+    ULONG           Tag) 
 {
 
-    PVOID allocation;
+    PVOID segment;
+
+    segment = *SegmentSlot;
+
+    if (segment != NULL) {
 
-    UNREFERENCED_PARAMETER(Table);
+        return segment;
 
+    }
+
+    // 
+    // Can't be sure that we're the only one here, the owner of the 
+    // next entry could have gotten here first. Allocate one and try to 
+    // install it, if we lose the race use the winner's 
+    //  
 #pragma warning(suppress: 30030)
-    allocation =  ExAllocatePoolWithTag(NonPagedPool, ByteSize, 'nFep');
+    segment = ExAllocatePoolWithTag(NonPagedPool,
+                                    SegmentSize,
+                                    Tag);
 
-    return allocation;
-}
+    if (segment == NULL) {
 
+        // 
+        // We burn the entry, the debugger skips segments that were 
+        // never allocated. Someone else in this segment can try again. 
+        //  
+        DbgPrint("OSRPENTER: Trace segment allocation failed. "\
+                 "Not tracking function\n");
 
-_Use_decl_annotations_
-VOID
-FunctionTableFreeRoutine(
-    PRTL_GENERIC_TABLE Table,
-    PVOID Buffer) 
-{
+        return NULL;
 
-    UNREFERENCED_PARAMETER(Table);
+    }
 
-    ExFreePoolWithTag(Buffer,
-                      'nFep');
+    RtlZeroMemory(segment,
+                  SegmentSize);
 
-    return;
-}
+    if (InterlockedCompareExchangePointer(SegmentSlot,
+                                          segment,
+                                          NULL) != NULL) {
+
+        ExFreePoolWithTag(segment, 
+                          Tag);
+
+        segment = *SegmentSlot;
 
+    }
+
+    return segment;
+
+}
@@ -40,6 +40,11 @@
 EXTERN LogFuncEntry:PROC
 EXTERN LogFuncExit:PROC
 
+;
+; External C global that says if we should bother calling them
+;
+EXTERN TracingEnabled:DWORD
+
 ; typedef struct _ENTER_REGISTERS {
 ;     ULONGLONG R11;
 ;     ULONGLONG R10;
@@ -50,7 +55,11 @@ EXTERN LogFuncExit:PROC
 ;     ULONGLONG Rax;
 ;     ULONGLONG Rsp;
 ;     ULONGLONG ReturnRip;    
+;     PLARGE_INTEGER StartTicks;
 ; }ENTER_REGISTERS, *PENTER_REGISTERS;
+;
+; EXIT_REGISTERS is the same, except that the last field is the
+; ULONGLONG Timestamp
 
 ;
 ; We save our registers after the home/alignment space that 
@@ -67,6 +76,76 @@ RCXSave EQU 48h     ; Offset 0x28
 RAXSave EQU 50h     ; Offset 0x30
 RSPSave EQU 58h     ; Offset 0x38
 RIPSave EQU 60h     ; Offset 0x40
+TSCSave EQU 68h     ; Offset 0x48
+
+;
+; VOID
+; READ_TSC(
+;   VOID
+; );
+;
+;   Reads the time stamp counter into RAX. Trashes RDX
+;
+READ_TSC macro
+
+    rdtsc                   ; EDX:EAX = time stamp counter
+
+    shl rdx, 32             ; Put the halves together
+
+    or  rax, rdx
+
+endm
+
+;
+; VOID
+; SAVE_EXIT_TIMESTAMP(
+;   VOID
+; );
+;
+;   Reads the time stamp counter into EXIT_REGISTERS.Timestamp. This is 
+;   the first thing the exit hook does after setting up its stack, so that 
+;   as little of the hook as possible is billed to the function.
+;
+SAVE_EXIT_TIMESTAMP macro
+
+    mov RAXSave[rsp], rax   ; READ_TSC trashes these...
+    mov RDXSave[rsp], rdx
+
+    READ_TSC
+
+    mov TSCSave[rsp], rax
+
+    mov rax, RAXSave[rsp]   ; ...and the rest of the hook expects them
+    mov rdx, RDXSave[rsp]   ; intact
+
+endm
+
+;
+; VOID
+; STORE_START_TIMESTAMP(
+;   VOID
+; );
+;
+;   Reads the time stamp counter into the place that LogFuncEntry left in
+;   ENTER_REGISTERS.StartTicks, if it left one. This is the last thing the
+;   entry hook does before restoring the registers, so that as little of 
+;   the hook as possible is billed to the function.
+;
+STORE_START_TIMESTAMP macro
+
+    mov rcx, TSCSave[rsp]   ; Where does it go?
+
+    test rcx, rcx
+
+    jz @F                   ; Nowhere, skip it
+
+    READ_TSC
+
+    mov [rcx], rax
+
+@@:
+
+endm
 
 ;
 ; VOID
@@ -219,6 +298,15 @@ LEAF_ENTER macro
 
     mov RIPSave[rsp], rcx   ; Store the result as the caller's RIP
 
+    ;
+    ; The exit hook read the time stamp into its own locals before it
+    ; called us. Copy it into ours. Harmless for the entry hook, whose
+    ; StartTicks gets filled in by LogFuncEntry
+    ;
+    mov rcx, (LeafLocalsSize + 8 + TSCSave)[rsp]
+
+    mov TSCSave[rsp], rcx
+
     lea rcx, R11Save[rsp]   ; Set up the parameter to the logging function
 
 ENDM
@@ -262,6 +350,8 @@ _penter_leaf PROC FRAME
 
     call LogFuncEntry  ; Log the function entry
 
+    STORE_START_TIMESTAMP ; Start the clock
+
     LEAF_EXIT          ; Macro all the epilog stuff, it's the same
                        ; for entry/exit
 
@@ -304,15 +394,20 @@ _pexit_leaf ENDP
 ;   LeafProcessingFunction
 ; );
 ;
-;   Called by _penter/_pexit for common processing
+;   Called by _penter/_pexit for common processing. The exit hook passes
+;   TRUE for ExitHook to have the time stamp read first thing.
 ;
-HOOK_ENTER macro LeafFunction
+HOOK_ENTER macro LeafFunction, ExitHook
 
     sub rsp, EntryLocalsSize 
 
     .ALLOCSTACK EntryLocalsSize ; Generate unwind data
     
     .ENDPROLOG                  ; Done with the prolog
+
+IFNB <ExitHook>
+    SAVE_EXIT_TIMESTAMP         ; Stop the clock
+ENDIF
     
     test rsp, 8                 ; Stack aligned on an 8 byte boundary? This would mean
                                 ; a leaf function called us
@@ -370,40 +465,68 @@ ENDM
 
 ;
 ; VOID
-; _penter(
+; HOOK_CHECK(
+;   HookFunction
+; );
+;
+;   Called by _penter/_pexit to decide if there's any work to do. There 
+;   is if tracing is on.
+;
+;   The frames of calls that were in flight when tracing was turned off 
+;   are left behind, ThreadTableLookupEntry throws them away once tracing 
+;   is back on. See TracingGeneration.
+;
+;   This runs before we touch the stack, so we can only use the flags. 
+;   Everything else still belongs to the instrumented function.
+;
+HOOK_CHECK macro HookFunction
+
+    cmp TracingEnabled, 0       ; Tracing on?
+
+    jne HookFunction            ; Yes, do the work
+
+    ret                         ; Nothing to do
+
+ENDM
+
+;
+; VOID
+; _penter_hook(
 ;   VOID
 ; );
 ;
-;   Our function entry sub. Sets up the call stack and calls 
-;   LogFuncEntry
+;   Sets up the call stack and calls LogFuncEntry. Jumped to by _penter
+;   with the stack exactly as the instrumented function left it
 ;
 ALIGN   16              ; Align on a 16 byte boundary
-PUBLIC _penter
-_penter PROC FRAME
+PUBLIC _penter_hook
+_penter_hook PROC FRAME
 
     HOOK_ENTER _penter_leaf ; Common prolog code
     
     call LogFuncEntry       ; Log the function entry
 
+    STORE_START_TIMESTAMP   ; Start the clock
+
     HOOK_EXIT 
 
     ret                     ; Return
-_penter ENDP
+_penter_hook ENDP
 
 ;
 ; VOID
-; _pexit(
+; _pexit_hook(
 ;   VOID
 ; );
 ;
-;   Our function exit sub. Sets up the call stack and calls 
-;   LogFuncExit
+;   Sets up the call stack and calls LogFuncExit. Jumped to by _pexit
+;   with the stack exactly as the instrumented function left it
 ;
 ALIGN   16              ; Align on a 16 byte boundary
-PUBLIC _pexit
-_pexit PROC FRAME
+PUBLIC _pexit_hook
+_pexit_hook PROC FRAME
 
-    HOOK_ENTER _pexit_leaf  ; Common prolog code
+    HOOK_ENTER _pexit_leaf, TRUE ; Common prolog code
     
     call LogFuncExit        ; Log the function exit
 
@@ -411,8 +534,139 @@ _pexit PROC FRAME
 
     ret                     ; Return
 
+_pexit_hook ENDP
+
+;
+; VOID
+; _penter(
+;   VOID
+; );
+;
+;   Our function entry sub. Goes to _penter_hook if there's anything to 
+;   log.
+;
+;   This is a true leaf, it doesn't touch the stack, so it doesn't need any 
+;   unwind data. The jump leaves the stack as it was, so _penter_hook's
+;   alignment check and unwind data work just like they would if the 
+;   instrumented function had called it directly.
+;
+ALIGN   16              ; Align on a 16 byte boundary
+PUBLIC _penter
+_penter PROC
+
+    HOOK_CHECK _penter_hook ; Anything to do?
+
+_penter ENDP
+
+;
+; VOID
+; _pexit(
+;   VOID
+; );
+;
+;   Our function exit sub. Goes to _pexit_hook if there's anything to 
+;   log. See _penter
+;
+ALIGN   16              ; Align on a 16 byte boundary
+PUBLIC _pexit
+_pexit PROC
+
+    HOOK_CHECK _pexit_hook  ; Anything to do?
+
 _pexit ENDP
 
+;
+; VOID
+; HookOverheadOuter(
+;   PHOOK_OVERHEAD_CALLBACK Callback
+; );
+;
+;   Instrumented dummy for HookOverheadInitialize. Calls Callback, which
+;   times calls to HookOverheadLeaf and HookOverheadNonLeaf. The hooks go 
+;   around the prolog and the epilog, same as the compiler puts them with 
+;   /Gh /GH.
+;
+ALIGN   16              ; Align on a 16 byte boundary
+PUBLIC HookOverheadOuter
+HookOverheadOuter PROC FRAME
+
+    call _penter            ; Log the entry
+
+    sub rsp, 28h            ; Home space for the callback, and align the 
+                            ; stack for it
+    .ALLOCSTACK 28h         ; Generate unwind data
+
+    .ENDPROLOG              ; Done with the prolog
+
+    call rcx                ; Time the inner calls
+
+    add rsp, 28h            ; Clean up our stack space
+
+    call _pexit             ; Log the exit
+
+    ret                     ; Return
+
+HookOverheadOuter ENDP
+
+;
+; VOID
+; HookOverheadLeaf(
+;   VOID
+; );
+;
+;   Instrumented dummy for HookOverheadInitialize. An empty leaf function
+;   built with /Gh /GH, so it doesn't touch the stack and doesn't need any
+;   unwind data. Its hooks take the _penter_leaf path.
+;
+ALIGN   16              ; Align on a 16 byte boundary
+PUBLIC HookOverheadLeaf
+HookOverheadLeaf PROC
+
+    call _penter            ; Log the entry
+
+    call _pexit             ; Log the exit
+
+    ret                     ; Return
+
+HookOverheadLeaf ENDP
+
+;
+; VOID
+; HookOverheadNonLeaf(
+;   VOID
+; );
+;
+;   Instrumented dummy for HookOverheadInitialize. An empty function that
+;   sets up a stack frame, like a function that calls something, so the 
+;   stack is aligned when it calls the hooks and they take the full 
+;   HOOK_ENTER path.
+;
+;   The library keys a function on where it calls _penter, which is past
+;   the prolog here. HookOverheadNonLeafHooked marks the spot so that 
+;   HookOverheadInitialize can find the trace entry.
+;
+ALIGN   16              ; Align on a 16 byte boundary
+PUBLIC HookOverheadNonLeaf
+PUBLIC HookOverheadNonLeafHooked
+HookOverheadNonLeaf PROC FRAME
+
+    sub rsp, 28h            ; Home space, and align the stack
+    .ALLOCSTACK 28h         ; Generate unwind data
+
+    .ENDPROLOG              ; Done with the prolog
+
+HookOverheadNonLeafHooked::
+
+    call _penter            ; Log the entry
+
+    call _pexit             ; Log the exit
+
+    add rsp, 28h            ; Clean up our stack space
+
+    ret                     ; Return
+
+HookOverheadNonLeaf ENDP
+
 
 _text ENDS
 
@@ -32,15 +32,44 @@
 
 BOOLEAN    Initialized;
 BOOLEAN    Initializing;
-FUNC_TRACE FuncTraces[MAX_FUNC_TRACES];
-ULONG_PTR  FuncTracesInUse = 0;
 BOOLEAN    ErrorReported;
 
-EX_SPIN_LOCK      FunctionTableLock;
-RTL_GENERIC_TABLE FunctionTable;
+//
+// Segment directories for the FUNC_TRACE entries, their per IRQL counters
+// and histograms and the number of entries handed out so far. Every 
+// processor has its own directory for the counters, see PER_CPU_DATA. See
+// func_trace.h
+//
+PFUNC_TRACE volatile    FuncTraceSegments[MAX_FUNC_TRACE_SEGMENTS];
+PFUNC_IRQL_STATS volatile FuncIrqlSegments[MAX_FUNC_TRACE_SEGMENTS];
+PFUNC_HISTOGRAM volatile FuncHistogramSegments[MAX_FUNC_TRACE_SEGMENTS];
+PFUNC_SLOW_CALLS volatile FuncSlowCallsSegments[MAX_FUNC_TRACE_SEGMENTS];
+ULONG_PTR            FuncTracesInUse = 0;
+
+//
+// See FuncTraceShouldSample
+//
+ULONG                SampleRate = 1;
 
-EX_SPIN_LOCK      ThreadTableLock;
-RTL_GENERIC_TABLE ThreadTable;
+//
+// The hooks don't call into the library at all while this is zero. Flip it
+// from the debugger with !tracing, or from the driver with PenterSetTracing.
+//
+volatile LONG        TracingEnabled = 1;
+
+//
+// Bumped every time tracing is turned back on. The exits of the calls that
+// were in flight when it was turned off never made it to the library, so
+// their frames are left on their threads' shadow stacks. Those frames are
+// from an older generation than this, which is how ThreadTableLookupEntry
+// knows to throw them away. See TracingCallsDropped.
+//
+volatile LONG        TracingGeneration;
+
+//
+// See FUNC_FILTER_XXX
+//
+ULONG                FilterDefault = FUNC_FILTER_TRACE;
 
 //
 // ****NOTE****
@@ -58,6 +87,20 @@ RTL_GENERIC_TABLE ThreadTable;
 //
 KIRQL      SynchronizeIrql = DISPATCH_LEVEL;
 
+static
+VOID
+LogRecursionDepth(
+    PFUNC_TRACE FuncTrace,
+    ULONG       RecursionDepth
+    );
+
+static
+VOID
+LogUntimedCall(
+    PFUNC_TRACE FuncTrace,
+    KIRQL       EntryIrql
+    );
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 //  TracingLibraryInitialize
@@ -122,9 +165,59 @@ TracingLibraryInitialize(
     // Set up our globals.
     //
 
+    if (!NT_SUCCESS(PerCpuInitialize())) {
+
+        //
+        // Leave Initialized clear, the hooks won't do anything
+        //
+        DbgPrint("OSRPENTER: Per processor allocation failed. No tracing!\n");
+
+        return;
+
+    }
+
+    TimeSourceInitialize();
     FunctionTableInitialize();
     ThreadTableInitialize();
 
+    if (!NT_SUCCESS(CallGraphInitialize())) {
+
+        //
+        // Not fatal, we just won't record the call graph
+        //
+        DbgPrint("OSRPENTER: Call edge table allocation failed. No call graph\n");
+
+    }
+
+    if (!NT_SUCCESS(CallTreeInitialize())) {
+
+        //
+        // Not fatal, we just won't build the calling-context tree
+        //
+        DbgPrint("OSRPENTER: Call tree allocation failed. No call tree\n");
+
+    }
+
+    if (!NT_SUCCESS(ProcessStatsInitialize())) {
+
+        //
+        // Not fatal, we just won't count calls by process
+        //
+        DbgPrint("OSRPENTER: Process stats allocation failed. No process stats\n");
+
+    }
+
+#ifdef PENTER_STACK_WALK_ON
+    if (!NT_SUCCESS(StackTableInitialize())) {
+
+        //
+        // Not fatal, we just won't capture stacks
+        //
+        DbgPrint("OSRPENTER: Stack table allocation failed. No stack capture\n");
+
+    }
+#endif
+
     //
     // Print out a message.
     //
@@ -135,6 +228,73 @@ TracingLibraryInitialize(
     //
     Initialized = TRUE;
 
+    //
+    // Now that the hooks work, time them. This has to come after setting
+    // Initialized, it calls the hooks.
+    //
+    HookOverheadInitialize();
+
+    return;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  PenterSetTracing
+//
+//      Turn tracing on or off from the instrumented driver. Same thing as
+//      !tracing in the debugger.
+//
+//  INPUTS:
+//
+//      Enable - TRUE to turn tracing on, FALSE to turn it off.
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None
+//
+//  IRQL:
+//
+//      Any
+//
+//  NOTES:
+//
+//      Use this instead of setting TracingEnabled. Turning tracing back on
+//      has to start a new TracingGeneration first, or the frames left behind
+//      by the calls that were in flight when it was turned off would get
+//      mixed up with new ones. Those calls aren't counted, they show up in
+//      TracingCallsDropped instead.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+PenterSetTracing(
+    BOOLEAN Enable) 
+{
+
+    if (Enable == FALSE) {
+
+        InterlockedExchange(&TracingEnabled, 0);
+
+        return;
+
+    }
+
+    // 
+    // Two threads turning it on at once might both bump the generation, 
+    // which only throws away the same frames twice 
+    //  
+    if (TracingEnabled == 0) {
+
+        InterlockedIncrement(&TracingGeneration);
+
+    }
+
+    InterlockedExchange(&TracingEnabled, 1);
+
     return;
 }
 
@@ -169,16 +329,34 @@ TracingLibraryInitialize(
 #ifdef _X86_
 VOID __declspec(naked) _cdecl _penter(VOID) {
     _asm {
+        cmp  TracingEnabled, 0    ; Tracing on?
+        jne  PenterTraced
+
+        ret                       ; No, nothing to do
+
+    PenterTraced:
         push ebp
         mov  ebp, esp
         pushad            ; Push all of the general purpose registers
                           ; onto the stack
 
+        push 0            ; ENTER_REGISTERS.StartTicks, filled in by the
+                          ; C function
+
         push esp          ; Push the stack pointer, which now becomes the 
                           ; PENTER_REGISTERS paramter to the C function.
 
         call LogFuncEntry ; Call our C code that does the logging.
 
+        pop  ecx          ; Where does the start time go?
+        test ecx, ecx
+        jz   PenterNoStart
+
+        rdtsc             ; Start the clock as late as we can
+        mov  [ecx], eax
+        mov  [ecx+4], edx
+
+    PenterNoStart:
         popad             ; Restore the general purpose registers.
 
         pop ebp
@@ -222,14 +400,37 @@ LogFuncEntry(
 
     ULONGLONG             functionAddress;
     PTIME_LOGGER          timeLogger;
-    NTSTATUS              status;
+    PSHADOW_STACK         shadowStack;
+    ULONG                 depth;
+    ULONG                 i;
+    ULONG                 parentNode;
+    ULONG                 filterState = FUNC_FILTER_TRACE;
+    KIRQL                 entryIrql;
+    BOOLEAN               referencedEntry = FALSE;
+    BOOLEAN               sampled = TRUE;
+    PKTHREAD              currentThread;
     PFUNCTION_TABLE_ENTRY funcTableEntry = NULL;
     PTHREAD_TABLE_ENTRY   threadTableEntry = NULL;
+
+    // 
+    // Nowhere for the hook to put the start time until we have a frame 
+    //  
+    Registers->StartTicks = NULL;
     
     if (Initialized == FALSE) {
 
         TracingLibraryInitialize();
 
+        if (Initialized == FALSE) {
+
+            //
+            // Either initialization failed or we're being called from 
+            // inside of it
+            //
+            goto Exit;
+
+        }
+
     }
 
     //
@@ -249,115 +450,468 @@ LogFuncEntry(
     #error "Unsupported architecture"
 #endif
 
-    //
-    // Each invocation of a subroutine requires a unique tracking
-    // structure to track the start and end time. Allocate one from
-    // pool.
-    //
-
     // 
-    // 6014 - We free this in LogFuncExit
+    // Function table entries are NEVER FREED. This is by design! They live 
+    // until the driver unloads or the system reboots 
+    //  
+    // Note that we still push a frame if this fails, otherwise the exit 
+    // for this call would pop our caller's frame. 
+    // 
+    funcTableEntry = FunctionTableLookupEntry(functionAddress);
+
+    entryIrql = KeGetCurrentIrql();
+
     // 
-    // 30030 - Bad form to suppress the executable, but we're a static lib
-    // and can't enforce such things
-    //
-#pragma warning(suppress: 6014)
-#pragma warning(suppress: 30030)
-    timeLogger = (PTIME_LOGGER)ExAllocatePoolWithTag(NonPagedPool, 
-                                                     sizeof(TIME_LOGGER), 
-                                                     TIME_LOGGER_TAG);
-    if (timeLogger == NULL) {
+    // Most calls don't get sampled if the user turned sampling on, and 
+    // filtered calls don't get timed at all. All of those get counted 
+    // (unless the function is ignored) and that's it. No clock, no frame. 
+    //  
+    if (funcTableEntry != NULL) {
 
-        //
-        // Oops! Not much we can do here...
-        //
-        DbgPrint("OSRPENTER: Memory allocation failed. Not tracking call\n");
+        filterState = funcTableEntry->TraceEntry->FilterState;
 
-        status = STATUS_INSUFFICIENT_RESOURCES;
+        if (filterState == FUNC_FILTER_TRACE) {
 
-        goto Exit;
+            sampled = FuncTraceShouldSample(funcTableEntry->TraceEntry);
 
-    }
+        } else {
 
+            sampled = FALSE;
+
+        }
+
+        if ((sampled == FALSE) && (filterState != FUNC_FILTER_IGNORE)) {
+
+            LogUntimedCall(funcTableEntry->TraceEntry, entryIrql);
+
+        }
+
+    }
 
     // 
-    // Function table entries are NEVER FREED. This is by design! They live 
-    // until the driver unloads or the system reboots 
+    // Thread table entries are transient and referenced. The reference goes 
+    // away when we have no further calls outstanding from the thread. 
+    // 
+    // If the thread already has calls outstanding this is a simple lookup. 
+    // Otherwise this is the outermost call and its frame takes the reference, 
+    // to be dropped by LogFuncExit. 
     //  
-    funcTableEntry = FunctionTableLookupEntry(functionAddress);
+    currentThread = KeGetCurrentThread();
+
+    threadTableEntry = ThreadTableLookupEntry(currentThread);
+
+    if (sampled == FALSE) {
+
+        // 
+        // Let our caller's frame know that the next exit is ours and not 
+        // its own. The exits come back in the reverse order of the entries, 
+        // so a count is all that it needs. 
+        // 
+        // If we're the outermost call there's no frame to tell, but the 
+        // exit won't find a thread table entry either. If we're too deep 
+        // our caller doesn't have a frame to count us in, so just bump the 
+        // depth like any other call that's too deep. 
+        // 
+        // The thread can also have an entry with nothing on its stack. 
+        // That's an instrumented DPC or ISR that came in on top of the 
+        // outermost call after it referenced the entry but before it 
+        // pushed its frame, or after its exit popped the frame but before 
+        // it let the entry go. There's no frame to tell then either, and 
+        // the exit finds the stack just as empty. 
+        //  
+        if (threadTableEntry == NULL) {
+
+            goto Exit;
 
-    if (funcTableEntry == NULL) {
+        }
+
+        shadowStack = threadTableEntry->ShadowStack;
+
+        depth = shadowStack->Depth;
+
+        if (depth == 0) {
+
+            goto Exit;
+
+        }
 
-        DbgPrint("OSRPENTER: Memory allocation failed. Not tracking call\n");
+        if (depth <= MAX_CALL_DEPTH) {
 
-        status = STATUS_INSUFFICIENT_RESOURCES;
+            shadowStack->Frames[depth - 1].FramelessCalls++;
+
+        } else {
+
+            shadowStack->Depth = depth + 1;
+
+        }
 
         goto Exit;
 
     }
-    
+
+#ifdef PENTER_STACK_WALK_ON
     // 
-    // Thread table entries are transient and reference counted. They go away 
-    // when we have no further calls outstanding from the thread 
+    // Count the stack that got us here if the user asked for it. Do it 
+    // before we start the clock so the stack walk isn't billed to the 
+    // function 
     //  
-    threadTableEntry = ThreadTableLookupEntry(PsGetCurrentThreadId(),
-                                              LookupActionCreateIfNotFound);
+    if ((StackCaptureFrames != 0) && (funcTableEntry != NULL)) {
+
+        StackCaptureRecord(funcTableEntry->TraceEntry,
+                           (ULONG_PTR)(functionAddress + 5));
+
+    }
+#endif
 
     if (threadTableEntry == NULL) {
 
-        DbgPrint("OSRPENTER: Memory allocation failed. Not tracking call\n");
+        threadTableEntry = ThreadTableEntryReference(currentThread);
+
+        if (threadTableEntry == NULL) {
+
+            DbgPrint("OSRPENTER: No thread tracking available. Not tracking call\n");
+
+            goto Exit;
+
+        }
+
+        referencedEntry = TRUE;
+
+    }
+
+    shadowStack = threadTableEntry->ShadowStack;
+
+    // 
+    // Claim our slot on the shadow stack BEFORE we fill it in. We're the only 
+    // thread that ever touches this stack, but an instrumented DPC or ISR 
+    // can come in on top of us and will push its own frames. Bumping the 
+    // depth first means it pushes above us instead of over us 
+    // 
+    depth = shadowStack->Depth;
+    shadowStack->Depth = depth + 1;
+
+    if (depth >= MAX_CALL_DEPTH) {
 
-        status = STATUS_INSUFFICIENT_RESOURCES;
+        // 
+        // Too deep to track. The depth still counts the call so that the 
+        // exit lines up, but there's nowhere to put the timing info. 
+        // 
+        // Note that this can't be the frame that took the reference, an 
+        // unreferenced entry always starts out empty. 
+        // 
+        ASSERT(referencedEntry == FALSE);
+
+        InterlockedIncrement(&ShadowStackOverflows);
 
         goto Exit;
 
     }
 
+    timeLogger = &shadowStack->Frames[depth];
+
     //
     // Store the referenced function table entry
     //
-    timeLogger->FunctionEntry = funcTableEntry;
+    timeLogger->FunctionEntry          = funcTableEntry;
+    timeLogger->ReferencedEntry        = referencedEntry;
+    timeLogger->DescendantHookOverhead = 0;
+    timeLogger->ChildTicks             = 0;
+    timeLogger->RecursionDepth         = 0;
+    timeLogger->FramelessCalls         = 0;
+    timeLogger->InterruptTicks         = 0;
+    timeLogger->EntryIrql              = entryIrql;
+    timeLogger->Interrupt              = FALSE;
+    timeLogger->Leaf                   = ENTER_REGISTERS_FROM_LEAF(Registers);
+    timeLogger->StartCycles            = 0;
+    timeLogger->CountProcess           = FALSE;
 
     // 
-    // And the referenced thread table entry 
+    // Coming in above the IRQL of the frame below us means that either it 
+    // raised and called us or that we're a DPC or ISR that interrupted it. 
+    // Only the second one isn't really a call. We can't interrupt anything 
+    // at DISPATCH_LEVEL without being in a DPC, and anything above that is 
+    // an ISR (or something synchronized with one, which we'll live with). 
+    //  
+    if ((depth != 0) && 
+        (entryIrql > shadowStack->Frames[depth - 1].EntryIrql)) {
+
+        timeLogger->Interrupt = (BOOLEAN)((entryIrql > DISPATCH_LEVEL) || 
+                                          KeIsExecutingDpc());
+
+    }
+
     // 
-    timeLogger->ThreadEntry   = threadTableEntry; 
+    // See if an outer call of the same function is still running on this 
+    // thread. The closest one tells us how deep we are. Its inclusive time 
+    // already covers ours, so we'll only count our self time. 
+    // 
+    // Don't look past a DPC or ISR, anything below it isn't ours. 
+    //  
+    if ((funcTableEntry != NULL) && (timeLogger->Interrupt == FALSE)) {
 
-    //
-    // Capture the performance counter. 
-    //
-    timeLogger->StartTicks = KeQueryPerformanceCounter(NULL);
+        for (i = depth; i > 0; i--) {
+
+            if (shadowStack->Frames[i - 1].FunctionEntry == funcTableEntry) {
+
+                timeLogger->RecursionDepth = 
+                            shadowStack->Frames[i - 1].RecursionDepth + 1;
+
+                LogRecursionDepth(funcTableEntry->TraceEntry,
+                                  timeLogger->RecursionDepth);
+
+                break;
+
+            }
+
+            if (shadowStack->Frames[i - 1].Interrupt != FALSE) {
+
+                break;
+
+            }
+
+        }
+
+    }
+
+    // 
+    // Move the thread's cursor down the calling-context tree. Our caller's 
+    // frame already has its node, so this is a lookup of a single child 
+    // and not of the whole stack. 
+    //  
+    timeLogger->CallTreeNode = CALL_TREE_NODE_NONE;
+
+    if ((funcTableEntry != NULL) && (CallTree != NULL)) {
+
+        // 
+        // A DPC or ISR starts a new path, it wasn't called by the frame 
+        // below it 
+        //  
+        parentNode = ((depth == 0) || (timeLogger->Interrupt != FALSE)) ? 
+                            CALL_TREE_NODE_ROOT : 
+                            shadowStack->Frames[depth - 1].CallTreeNode;
+
+        // 
+        // If our caller's frame has frameless calls outstanding, it didn't 
+        // call us. One of those did, or something that they called. Put 
+        // the gap in the path instead of making us its child. 
+        //  
+        if ((parentNode != CALL_TREE_NODE_NONE) && 
+            (parentNode != CALL_TREE_NODE_ROOT) && 
+            (shadowStack->Frames[depth - 1].FramelessCalls != 0)) {
+
+            parentNode = CallTreeLookupChild(parentNode, NULL);
+
+        }
+
+        if (parentNode != CALL_TREE_NODE_NONE) {
+
+            timeLogger->CallTreeNode = 
+                        CallTreeLookupChild(parentNode,
+                                            funcTableEntry->TraceEntry);
+
+        }
+
+    }
+
+    // 
+    // Remember whose call this is if the user wants calls counted by 
+    // process 
+    //  
+    if ((ProcessStatsEnabled != 0) && 
+        (ProcessStatsTable != NULL) && 
+        (funcTableEntry != NULL)) {
+
+        timeLogger->ProcessId    = ProcessStatsGetProcessId(entryIrql);
+        timeLogger->CountProcess = TRUE;
+
+    }
 
     // 
-    // Push onto the thread call list 
+    // Log the entry on the timeline before we start the clock, so that it 
+    // isn't billed to the function 
     //  
-    PushEntryList(&threadTableEntry->CallList,
-                  &timeLogger->ListEntry);
+    if ((TimelineMode != TIMELINE_MODE_OFF) && (funcTableEntry != NULL)) {
+
+        TimelineRecord(funcTableEntry->TraceEntry->Index,
+                       PenterGetTimestamp());
+
+    }
 
     // 
-    // Success! 
+    // Note how long the thread has run so far, so that the exit can tell 
+    // how much of the call was spent blocked. Only calls below 
+    // DISPATCH_LEVEL can block, and thread cycles are only comparable to 
+    // the clock if the clock is the TSC. 
     //  
-    status = STATUS_SUCCESS;
+    if ((funcTableEntry != NULL) && 
+        (entryIrql < DISPATCH_LEVEL) && 
+        (TimeCalibration.TimeSource == PENTER_TIME_SOURCE_TSC)) {
+
+        KeQueryThreadCycleTime(KeGetCurrentThread(), 
+                               &timeLogger->StartCycles);
+
+    }
+
+    //
+    // Capture the start time. On the TSC the hook does that on its way 
+    // out, see ENTER_REGISTERS. 
+    //
+    if (TimeCalibration.TimeSource == PENTER_TIME_SOURCE_TSC) {
+
+        Registers->StartTicks = &timeLogger->StartTicks;
+
+    } else {
+
+        timeLogger->StartTicks.QuadPart = PenterGetTimestamp();
+
+    }
 
 Exit:
 
-    if (!NT_SUCCESS(status)) {
+    return;
+}
+
 
-        if (timeLogger != NULL) {
+///////////////////////////////////////////////////////////////////////////////
+//
+//  LogRecursionDepth
+//
+//      Remember the deepest recursion seen for a function.
+//
+//  INPUTS:
+//
+//      FuncTrace      - Trace entry of the function.
+//
+//      RecursionDepth - Depth of the current call.
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None
+//
+//  IRQL:
+//
+//      IRQL <= SynchronizeIrql
+//
+//  NOTES:
+//
+//      The max is shared by all processors, but it only changes when a
+//      recursion goes deeper than ever before so that's OK.
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+VOID
+LogRecursionDepth(
+    PFUNC_TRACE FuncTrace,
+    ULONG       RecursionDepth) 
+{
 
-            ExFreePool(timeLogger);
+    LONG maxDepth;
+    LONG previousMax;
 
-        }
+    maxDepth = FuncTrace->MaxRecursionDepth;
+
+    while ((LONG)RecursionDepth > maxDepth) {
+
+        previousMax = InterlockedCompareExchange(&FuncTrace->MaxRecursionDepth,
+                                                 (LONG)RecursionDepth,
+                                                 maxDepth);
 
-        if (threadTableEntry != NULL) {
+        if (previousMax == maxDepth) {
 
-            ThreadTableEntryDereference(threadTableEntry);
+            break;
 
         }
 
+        maxDepth = previousMax;
+
     }
 
     return;
+
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  LogUntimedCall
+//
+//      Count a call that doesn't get timed, either because it wasn't
+//      sampled or because its function is filtered to FUNC_FILTER_COUNT.
+//
+//  INPUTS:
+//
+//      FuncTrace - Trace entry of the function.
+//
+//      EntryIrql - IRQL that the call was entered at.
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None
+//
+//  IRQL:
+//
+//      IRQL <= SynchronizeIrql
+//
+//  NOTES:
+//
+//      The call is counted on the way in, because it doesn't get a frame
+//      and its exit doesn't know which function it's for. See LogFuncExit
+//      for why the counters are safe to update this way.
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+VOID
+LogUntimedCall(
+    PFUNC_TRACE FuncTrace,
+    KIRQL       EntryIrql) 
+{
+
+    PFUNC_COUNTERS funcCounters;
+    KIRQL          oldIrql;
+
+    if (EntryIrql < DISPATCH_LEVEL) {
+
+        KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+
+    }
+
+    funcCounters = FuncCountersGetShard(FuncTrace, PerCpuGetCurrentIndex());
+
+    funcCounters->CallCount++;
+
+    if (EntryIrql < DISPATCH_LEVEL) {
+
+        KeLowerIrql(oldIrql);
+
+    }
+
+    if (EntryIrql != PASSIVE_LEVEL) {
+
+        InterlockedIncrement64(
+            &FuncTrace->IrqlStats->Irql[FUNC_IRQL_CLASS(EntryIrql) - 1].CallCount);
+
+    }
+
+    if ((ProcessStatsEnabled != 0) && (ProcessStatsTable != NULL)) {
+
+        ProcessStatsRecord(FuncTrace,
+                           ProcessStatsGetProcessId(EntryIrql),
+                           FALSE,
+                           0,
+                           0);
+
+    }
+
+    return;
+
 }
 
 
@@ -391,17 +945,29 @@ Exit:
 #ifdef _X86_
 VOID __declspec(naked) _cdecl _pexit(VOID) {
     _asm {
+        cmp  TracingEnabled, 0    ; Tracing on?
+        jne  PexitTraced
+
+        ret                       ; No, nothing to do
+
+    PexitTraced:
         push ebp
         mov  ebp, esp
 
         pushad            ; Push all of the general purpose registers
                           ; onto the stack
 
+        rdtsc             ; Stop the clock as early as we can and push it
+        push edx          ; as EXIT_REGISTERS.Timestamp
+        push eax
+
         push esp          ; Push the stack pointer, which now becomes the 
                           ; PENTER_REGISTERS paramter to the C function.
 
         call LogFuncExit  ; Call our C code that does the logging.
 
+        add  esp, 8       ; Pop the time stamp
+
         popad             ; Restore the general purpose registers.
         
         pop ebp
@@ -446,12 +1012,21 @@ LogFuncExit(
 {
 
     LARGE_INTEGER         endTicks;
-    PTIME_LOGGER          timeLogger = NULL;
+    LONGLONG              elapsedTicks;
+    LONGLONG              rawTicks;
+    LONGLONG              cpuTicks;
+    ULONG64               endCycles;
+    TIME_LOGGER           timeLogger;
+    PSHADOW_STACK         shadowStack;
+    ULONG                 depth;
     PTHREAD_TABLE_ENTRY   threadTableEntry = NULL;
-    PFUNC_TRACE           funcTrace = NULL;
-    PFUNCTION_TABLE_ENTRY funcTableEntry = NULL;
-
-    UNREFERENCED_PARAMETER(Registers);
+    PFUNC_COUNTERS        funcCounters;
+    PFUNC_IRQL_COUNTERS   irqlCounters;
+    PFUNC_SLOW_CALLS      slowCalls;
+    PFUNCTION_TABLE_ENTRY callerEntry = NULL;
+    ULONG                 processor;
+    KIRQL                 currentIrql;
+    KIRQL                 oldIrql;
 
     //
     // Bail if we're not set up.
@@ -463,83 +1038,367 @@ LogFuncExit(
     }
 
     //
-    // Capture the performance counter at the end of the subroutine
-    // call.
+    // Capture the time at the end of the subroutine call. On the TSC the 
+    // hook already did, see EXIT_REGISTERS. 
     //
-    endTicks = KeQueryPerformanceCounter(NULL);
+    if (TimeCalibration.TimeSource == PENTER_TIME_SOURCE_TSC) {
+
+        endTicks.QuadPart = (LONGLONG)Registers->Timestamp;
+
+    } else {
+
+        endTicks.QuadPart = PenterGetTimestamp();
+
+    }
 
     // 
-    // Get the thread table entry for the current thread 
+    // Get the thread table entry for the current thread. Our frame holds it 
+    // referenced, so it's not going anywhere 
     //  
-    threadTableEntry = ThreadTableLookupEntry(PsGetCurrentThreadId(),
-                                              LookupActionFailIfNotFound);
+    threadTableEntry = ThreadTableLookupEntry(KeGetCurrentThread());
 
     if (threadTableEntry == NULL) {
 
-        DbgPrint("OSRPENTER: Thread table entry not found??\n");
+        // 
+        // The entry for this call never pushed a frame, or the frame is 
+        // gone. Either the call came in while tracing was off, tracing was 
+        // turned off and back on since it came in, or there was no thread 
+        // tracking available (which the entry already complained about) 
+        //  
+        goto Exit;
+
+    }
 
+    shadowStack = threadTableEntry->ShadowStack;
+
+    if (shadowStack->Depth == 0) {
+
+        // 
+        // Nothing to pop. This is the exit of a call that didn't get 
+        // sampled and came in on top of the outermost call while it was 
+        // pushing or popping its frame, see LogFuncEntry. It didn't push 
+        // anything either. 
+        //  
         goto Exit;
 
     }
 
+    //
+    // Pop our frame off of the shadow stack. Copy it out BEFORE we drop the 
+    // depth, an instrumented DPC or ISR coming in on top of us would 
+    // otherwise be free to reuse the slot 
+    //
+    depth = shadowStack->Depth - 1;
+
     // 
-    // Drop the reference that we just received to the table entry from the 
-    // lookup...We don't need it, we have a reference to the entry dangling 
-    // from the function entry logging routine (we acquire a reference there 
-    // and leave it so that the thread tracking structure won't go 
-    // away...unfortunately we can't pass that as a context here, so we end 
-    // up with this double reference situation) 
+    // Is this the exit of a filtered call that never pushed a frame? Then 
+    // the frame on top is our caller's and isn't ours to pop, it just has 
+    // one less of those outstanding. 
+    // 
+    // An instrumented DPC or ISR can come in between the read and the 
+    // write, but it leaves the count the way it found it. 
     //  
-    ThreadTableEntryDereference(threadTableEntry);
+    if ((depth < MAX_CALL_DEPTH) && 
+        (shadowStack->Frames[depth].FramelessCalls != 0)) {
 
-    //
-    // Get the time logger by popping the call stack queue
-    //
-    timeLogger = (PTIME_LOGGER)PopEntryList(&threadTableEntry->CallList); 
+        shadowStack->Frames[depth].FramelessCalls--;
+
+        goto Exit;
+
+    }
+
+    if (depth < MAX_CALL_DEPTH) {
+
+        timeLogger = shadowStack->Frames[depth];
+
+    } else {
+
+        // 
+        // Call was too deep to be recorded 
+        // 
+        timeLogger.FunctionEntry          = NULL;
+        timeLogger.ReferencedEntry        = FALSE;
+        timeLogger.DescendantHookOverhead = 0;
+        timeLogger.StartTicks             = endTicks;
+        timeLogger.ChildTicks             = 0;
+        timeLogger.RecursionDepth         = 0;
+        timeLogger.CallTreeNode           = CALL_TREE_NODE_NONE;
+        timeLogger.FramelessCalls         = 0;
+        timeLogger.InterruptTicks         = 0;
+        timeLogger.EntryIrql              = PASSIVE_LEVEL;
+        timeLogger.Interrupt              = FALSE;
+        timeLogger.Leaf                   = FALSE;
+        timeLogger.StartCycles            = 0;
+        timeLogger.CountProcess           = FALSE;
+
+    }
+
+    rawTicks = endTicks.QuadPart - timeLogger.StartTicks.QuadPart;
+
+    if (rawTicks < 0) {
+
+        // 
+        // Moved to a processor whose clock is a hair behind 
+        //  
+        rawTicks = 0;
+
+    }
 
     // 
-    // Get the function table information 
+    // DPCs and ISRs that came in on top of us aren't part of the call 
+    //  
+    elapsedTicks = rawTicks - timeLogger.InterruptTicks;
+
+    if (elapsedTicks < 0) {
+
+        elapsedTicks = 0;
+
+    }
+
+    // 
+    // Let our caller know what the hooks of the instrumented calls that it 
+    // made through us cost it, ours included, and how long we took. It uses 
+    // that to back out the hook overhead and to figure out its own self 
+    // time. 
     // 
-    funcTableEntry = timeLogger->FunctionEntry; 
+    // If we're a DPC or ISR we didn't get called at all, the frame below 
+    // us just has to leave all of our time out. 
+    // 
+    if ((depth != 0) && ((depth - 1) < MAX_CALL_DEPTH)) {
+
+        if (timeLogger.Interrupt != FALSE) {
+
+            shadowStack->Frames[depth - 1].InterruptTicks += rawTicks;
+
+        } else {
+
+            shadowStack->Frames[depth - 1].DescendantHookOverhead += 
+                            timeLogger.DescendantHookOverhead + 
+                            ((timeLogger.Leaf != FALSE) ? 
+                                        TimeCalibration.HookOverheadLeaf : 
+                                        TimeCalibration.HookOverhead);
+
+            shadowStack->Frames[depth - 1].ChildTicks += elapsedTicks;
+
+            shadowStack->Frames[depth - 1].InterruptTicks += 
+                                            timeLogger.InterruptTicks;
+
+            // 
+            // The frame below us only called us if it has no frameless 
+            // calls outstanding. Otherwise one of those did, or something 
+            // that they called, and there's no telling which function that 
+            // was. Leave the edge out rather than make one up. 
+            //  
+            if (shadowStack->Frames[depth - 1].FramelessCalls == 0) {
+
+                callerEntry = shadowStack->Frames[depth - 1].FunctionEntry;
+
+            }
+
+        }
+
+    }
+
+    shadowStack->Depth = depth;
+
+    if (timeLogger.ReferencedEntry != FALSE) {
+
+        // 
+        // This was the outermost call on the thread. Let the entry go, 
+        // it's the last time we touch it 
+        //  
+        ThreadTableEntryDereference(threadTableEntry);
+
+    }
+
+    if (timeLogger.FunctionEntry == NULL) {
+
+        goto Exit;
+
+    }
+
+    if (timeLogger.CountProcess != FALSE) {
+
+        ProcessStatsRecord(timeLogger.FunctionEntry->TraceEntry,
+                           timeLogger.ProcessId,
+                           TRUE,
+                           (timeLogger.RecursionDepth == 0) ? elapsedTicks : 0,
+                           elapsedTicks - timeLogger.ChildTicks);
+
+    }
+
+    if (TimelineMode != TIMELINE_MODE_OFF) {
+
+        TimelineRecord(timeLogger.FunctionEntry->TraceEntry->Index | 
+                                                    TIMELINE_EVENT_EXIT,
+                       endTicks.QuadPart);
+
+    }
 
     // 
-    // And the trace info 
+    // Update this processor's copy of the counters. Nobody else updates 
+    // them, so we can use plain adds as long as we don't get moved to 
+    // another processor halfway through. Raise to make sure of that. 
     // 
-    funcTrace = funcTableEntry->TraceEntry; 
+    // The only thing that can still get in is an instrumented interrupt 
+    // returning from this same function between our read and write. That's 
+    // rare enough that we'll live with losing the odd call. 
+    // 
+    currentIrql = KeGetCurrentIrql();
 
-    //
-    // Add the delta in.
-    //
-    InterlockedExchangeAdd64(
-            &funcTrace->CallTicks.QuadPart,
-            (endTicks.QuadPart - timeLogger->StartTicks.QuadPart));
+    // 
+    // Figure out how much of the call the thread actually ran for. The 
+    // thread isn't charged for any DPC or ISR, but elapsedTicks only has 
+    // the instrumented ones taken out. The rest show up in the difference
+    // along with the time spent blocked. If we didn't get a start reading
+    // the call couldn't block and all of it was on the processor. 
+    //  
+    cpuTicks = elapsedTicks;
+
+    if ((timeLogger.StartCycles != 0) && (currentIrql <= DISPATCH_LEVEL)) {
+
+        KeQueryThreadCycleTime(KeGetCurrentThread(), &endCycles);
+
+        cpuTicks = (LONGLONG)(endCycles - timeLogger.StartCycles);
+
+        if (cpuTicks < 0) {
+
+            cpuTicks = 0;
+
+        } else if (cpuTicks > elapsedTicks) {
+
+            // 
+            // The thread's cycles get read a bit before the clock on the 
+            // way in and a bit after it on the way out 
+            //  
+            cpuTicks = elapsedTicks;
+
+        }
+
+    }
+
+    if (currentIrql < DISPATCH_LEVEL) {
+
+        KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+
+    }
+
+    processor = PerCpuGetCurrentIndex();
+
+    funcCounters = FuncCountersGetShard(timeLogger.FunctionEntry->TraceEntry,
+                                        processor);
 
     // 
-    // Bump the call count 
+    // Calls that weren't sampled were counted on the way in and never got 
+    // here 
     //  
-    InterlockedIncrement((volatile LONG *)&funcTrace->CallCount);
+    funcCounters->CallCount++;
+
+    funcCounters->SampledCount++;
 
     //
-    // Done!
+    // Add the delta in, with and without the children. If we're a 
+    // recursive call the outermost call will count our time (and our 
+    // descendants) when it returns. 
     //
+    if (timeLogger.RecursionDepth == 0) {
 
-Exit:
+        funcCounters->CallTicks.QuadPart += elapsedTicks;
 
-    if (timeLogger != NULL) {
+        funcCounters->DescendantHookOverhead += 
+                                    timeLogger.DescendantHookOverhead;
 
-        ExFreePool(timeLogger);
+        funcCounters->CpuTicks += (ULONGLONG)cpuTicks;
 
     }
 
-    if (threadTableEntry != NULL) {
+    funcCounters->SelfTicks.QuadPart += (elapsedTicks - timeLogger.ChildTicks);
 
-        ThreadTableEntryDereference(threadTableEntry);
+    if ((ULONGLONG)elapsedTicks > funcCounters->MaxTicks) {
+
+        funcCounters->MaxTicks = (ULONGLONG)elapsedTicks;
 
     }
 
-    return;
-}
+    // 
+    // Most calls aren't among the slowest, a single compare tells us that 
+    //  
+    slowCalls = timeLogger.FunctionEntry->TraceEntry->SlowCalls;
+
+    if (elapsedTicks > slowCalls->ThresholdTicks) {
+
+        SlowCallsRecord(slowCalls, 
+                        elapsedTicks,
+                        timeLogger.StartTicks.QuadPart,
+                        processor,
+                        timeLogger.EntryIrql,
+                        currentIrql);
+
+    }
+
+    if (currentIrql < DISPATCH_LEVEL) {
+
+        KeLowerIrql(oldIrql);
+
+    }
+
+    // 
+    // The histogram is shared, a copy per processor would be too big. 
+    // Every call counts here, recursive or not. 
+    //  
+    InterlockedIncrement64(
+        &timeLogger.FunctionEntry->TraceEntry->Histogram->Buckets[
+                            FuncHistogramBucket((ULONGLONG)elapsedTicks)]);
 
+    // 
+    // Same for the per IRQL counters. Calls at PASSIVE_LEVEL are what's 
+    // left of the totals, so they skip this. 
+    //  
+    if (timeLogger.EntryIrql != PASSIVE_LEVEL) {
+
+        irqlCounters = &timeLogger.FunctionEntry->TraceEntry->IrqlStats->Irql[
+                                FUNC_IRQL_CLASS(timeLogger.EntryIrql) - 1];
+
+        InterlockedIncrement64(&irqlCounters->CallCount);
+
+        InterlockedIncrement64(&irqlCounters->SampledCount);
+
+        if (timeLogger.RecursionDepth == 0) {
+
+            InterlockedAdd64(&irqlCounters->CallTicks, elapsedTicks);
+
+        }
+
+        InterlockedAdd64(&irqlCounters->SelfTicks, 
+                         elapsedTicks - timeLogger.ChildTicks);
+
+    }
+
+    // 
+    // Count the call against the edge from our caller. Only the outermost 
+    // call of a recursion adds time, same as CallTicks. 
+    //  
+    if ((callerEntry != NULL) && (CallEdgeTable != NULL)) {
+
+        CallGraphRecord(callerEntry->TraceEntry,
+                        timeLogger.FunctionEntry->TraceEntry,
+                        (timeLogger.RecursionDepth == 0) ? elapsedTicks : 0);
+
+    }
+
+    if (timeLogger.CallTreeNode != CALL_TREE_NODE_NONE) {
+
+        CallTreeRecord(timeLogger.CallTreeNode,
+                       elapsedTicks,
+                       elapsedTicks - timeLogger.ChildTicks);
+
+    }
 
+    //
+    // Done!
+    //
 
+Exit:
 
+    return;
+}
@@ -32,8 +32,6 @@
 #ifndef __PENTER_H__
 #define __PENTER_H__
 
-#define RTL_USE_AVL_TABLES 0
-
 #include <ntddk.h>
 
 //
@@ -104,9 +102,21 @@ RtlCaptureStackBackTrace(
 #define WHILE_CONSTANT(constant) \
 __pragma(warning(disable: 4127)) while(constant); __pragma(warning(default: 4127))
 
+//
+// The hooks read the time stamp counter themselves, so that as little of 
+// the hook as possible gets billed to the function. 
+//
+// The exit hook reads it first thing and passes it in Timestamp. The entry 
+// hook can't pass its time stamp in, it would have to read it before the 
+// work that it's trying to leave out. Instead LogFuncEntry leaves the 
+// address of the frame's StartTicks in StartTicks and the hook fills it in 
+// last thing, just before it returns. NULL means nowhere, for example
+// because the library isn't using the TSC.
+//
 #ifdef _X86_
 
 typedef struct _ENTER_REGISTERS {
+    PLARGE_INTEGER StartTicks;
     ULONG Edi;
     ULONG Esi;
     ULONG Ebp;
@@ -120,7 +130,13 @@ typedef struct _ENTER_REGISTERS {
     ULONG CalleeEip;
 }ENTER_REGISTERS, *PENTER_REGISTERS;
 
+//
+// Every call goes through the same path on the x86
+//
+#define ENTER_REGISTERS_FROM_LEAF(Registers) FALSE
+
 typedef struct _EXIT_REGISTERS {
+    ULONGLONG Timestamp;
     ULONG Edi;
     ULONG Esi;
     ULONG Ebp;
@@ -148,12 +164,24 @@ typedef struct _ENTER_REGISTERS {
     
     ULONGLONG ReturnRip;
 
+    PLARGE_INTEGER StartTicks;
+
 }ENTER_REGISTERS, *PENTER_REGISTERS;
 
 //
 // Assembly code has baked in assumption
 //
-C_ASSERT(sizeof(ENTER_REGISTERS) <= 0x60);
+C_ASSERT(sizeof(ENTER_REGISTERS) <= 0x50);
+C_ASSERT(FIELD_OFFSET(ENTER_REGISTERS, StartTicks) == 0x48);
+
+//
+// A leaf function calls _penter first thing, on the stack that it was called
+// on, so the return address lands on a 16 byte boundary. A non-leaf function
+// aligns its stack first. Leaf calls go through _penter_leaf, see HOOK_ENTER,
+// and cost less.
+//
+#define ENTER_REGISTERS_FROM_LEAF(Registers) \
+                        ((BOOLEAN)(((Registers)->Rsp & 0xF) == 0))
 
 typedef struct _EXIT_REGISTERS {
     ULONGLONG R11;
@@ -165,75 +193,580 @@ typedef struct _EXIT_REGISTERS {
     ULONGLONG Rax;
     ULONGLONG Rsp;
     ULONGLONG ReturnRip;    
+    ULONGLONG Timestamp;
 }EXIT_REGISTERS, *PEXIT_REGISTERS;
 
 //
 // Assembly code has baked in assumption
 //
-C_ASSERT(sizeof(EXIT_REGISTERS) <= 0x60);
+C_ASSERT(sizeof(EXIT_REGISTERS) <= 0x50);
+C_ASSERT(FIELD_OFFSET(EXIT_REGISTERS, Timestamp) == 0x48);
 
 #endif
 
-typedef struct _FUNCTION_TABLE_ENTRY {
+//
+// The function table is a fixed size, open addressed hash table keyed by
+// function address. Lookups are lock free, inserts claim an empty slot with a
+// compare exchange. Entries are never deleted.
+//
+// Must be a power of two and should be at least twice MAX_FUNC_TRACES to
+// keep the probe sequences short.
+//
+#define FUNCTION_TABLE_SHIFT 15
+#define FUNCTION_TABLE_SIZE  (1 << FUNCTION_TABLE_SHIFT)
 
-    ULONGLONG     FunctionAddress;
+C_ASSERT(FUNCTION_TABLE_SIZE >= (2 * MAX_FUNC_TRACES));
 
-    PFUNC_TRACE   TraceEntry;
+//
+// Stored in the TraceEntry of a claimed slot when we ran out of FUNC_TRACE
+// entries for it
+//
+#define FUNC_TRACE_UNAVAILABLE ((PFUNC_TRACE)(ULONG_PTR)1)
 
-}FUNCTION_TABLE_ENTRY, *PFUNCTION_TABLE_ENTRY;
+typedef struct DECLSPEC_ALIGN(16) _FUNCTION_TABLE_ENTRY {
 
-typedef struct _THREAD_TABLE_ENTRY {
+    //
+    // Zero if the slot is free. Set exactly once by whoever claims the slot.
+    //
+    volatile ULONGLONG     FunctionAddress;
 
-    ULONGLONG         ThreadId;
+    //
+    // NULL until the claiming thread finishes setting up the trace entry
+    //
+    PFUNC_TRACE volatile   TraceEntry;
 
-    volatile LONG     RefCount;
+}FUNCTION_TABLE_ENTRY, *PFUNCTION_TABLE_ENTRY;
 
-    SINGLE_LIST_ENTRY CallList;
+//
+// Fibonacci hash of an address into a table of (1 << Shift) entries. The low
+// bits of the addresses that we hash are mostly alignment, so use the high 
+// bits of the product.
+//
+FORCEINLINE
+ULONG
+PenterHash(
+    ULONGLONG Value,
+    ULONG     Shift
+    )
+{
+    return (ULONG)((Value * 0x9E3779B97F4A7C15ULL) >> (64 - Shift));
+}
 
-}THREAD_TABLE_ENTRY, *PTHREAD_TABLE_ENTRY;
+FORCEINLINE
+ULONG
+FunctionTableHash(
+    ULONGLONG FunctionAddress
+    )
+{
+    return PenterHash(FunctionAddress, FUNCTION_TABLE_SHIFT);
+}
 
+//
+// Each processor has a small, direct mapped cache in front of the function
+// table. Must be a power of two.
+//
+#define FUNCTION_CACHE_SHIFT 6
+#define FUNCTION_CACHE_SIZE  (1 << FUNCTION_CACHE_SHIFT)
+
+FORCEINLINE
+ULONG
+FunctionCacheHash(
+    ULONGLONG FunctionAddress
+    )
+{
+    return PenterHash(FunctionAddress, FUNCTION_CACHE_SHIFT);
+}
+
+//
+// One frame on a thread's shadow stack. Tracks the start time of a single
+// invocation of a function.
+//
 typedef struct _TIME_LOGGER {
 
-    SINGLE_LIST_ENTRY     ListEntry;
     PFUNCTION_TABLE_ENTRY FunctionEntry;
-    PTHREAD_TABLE_ENTRY   ThreadEntry;
     LARGE_INTEGER         StartTicks;
 
+    //
+    // Cost of the hooks of the instrumented calls made by this invocation,
+    // at any depth, see TIME_CALIBRATION. Children add theirs (plus their
+    // own hooks) in when they return.
+    //
+    ULONGLONG             DescendantHookOverhead;
+
+    //
+    // Time spent in instrumented children of this invocation. Children add
+    // their elapsed time in when they return.
+    //
+    LONGLONG              ChildTicks;
+
+    //
+    // Number of outer invocations of the same function still running on
+    // this thread. Non-zero means that this is a recursive call, which
+    // doesn't count towards the function's inclusive time.
+    //
+    ULONG                 RecursionDepth;
+
+    //
+    // Set if this frame took the reference on the thread table entry and
+    // must drop it on exit
+    //
+    BOOLEAN               ReferencedEntry;
+
+    //
+    // This invocation's node in the calling-context tree. Our children
+    // start their lookup from here.
+    //
+    ULONG                 CallTreeNode;
+
+    //
+    // Number of calls made by this invocation that didn't push a frame of
+    // their own and haven't returned yet, see FUNC_FILTER_XXX. The next
+    // that many exits are theirs and not ours.
+    //
+    ULONG                 FramelessCalls;
+
+    //
+    // Time spent in instrumented DPCs and ISRs that came in on top of this
+    // invocation, at any depth. They aren't part of the call, so it gets 
+    // taken back out of the elapsed time.
+    //
+    LONGLONG              InterruptTicks;
+
+    //
+    // IRQL that the invocation was entered at
+    //
+    KIRQL                 EntryIrql;
+
+    //
+    // Set if this is the outermost frame of an instrumented DPC or ISR that
+    // came in on top of the frame below it, rather than being called by it
+    //
+    BOOLEAN               Interrupt;
+
+    //
+    // Set if the function's hooks take the _penter_leaf path, see
+    // ENTER_REGISTERS_FROM_LEAF
+    //
+    BOOLEAN               Leaf;
+
+    //
+    // Thread cycle time at entry, zero if we didn't read it. Thread cycles
+    // are TSC ticks, so this is only read on that time source.
+    //
+    ULONG64               StartCycles;
+
+    //
+    // Process to count the call against, only valid if CountProcess is set.
+    // See PROCESS_STATS.
+    //
+    ULONG                 ProcessId;
+
+    BOOLEAN               CountProcess;
+
 }TIME_LOGGER, *PTIME_LOGGER;
 
-#define TIME_LOGGER_TAG 'LTsO'
+//
+// Turn an IRQL into its class, see FUNC_IRQL_CLASSES. Class C is kept in 
+// FUNC_IRQL_STATS.Irql[C - 1], PASSIVE_LEVEL isn't kept at all.
+//
+#define FUNC_IRQL_CLASS(Irql) \
+    (((Irql) < FUNC_IRQL_CLASSES) ? (Irql) : (FUNC_IRQL_CLASSES - 1))
+
+C_ASSERT(FUNC_IRQL_CLASSES == DISPATCH_LEVEL + 2);
+
+//
+// Special values for TIME_LOGGER.CallTreeNode. A call whose parent frame
+// has no node doesn't get one either, or it would show up as a top level
+// call.
+//
+#define CALL_TREE_NODE_NONE ((ULONG)-1)
+#define CALL_TREE_NODE_ROOT ((ULONG)-2)
+
+//
+// Maximum call depth that we track per thread. Calls deeper than this still
+// bump the depth (so that the exits line up) but aren't timed.
+//
+#define MAX_CALL_DEPTH 64
+
+//
+// Preallocated, fixed depth stack of TIME_LOGGER frames. There's one of these
+// for each slot in the thread table, so the hooks never need to go to pool.
+//
+typedef struct DECLSPEC_CACHEALIGN _SHADOW_STACK {
+
+    //
+    // Number of frames pushed. Can exceed MAX_CALL_DEPTH, in which case only
+    // the first MAX_CALL_DEPTH frames are recorded.
+    //
+    volatile ULONG Depth;
+
+    //
+    // TracingGeneration when the outermost frame was pushed
+    //
+    LONG           Generation;
+
+    TIME_LOGGER    Frames[MAX_CALL_DEPTH];
+
+}SHADOW_STACK, *PSHADOW_STACK;
+
+//
+// The thread table is a fixed size, open addressed hash table keyed by
+// KTHREAD. This is the maximum number of threads that can have calls
+// outstanding in the module at any one time. Must be a power of two.
+//
+#define THREAD_TABLE_SHIFT 9
+#define THREAD_TABLE_SIZE  (1 << THREAD_TABLE_SHIFT)
+
+//
+// Low bit of the Owner field. Set while the owning thread has calls
+// outstanding, which is the only time the entry is in use. KTHREADs are
+// always at least 16 byte aligned, so the bit is free.
+//
+#define THREAD_TABLE_ENTRY_REFERENCED ((ULONG_PTR)1)
+
+typedef struct _THREAD_TABLE_ENTRY {
+
+    //
+    // KTHREAD that last used the slot, plus the referenced bit. Zero if the 
+    // slot has never been used. Once used, a slot never goes back to zero,
+    // so lookups can stop at the first zero slot.
+    //
+    // A slot that isn't referenced can be taken over by another thread. All
+    // transitions are a single compare exchange of this field.
+    //
+    volatile ULONG_PTR Owner;
+
+    PSHADOW_STACK      ShadowStack;
+
+}THREAD_TABLE_ENTRY, *PTHREAD_TABLE_ENTRY;
+
+FORCEINLINE
+ULONG
+ThreadTableHash(
+    PKTHREAD Thread
+    )
+{
+    return PenterHash((ULONG_PTR)Thread, THREAD_TABLE_SHIFT);
+}
+
+//
+// Data that we keep for each processor. Only ever touched from its own 
+// processor (modulo the odd preemption, see PerCpuGetCurrent), so no 
+// interlocked operations are needed to update it.
+//
+typedef struct DECLSPEC_CACHEALIGN _PER_CPU_DATA {
+
+    //
+    // Function table cache hit/miss counts. These are statistics only.
+    //
+    ULONGLONG                      FunctionCacheHits;
+    ULONGLONG                      FunctionCacheMisses;
+
+    //
+    // Direct mapped cache of recently used function table entries, indexed
+    // by FunctionCacheHash. Each slot is a single pointer so that it can't 
+    // be seen torn, the entry's FunctionAddress says what's in it.
+    //
+    PFUNCTION_TABLE_ENTRY volatile FunctionCache[FUNCTION_CACHE_SIZE];
+
+    //
+    // This processor's timeline, NULL until it records its first event
+    //
+    PTIMELINE_BUFFER volatile      Timeline;
+
+    //
+    // This processor's copy of the counter segments, see FUNC_COUNTERS
+    //
+    PFUNC_COUNTERS volatile        CounterSegments[MAX_FUNC_TRACE_SEGMENTS];
+
+}PER_CPU_DATA, *PPER_CPU_DATA;
+
+extern PPER_CPU_DATA PerCpuData;
+extern ULONG         PerCpuCount;
+
+//
+// Get the data for the current processor. The index is system wide, so this
+// works across processor groups.
+//
+// If we're below DISPATCH_LEVEL we can be preempted and moved to another 
+// processor after this returns, in which case we end up racing with whoever
+// runs next on the original processor. All of the per processor data must
+// tolerate that.
+//
+FORCEINLINE
+ULONG
+PerCpuGetCurrentIndex(
+    VOID
+    )
+{
+    ULONG index;
+
+    index = KeGetCurrentProcessorNumberEx(NULL);
+
+    if (index >= PerCpuCount) {
+
+        //
+        // Hot added processor that we didn't know about. Share.
+        //
+        index = index % PerCpuCount;
+
+    }
+
+    return index;
+}
+
+FORCEINLINE
+PPER_CPU_DATA
+PerCpuGetCurrent(
+    VOID
+    )
+{
+    return &PerCpuData[PerCpuGetCurrentIndex()];
+}
+
+//
+// Find the histogram bucket for a call that took the given number of ticks.
+// See func_trace.h
+//
+FORCEINLINE
+ULONG
+FuncHistogramBucket(
+    ULONGLONG Ticks
+    )
+{
+    ULONG msb;
+    ULONG bucket;
+
+    if (Ticks < FUNC_HISTOGRAM_SUB_BUCKETS) {
+
+        return (ULONG)Ticks;
+
+    }
+
+#ifdef _X86_
+    if ((Ticks >> 32) != 0) {
+
+        _BitScanReverse(&msb, (ULONG)(Ticks >> 32));
+        msb += 32;
+
+    } else {
+
+        _BitScanReverse(&msb, (ULONG)Ticks);
+
+    }
+#else
+    _BitScanReverse64(&msb, Ticks);
+#endif
+
+    bucket = ((msb - FUNC_HISTOGRAM_SUB_BUCKET_BITS + 1) << 
+                                        FUNC_HISTOGRAM_SUB_BUCKET_BITS) +
+             (ULONG)((Ticks >> (msb - FUNC_HISTOGRAM_SUB_BUCKET_BITS)) & 
+                                        (FUNC_HISTOGRAM_SUB_BUCKETS - 1));
+
+    if (bucket >= FUNC_HISTOGRAM_BUCKETS) {
+
+        bucket = FUNC_HISTOGRAM_BUCKETS - 1;
+
+    }
+
+    return bucket;
+}
+
+//
+// Get a processor's copy of a function's counters. See func_trace.h
+//
+// Every function has one of these on every processor, keep it to a single
+// cache line.
+//
+C_ASSERT(sizeof(FUNC_COUNTERS) <= SYSTEM_CACHE_ALIGNMENT_SIZE);
+
+FORCEINLINE
+PFUNC_COUNTERS
+FuncCountersGetShard(
+    PFUNC_TRACE FuncTrace,
+    ULONG       Processor
+    )
+{
+    return &PerCpuData[Processor].CounterSegments[
+                FuncTrace->Index >> FUNC_TRACE_SEGMENT_SHIFT][
+                FuncTrace->Index & FUNC_TRACE_SEGMENT_MASK];
+}
 
-extern EX_SPIN_LOCK      FunctionTableLock;
-extern RTL_GENERIC_TABLE FunctionTable;
+//
+// Time only one in this many calls of a function, unless the function has
+// its own FUNC_TRACE.SampleRate. One (the default) samples every call. Set
+// it from the debugger with !samplerate.
+//
+extern ULONG SampleRate;
 
-extern EX_SPIN_LOCK      ThreadTableLock;
-extern RTL_GENERIC_TABLE ThreadTable;
+//
+// Filter state given to functions the first time that they're called. See
+// FUNC_FILTER_XXX.
+//
+extern ULONG FilterDefault;
+
+//
+// Decide if this call of the function gets sampled. Each processor counts
+// down the calls to the next sample in its own copy of the counters.
+//
+// No raise here, so if we're preempted and moved another call can get in
+// between the read and the write. That only makes the odd sample come a
+// call early or late, which doesn't matter.
+//
+FORCEINLINE
+BOOLEAN
+FuncTraceShouldSample(
+    PFUNC_TRACE FuncTrace
+    )
+{
+    PFUNC_COUNTERS funcCounters;
+    ULONG          rate;
+    ULONG          countdown;
+
+    rate = FuncTrace->SampleRate;
+
+    if (rate == 0) {
+
+        rate = SampleRate;
+
+    }
+
+    if (rate <= 1) {
+
+        return TRUE;
+
+    }
+
+    funcCounters = FuncCountersGetShard(FuncTrace, PerCpuGetCurrentIndex());
+    countdown    = funcCounters->SampleCountdown;
+
+    if (countdown > 1) {
+
+        funcCounters->SampleCountdown = countdown - 1;
+
+        return FALSE;
+
+    }
+
+    funcCounters->SampleCountdown = rate;
+
+    return TRUE;
+}
+
+//
+// Time source that we use if it's available. Define this to
+// PENTER_TIME_SOURCE_QPC to always use KeQueryPerformanceCounter.
+//
+// The TSC is only used if the processor says it's invariant (constant rate
+// and doesn't stop in deep C-states), otherwise we fall back to the QPC.
+//
+#ifndef PENTER_PREFERRED_TIME_SOURCE
+#define PENTER_PREFERRED_TIME_SOURCE PENTER_TIME_SOURCE_TSC
+#endif
+
+extern TIME_CALIBRATION TimeCalibration;
+
+//
+// Read the selected time source. This is what every hook uses for its 
+// timestamps, so it's important that it's cheap.
+//
+FORCEINLINE
+LONGLONG
+PenterGetTimestamp(
+    VOID
+    )
+{
+    if (TimeCalibration.TimeSource == PENTER_TIME_SOURCE_TSC) {
+
+        return (LONGLONG)__rdtsc();
+
+    }
+
+    return KeQueryPerformanceCounter(NULL).QuadPart;
+}
+
+extern FUNCTION_TABLE_ENTRY FunctionTable[FUNCTION_TABLE_SIZE];
+
+extern THREAD_TABLE_ENTRY ThreadTable[THREAD_TABLE_SIZE];
+extern SHADOW_STACK       ShadowStacks[THREAD_TABLE_SIZE];
 
 extern KIRQL             SynchronizeIrql;
 
-extern FUNC_TRACE FuncTraces[MAX_FUNC_TRACES];
-extern ULONG_PTR  FuncTracesInUse;
+extern PFUNC_TRACE volatile    FuncTraceSegments[MAX_FUNC_TRACE_SEGMENTS];
+extern PFUNC_IRQL_STATS volatile FuncIrqlSegments[MAX_FUNC_TRACE_SEGMENTS];
+extern PFUNC_HISTOGRAM volatile FuncHistogramSegments[MAX_FUNC_TRACE_SEGMENTS];
+extern PFUNC_SLOW_CALLS volatile FuncSlowCallsSegments[MAX_FUNC_TRACE_SEGMENTS];
+extern ULONG_PTR            FuncTracesInUse;
 extern BOOLEAN    ErrorReported;
 
+extern PCALL_EDGE CallEdgeTable;
+extern PCALL_TREE_NODE CallTree;
+extern ULONG           TimelineMode;
 
-typedef enum _LOOKUP_ACTION {
-    LookupActionFailIfNotFound,
-    LookupActionCreateIfNotFound,
-    LookupActionMaximum
-}LOOKUP_ACTION, *PLOOKUP_ACTION;
+extern PPROCESS_STATS  ProcessStatsTable;
+extern ULONG           ProcessStatsEnabled;
 
+extern volatile LONG ShadowStackOverflows;
+extern volatile LONG ShadowStackShortages;
+extern volatile LONG TracingCallsDropped;
 
-RTL_GENERIC_COMPARE_ROUTINE  FunctionTableCompareRoutine;
-RTL_GENERIC_ALLOCATE_ROUTINE FunctionTableAllocateRoutine;
-RTL_GENERIC_FREE_ROUTINE     FunctionTableFreeRoutine;
+//
+// Checked by the _penter and _pexit stubs before they save anything
+//
+extern volatile LONG TracingEnabled;
+extern volatile LONG TracingGeneration;
 
-RTL_GENERIC_COMPARE_ROUTINE  ThreadTableCompareRoutine;
-RTL_GENERIC_ALLOCATE_ROUTINE ThreadTableAllocateRoutine;
-RTL_GENERIC_FREE_ROUTINE     ThreadTableFreeRoutine;
+#ifdef PENTER_STACK_WALK_ON
+extern PSTACK_TABLE_ENTRY StackTable;
+extern ULONG              StackCaptureFrames;
+extern volatile LONG      StackCaptureDrops;
+#endif
 
 VOID LogFuncEntry(PENTER_REGISTERS Registers);
 VOID LogFuncExit(PEXIT_REGISTERS Registers);
 
+NTSTATUS
+PerCpuInitialize(
+    VOID
+    );
+
+VOID
+TimeSourceInitialize(
+    VOID
+    );
+
+VOID
+HookOverheadInitialize(
+    VOID
+    );
+
+//
+// Instrumented dummy functions that HookOverheadInitialize times the hooks
+// with. They call _penter and _pexit just like a function built with 
+// /Gh /GH does, HookOverheadOuter calls Callback in between. HookOverheadLeaf
+// calls them like a leaf function and HookOverheadNonLeaf like a function
+// that has set up its stack frame. They're in penter64.asm on the x64 and in
+// timesource.c on the x86.
+//
+typedef VOID (_cdecl *PHOOK_OVERHEAD_CALLBACK)(VOID);
+
+VOID _cdecl HookOverheadOuter(PHOOK_OVERHEAD_CALLBACK Callback);
+VOID _cdecl HookOverheadLeaf(VOID);
+VOID _cdecl HookOverheadNonLeaf(VOID);
+
+//
+// Where HookOverheadNonLeaf calls _penter, which is what its function table
+// entry is keyed on. That's past its prolog on the x64, there's no prolog
+// on the x86.
+//
+#ifdef _X86_
+#define HOOK_OVERHEAD_NON_LEAF_HOOKED ((ULONG_PTR)HookOverheadNonLeaf)
+#else
+extern UCHAR HookOverheadNonLeafHooked[];
+
+#define HOOK_OVERHEAD_NON_LEAF_HOOKED ((ULONG_PTR)HookOverheadNonLeafHooked)
+#endif
+
 VOID
 FunctionTableInitialize(
     VOID
@@ -250,23 +783,107 @@ ThreadTableInitialize(
     VOID
     );
 
-LONG
+PTHREAD_TABLE_ENTRY
+ThreadTableLookupEntry(
+    PKTHREAD Thread
+    );
+
+PTHREAD_TABLE_ENTRY
 ThreadTableEntryReference(
-    PTHREAD_TABLE_ENTRY Entry
+    PKTHREAD Thread
     );
 
-LONG
+VOID
 ThreadTableEntryDereference(
     PTHREAD_TABLE_ENTRY Entry
     );
 
+VOID
+SlowCallsRecord(
+    PFUNC_SLOW_CALLS SlowCalls,
+    LONGLONG         ElapsedTicks,
+    LONGLONG         StartTicks,
+    ULONG            Processor,
+    KIRQL            EntryIrql,
+    KIRQL            CurrentIrql
+    );
 
-PTHREAD_TABLE_ENTRY
-ThreadTableLookupEntry(
-    HANDLE ThreadId,
-    LOOKUP_ACTION LookupAction
+NTSTATUS
+CallGraphInitialize(
+    VOID
     );
 
-#endif __PENTER_H__
+VOID
+CallGraphRecord(
+    PFUNC_TRACE Caller,
+    PFUNC_TRACE Callee,
+    LONGLONG    ElapsedTicks
+    );
 
+VOID
+CallGraphClearFunction(
+    PFUNC_TRACE FuncTrace
+    );
 
+NTSTATUS
+CallTreeInitialize(
+    VOID
+    );
+
+ULONG
+CallTreeLookupChild(
+    ULONG       ParentNode,
+    PFUNC_TRACE FuncTrace
+    );
+
+VOID
+CallTreeRecord(
+    ULONG    Node,
+    LONGLONG ElapsedTicks,
+    LONGLONG SelfTicks
+    );
+
+VOID
+CallTreeClearFunction(
+    PFUNC_TRACE FuncTrace
+    );
+
+NTSTATUS
+ProcessStatsInitialize(
+    VOID
+    );
+
+ULONG
+ProcessStatsGetProcessId(
+    KIRQL EntryIrql
+    );
+
+VOID
+ProcessStatsRecord(
+    PFUNC_TRACE FuncTrace,
+    ULONG       ProcessId,
+    BOOLEAN     Sampled,
+    LONGLONG    ElapsedTicks,
+    LONGLONG    SelfTicks
+    );
+
+VOID
+TimelineRecord(
+    ULONG    FunctionIndex,
+    LONGLONG Timestamp
+    );
+
+#ifdef PENTER_STACK_WALK_ON
+NTSTATUS
+StackTableInitialize(
+    VOID
+    );
+
+VOID
+StackCaptureRecord(
+    PFUNC_TRACE FuncTrace,
+    ULONG_PTR   ReturnAddress
+    );
+#endif
+
+#endif __PENTER_H__
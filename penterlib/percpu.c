@@ -0,0 +1,108 @@
+//
+// Copyright 2008-2017 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+// CONSEQUENTIAL DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+// POSSIBILITY OF SUCH DAMAGE
+// 
+#include "penterlib.h"
+
+/////////////////
+// GLOBAL DATA //
+/////////////////
+
+//
+// Array of per processor data, one for every processor that can ever be in
+// the system. See penterlib.h
+//
+PPER_CPU_DATA PerCpuData;
+ULONG         PerCpuCount;
+
+//////////////////////
+// MODULE FUNCTIONS //
+//////////////////////
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  PerCpuInitialize
+//
+//      Allocate the per processor data.
+//
+//  INPUTS:
+//
+//      None.
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      STATUS_SUCCESS or STATUS_INSUFFICIENT_RESOURCES
+//
+//  IRQL:
+//
+//      IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      This is one allocation for the life of the driver, never freed.
+//
+///////////////////////////////////////////////////////////////////////////////
+NTSTATUS
+PerCpuInitialize(
+    VOID) 
+{
+
+    ULONG count;
+
+    // 
+    // Size for the processors that are active now, not every processor that
+    // the system could ever have. Every function gets a copy of its counters
+    // for each one, so on a big machine that's a lot of pool. A processor 
+    // that's added later shares, see PerCpuGetCurrentIndex.
+    //  
+    count = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+#pragma warning(suppress: 30030)
+    PerCpuData = (PPER_CPU_DATA)ExAllocatePoolWithTag(NonPagedPool,
+                                                      count * sizeof(PER_CPU_DATA),
+                                                      'cPep');
+
+    if (PerCpuData == NULL) {
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    }
+
+    RtlZeroMemory(PerCpuData,
+                  count * sizeof(PER_CPU_DATA));
+
+    PerCpuCount = count;
+
+    return STATUS_SUCCESS;
+
+}
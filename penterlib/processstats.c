@@ -0,0 +1,375 @@
+//
+// Copyright 2008-2017 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+// CONSEQUENTIAL DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+// POSSIBILITY OF SUCH DAMAGE
+// 
+#include "penterlib.h"
+
+//
+// Exported by the kernel but not in the WDK headers
+//
+NTKERNELAPI
+PCHAR
+PsGetProcessImageFileName(
+    PEPROCESS Process
+    );
+
+/////////////////
+// GLOBAL DATA //
+/////////////////
+
+//
+// Per process table, allocated at init. See func_trace.h
+//
+PPROCESS_STATS ProcessStatsTable;
+
+//
+// Where the calls go that don't fit in the table
+//
+PROCESS_STATS  ProcessStatsOverflow;
+
+//
+// Set from the debugger to count calls by process
+//
+ULONG          ProcessStatsEnabled;
+
+//
+// Set if we've told the user that the table is full
+//
+BOOLEAN        ProcessStatsFullReported;
+
+//
+// Max number of slots that we look at before giving up on an entry. Keeps a 
+// full table from costing us a walk of the whole thing on every call.
+//
+#define PROCESS_STATS_MAX_PROBES 64
+
+static
+VOID
+ProcessStatsSetImageName(
+    PPROCESS_STATS Entry,
+    ULONG          ProcessId
+    );
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  ProcessStatsInitialize
+//
+//      Allocate the per process table.
+//
+//  INPUTS:
+//
+//      None.
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      STATUS_SUCCESS or STATUS_INSUFFICIENT_RESOURCES
+//
+//  IRQL:
+//
+//      IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      This is one allocation for the life of the driver, never freed.
+//
+///////////////////////////////////////////////////////////////////////////////
+NTSTATUS
+ProcessStatsInitialize(
+    VOID) 
+{
+
+#pragma warning(suppress: 30030)
+    ProcessStatsTable = (PPROCESS_STATS)ExAllocatePoolWithTag(
+                                NonPagedPool,
+                                PROCESS_STATS_SIZE * sizeof(PROCESS_STATS),
+                                'sPep');
+
+    if (ProcessStatsTable == NULL) {
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    }
+
+    RtlZeroMemory(ProcessStatsTable,
+                  PROCESS_STATS_SIZE * sizeof(PROCESS_STATS));
+
+    return STATUS_SUCCESS;
+
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  ProcessStatsGetProcessId
+//
+//      Get the process to count the current call against.
+//
+//  INPUTS:
+//
+//      EntryIrql - IRQL that the call was entered at.
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      The current process ID, or PROCESS_STATS_DPC_ISR_ID for a DPC or 
+//      ISR
+//
+//  IRQL:
+//
+//      IRQL <= SynchronizeIrql
+//
+//  NOTES:
+//
+//      A DPC or ISR (or anything that it calls) isn't running on behalf of
+//      the thread that it interrupted, those all go to 
+//      PROCESS_STATS_DPC_ISR_ID. That's keyed on the IRQL, so the Idle 
+//      process (process zero) at PASSIVE_LEVEL keeps its own slot.
+//
+///////////////////////////////////////////////////////////////////////////////
+ULONG
+ProcessStatsGetProcessId(
+    KIRQL EntryIrql) 
+{
+
+    if ((EntryIrql > DISPATCH_LEVEL) || 
+        ((EntryIrql == DISPATCH_LEVEL) && KeIsExecutingDpc())) {
+
+        return PROCESS_STATS_DPC_ISR_ID;
+
+    }
+
+    return (ULONG)(ULONG_PTR)PsGetCurrentProcessId();
+
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  ProcessStatsRecord
+//
+//      Count a call against the process that made it.
+//
+//  INPUTS:
+//
+//      FuncTrace    - Trace entry of the function that was called.
+//
+//      ProcessId    - Process that made the call, PROCESS_STATS_DPC_ISR_ID
+//                     for a DPC or ISR.
+//
+//      Sampled      - Set if the call was timed.
+//
+//      ElapsedTicks - Time spent in the function, zero for recursive calls.
+//
+//      SelfTicks    - Time spent in the function less its instrumented
+//                     callees.
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None
+//
+//  IRQL:
+//
+//      IRQL <= SynchronizeIrql
+//
+//  NOTES:
+//
+//      Lock free, same as CallGraphRecord. The image name is filled in
+//      after the slot is claimed, so the debugger can see a slot without
+//      one for a moment.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+ProcessStatsRecord(
+    PFUNC_TRACE FuncTrace,
+    ULONG       ProcessId,
+    BOOLEAN     Sampled,
+    LONGLONG    ElapsedTicks,
+    LONGLONG    SelfTicks) 
+{
+
+    LONG64         key;
+    LONG64         slotKey;
+    ULONG          index;
+    ULONG          probes;
+    PPROCESS_STATS entry;
+
+    key = (LONG64)(((ULONG64)ProcessId << 32) | (FuncTrace->Index + 1));
+
+    index = PenterHash((ULONGLONG)key, PROCESS_STATS_SHIFT);
+
+    for (probes = 0; probes < PROCESS_STATS_MAX_PROBES; probes++) {
+
+        entry   = &ProcessStatsTable[index];
+        slotKey = entry->Key;
+
+        if (slotKey == 0) {
+
+            slotKey = InterlockedCompareExchange64(&entry->Key, key, 0);
+
+            if (slotKey == 0) {
+
+                ProcessStatsSetImageName(entry, ProcessId);
+
+                slotKey = key;
+
+            }
+
+        }
+
+        if (slotKey == key) {
+
+            break;
+
+        }
+
+        index = (index + 1) & (PROCESS_STATS_SIZE - 1);
+
+    }
+
+    if (probes == PROCESS_STATS_MAX_PROBES) {
+
+        entry = &ProcessStatsOverflow;
+
+        //
+        // Only nag the user once.
+        //
+        if (ProcessStatsFullReported == FALSE) {
+
+            DbgPrint("***Out Of Process Stats Entries. "\
+                     "Counting New Processes As Overflow***\n"); 
+
+            ProcessStatsFullReported = TRUE;
+
+        }
+
+    }
+
+    InterlockedIncrement64(&entry->CallCount);
+
+    if (Sampled == FALSE) {
+
+        return;
+
+    }
+
+    InterlockedIncrement64(&entry->SampledCount);
+
+    if (ElapsedTicks != 0) {
+
+        InterlockedAdd64(&entry->CallTicks, ElapsedTicks);
+
+    }
+
+    InterlockedAdd64(&entry->SelfTicks, SelfTicks);
+
+    return;
+
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  ProcessStatsSetImageName
+//
+//      Fill in the image name of a slot that we just claimed.
+//
+//  INPUTS:
+//
+//      Entry     - The slot.
+//
+//      ProcessId - Process that the slot is for, PROCESS_STATS_DPC_ISR_ID 
+//                  for a DPC or ISR.
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None
+//
+//  IRQL:
+//
+//      IRQL <= SynchronizeIrql
+//
+//  NOTES:
+//
+//      We're always running in a thread of the process, unless it's the
+//      DPC or ISR slot. Take the thread's own process and not the one that
+//      it might be attached to, PsGetCurrentProcessId does the same.
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+VOID
+ProcessStatsSetImageName(
+    PPROCESS_STATS Entry,
+    ULONG          ProcessId) 
+{
+
+    PCHAR imageName;
+    ULONG i;
+
+    if (ProcessId == PROCESS_STATS_DPC_ISR_ID) {
+
+        imageName = "DPC/ISR";
+
+    } else {
+
+        imageName = PsGetProcessImageFileName(
+                                IoThreadToProcess(PsGetCurrentThread()));
+
+    }
+
+    //
+    // The name in the process is at most 15 characters and NULL terminated
+    // if it's shorter, leave room for our own terminator
+    //
+    for (i = 0; i < (PROCESS_STATS_NAME_LENGTH - 1); i++) {
+
+        if (imageName[i] == '\0') {
+
+            break;
+
+        }
+
+        Entry->ImageName[i] = imageName[i];
+
+    }
+
+    return;
+
+}
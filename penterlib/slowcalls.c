@@ -0,0 +1,181 @@
+//
+// Copyright 2008-2017 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+// CONSEQUENTIAL DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+// POSSIBILITY OF SUCH DAMAGE
+// 
+#include "penterlib.h"
+
+/////////////////
+// GLOBAL DATA //
+/////////////////
+
+//
+// Number of slow calls that we couldn't record because we were above
+// DISPATCH_LEVEL and the function's list was busy
+//
+volatile LONG SlowCallsDrops;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  SlowCallsRecord
+//
+//      Remember a call if it's one of the slowest that the function has
+//      seen.
+//
+//  INPUTS:
+//
+//      SlowCalls    - The function's slowest calls.
+//
+//      ElapsedTicks - How long the call took.
+//
+//      StartTicks   - Time stamp at the start of the call.
+//
+//      Processor    - Index of the processor that we're running on.
+//
+//      EntryIrql    - IRQL that the call was entered at.
+//
+//      CurrentIrql  - IRQL that the exit hook was called at.
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None
+//
+//  IRQL:
+//
+//      DISPATCH_LEVEL <= IRQL <= SynchronizeIrql
+//
+//  NOTES:
+//
+//      The caller has already checked ElapsedTicks against ThresholdTicks
+//      without the lock, we check again once we have it.
+//
+//      Same lock rules as the stack histories: it's only ever held at 
+//      DISPATCH_LEVEL or above, and above DISPATCH_LEVEL we only try once
+//      since we might have interrupted the holder.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+SlowCallsRecord(
+    PFUNC_SLOW_CALLS SlowCalls,
+    LONGLONG         ElapsedTicks,
+    LONGLONG         StartTicks,
+    ULONG            Processor,
+    KIRQL            EntryIrql,
+    KIRQL            CurrentIrql) 
+{
+
+    PSLOW_CALL entry;
+    PSLOW_CALL minEntry;
+    LONG       i;
+
+    while (InterlockedCompareExchange(&SlowCalls->Lock, 1, 0) != 0) {
+
+        if (CurrentIrql > DISPATCH_LEVEL) {
+
+            InterlockedIncrement(&SlowCallsDrops);
+
+            return;
+
+        }
+
+        YieldProcessor();
+
+    }
+
+    if (SlowCalls->EntriesCount < MAX_SLOW_CALLS) {
+
+        entry = &SlowCalls->Entries[SlowCalls->EntriesCount];
+
+        SlowCalls->EntriesCount++;
+
+    } else {
+
+        // 
+        // Full. Someone might have beaten us to it while we were waiting 
+        // for the lock, in which case we might not make the cut anymore 
+        //  
+        if (ElapsedTicks <= SlowCalls->ThresholdTicks) {
+
+            goto Release;
+
+        }
+
+        entry = NULL;
+
+        for (i = 0; i < MAX_SLOW_CALLS; i++) {
+
+            if ((entry == NULL) || 
+                (SlowCalls->Entries[i].Ticks < entry->Ticks)) {
+
+                entry = &SlowCalls->Entries[i];
+
+            }
+
+        }
+
+    }
+
+    entry->Ticks      = (ULONGLONG)ElapsedTicks;
+    entry->StartTicks = StartTicks;
+    entry->ThreadId   = (ULONGLONG)(ULONG_PTR)PsGetCurrentThreadId();
+    entry->ProcessId  = (ULONGLONG)(ULONG_PTR)PsGetCurrentProcessId();
+    entry->Processor  = Processor;
+    entry->Irql       = EntryIrql;
+
+    // 
+    // Raise the bar for the next call once we're full 
+    //  
+    if (SlowCalls->EntriesCount == MAX_SLOW_CALLS) {
+
+        minEntry = &SlowCalls->Entries[0];
+
+        for (i = 1; i < MAX_SLOW_CALLS; i++) {
+
+            if (SlowCalls->Entries[i].Ticks < minEntry->Ticks) {
+
+                minEntry = &SlowCalls->Entries[i];
+
+            }
+
+        }
+
+        SlowCalls->ThresholdTicks = (LONGLONG)minEntry->Ticks;
+
+    }
+
+Release:
+
+    InterlockedExchange(&SlowCalls->Lock, 0);
+
+    return;
+
+}
@@ -0,0 +1,703 @@
+//
+// Copyright 2008-2017 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+// CONSEQUENTIAL DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+// POSSIBILITY OF SUCH DAMAGE
+// 
+#include "penterlib.h"
+
+#ifdef PENTER_STACK_WALK_ON
+
+/////////////////
+// GLOBAL DATA //
+/////////////////
+
+//
+// Number of frames to capture on every call to a function. Zero turns stack
+// capture off, which is the default since walking the stack on every call is
+// expensive. Set it from the debugger to turn capture on:
+//
+//      ed module!StackCaptureFrames 5
+//
+// Anything above MAX_CALL_FRAMES is treated as MAX_CALL_FRAMES.
+//
+ULONG              StackCaptureFrames = 0;
+
+//
+// Table of unique stacks, allocated at init. See func_trace.h
+//
+PSTACK_TABLE_ENTRY StackTable;
+
+//
+// Bumped by the debugger to reset the per function stack counts
+//
+volatile LONG      CurrentEpoch = 0;
+
+//
+// Number of stacks that we couldn't record because we were above
+// DISPATCH_LEVEL and couldn't allocate or wait
+//
+volatile LONG      StackCaptureDrops;
+
+//
+// Set if we've told the user that the stack table is full
+//
+BOOLEAN            StackTableFullReported;
+
+//
+// Max number of frames that RtlCaptureStackBackTrace returns before the
+// caller of the function being traced: StackCaptureRecord, LogFuncEntry,
+// _penter_leaf, _penter_hook (_penter on the x86) and finally the function
+// itself
+//
+#define STACK_CAPTURE_HOOK_FRAMES 5
+
+//////////////////////
+// MODULE FUNCTIONS //
+//////////////////////
+
+static
+ULONG
+StackTableIntern(
+    PVOID  *Frames,
+    USHORT  FramesCount
+    );
+
+static
+PCALL_HISTORY_LOG
+StackCaptureAllocateHistory(
+    PFUNC_TRACE FuncTrace
+    );
+
+static
+VOID
+StackCaptureUpdateHistory(
+    PCALL_HISTORY_LOG CallHistory,
+    ULONG             StackIndex,
+    KIRQL             CurrentIrql
+    );
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  StackTableInitialize
+//
+//      Allocate the unique stack table.
+//
+//  INPUTS:
+//
+//      None.
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      STATUS_SUCCESS or STATUS_INSUFFICIENT_RESOURCES
+//
+//  IRQL:
+//
+//      IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      This is one allocation for the life of the driver, never freed.
+//
+///////////////////////////////////////////////////////////////////////////////
+NTSTATUS
+StackTableInitialize(
+    VOID) 
+{
+
+#pragma warning(suppress: 30030)
+    StackTable = (PSTACK_TABLE_ENTRY)ExAllocatePoolWithTag(
+                                NonPagedPool,
+                                STACK_TABLE_SIZE * sizeof(STACK_TABLE_ENTRY),
+                                'tSep');
+
+    if (StackTable == NULL) {
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    }
+
+    RtlZeroMemory(StackTable,
+                  STACK_TABLE_SIZE * sizeof(STACK_TABLE_ENTRY));
+
+    return STATUS_SUCCESS;
+
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  StackCaptureRecord
+//
+//      Capture the current stack and count it against the function being
+//      called.
+//
+//  INPUTS:
+//
+//      FuncTrace     - Trace entry of the function being called.
+//
+//      ReturnAddress - Where _penter returns to in the function being called.
+//                      Used to find where the hook frames end.
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None
+//
+//  IRQL:
+//
+//      IRQL <= SynchronizeIrql
+//
+//  NOTES:
+//
+//      Each function keeps the counts of its MAX_CALL_HISTORY most frequent
+//      stacks using the Space-Saving algorithm: once the table is full a new
+//      stack replaces the least frequent one and inherits its count. A
+//      stack's count can therefore be too high, by at most the count of the
+//      entry that it replaced (the Error field). Any stack seen more than
+//      Total / MAX_CALL_HISTORY times is guaranteed to be in the table.
+//
+//      Must not be inlined, STACK_CAPTURE_HOOK_FRAMES counts our frame.
+//
+///////////////////////////////////////////////////////////////////////////////
+DECLSPEC_NOINLINE
+VOID
+StackCaptureRecord(
+    PFUNC_TRACE FuncTrace,
+    ULONG_PTR   ReturnAddress) 
+{
+
+    PVOID             frames[MAX_CALL_FRAMES + STACK_CAPTURE_HOOK_FRAMES];
+    ULONG             framesWanted;
+    USHORT            captured;
+    USHORT            first;
+    USHORT            i;
+    ULONG             stackIndex;
+    KIRQL             currentIrql;
+    PCALL_HISTORY_LOG callHistory;
+
+    framesWanted = StackCaptureFrames;
+
+    if ((framesWanted == 0) || (StackTable == NULL)) {
+
+        return;
+
+    }
+
+    if (framesWanted > MAX_CALL_FRAMES) {
+
+        framesWanted = MAX_CALL_FRAMES;
+
+    }
+
+    currentIrql = KeGetCurrentIrql();
+
+    callHistory = FuncTrace->CallHistory;
+
+    if (callHistory == NULL) {
+
+        if (currentIrql > DISPATCH_LEVEL) {
+
+            // 
+            // Can't allocate up here, we'll get it next time 
+            //  
+            InterlockedIncrement(&StackCaptureDrops);
+
+            return;
+
+        }
+
+        callHistory = StackCaptureAllocateHistory(FuncTrace);
+
+        if (callHistory == NULL) {
+
+            return;
+
+        }
+
+    }
+
+    // 
+    // Capture extra frames to make up for the hooks, then throw away 
+    // everything up to and including the return into the function being 
+    // called. What's left starts with its caller. 
+    // 
+    // The leaf and non-leaf hooks leave a different number of frames, so 
+    // look for the return address instead of skipping a fixed count. If it 
+    // isn't there the unwind went wrong somewhere and we keep it all. 
+    // 
+    captured = RtlCaptureStackBackTrace(0,
+                                        framesWanted + STACK_CAPTURE_HOOK_FRAMES,
+                                        frames,
+                                        NULL);
+
+    first = 0;
+
+    for (i = 0; (i < captured) && (i < STACK_CAPTURE_HOOK_FRAMES); i++) {
+
+        if ((ULONG_PTR)frames[i] == ReturnAddress) {
+
+            first = (USHORT)(i + 1);
+            break;
+
+        }
+
+    }
+
+    captured = (USHORT)(captured - first);
+
+    if (captured > framesWanted) {
+
+        captured = (USHORT)framesWanted;
+
+    }
+
+    if (captured == 0) {
+
+        return;
+
+    }
+
+    stackIndex = StackTableIntern(&frames[first], 
+                                  captured);
+
+    if (stackIndex == STACK_INDEX_NONE) {
+
+        return;
+
+    }
+
+    StackCaptureUpdateHistory(callHistory, 
+                              stackIndex,
+                              currentIrql);
+
+    return;
+
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  StackTableIntern
+//
+//      Find the stack in the unique stack table, adding it if it isn't
+//      there.
+//
+//  INPUTS:
+//
+//      Frames      - The stack.
+//
+//      FramesCount - Number of entries in Frames.
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      Index of the stack in the table or STACK_INDEX_NONE if the table is
+//      full
+//
+//  IRQL:
+//
+//      IRQL <= SynchronizeIrql
+//
+//  NOTES:
+//
+//      Same scheme as the function table, an open addressed table where the
+//      hash is claimed with an interlocked operation and FramesCount
+//      publishes the frames.
+//
+//      We hash the frames ourselves instead of using the hash from
+//      RtlCaptureStackBackTrace, that hash includes the hook frames that we
+//      threw away.
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+ULONG
+StackTableIntern(
+    PVOID  *Frames,
+    USHORT  FramesCount) 
+{
+
+    KIRQL              oldIrql;
+    KIRQL              currentIrql;
+    ULONGLONG          hash64;
+    ULONG              hash;
+    ULONG              slotHash;
+    USHORT             slotFramesCount;
+    ULONG              index;
+    ULONG              probes;
+    USHORT             i;
+    PSTACK_TABLE_ENTRY entry;
+
+    hash64 = FramesCount;
+
+    for (i = 0; i < FramesCount; i++) {
+
+        hash64 = (hash64 ^ (ULONG_PTR)Frames[i]) * 0x9E3779B97F4A7C15ULL;
+
+    }
+
+    hash = (ULONG)(hash64 >> 32);
+
+    // 
+    // Zero is an empty slot 
+    //  
+    if (hash == 0) {
+
+        hash = 1;
+
+    }
+
+    currentIrql = KeGetCurrentIrql();
+
+    index = (ULONG)PenterHash(hash, STACK_TABLE_SHIFT);
+
+    for (probes = 0; probes < STACK_TABLE_SIZE; probes++) {
+
+        entry    = &StackTable[index];
+        slotHash = entry->Hash;
+
+        if (slotHash == 0) {
+
+            // 
+            // An ISR doesn't add stacks, same as the function table. It 
+            // could be interrupting the owner of a slot that it needs. 
+            //  
+            if (currentIrql > DISPATCH_LEVEL) {
+
+                InterlockedIncrement(&StackCaptureDrops);
+
+                return STACK_INDEX_NONE;
+
+            }
+
+            // 
+            // Try to claim it. Raised for the same reason as the function 
+            // table, others spin waiting for us to fill it in. 
+            //  
+            KeRaiseIrql(max(currentIrql, SynchronizeIrql), &oldIrql);
+
+            slotHash = (ULONG)InterlockedCompareExchange((volatile LONG *)&entry->Hash,
+                                                         (LONG)hash,
+                                                         0);
+
+            if (slotHash == 0) {
+
+                RtlCopyMemory(entry->Frames,
+                              Frames,
+                              FramesCount * sizeof(PVOID));
+
+                InterlockedExchange16((volatile SHORT *)&entry->FramesCount,
+                                      (SHORT)FramesCount);
+
+                KeLowerIrql(oldIrql);
+
+                return index;
+
+            }
+
+            KeLowerIrql(oldIrql);
+
+        }
+
+        if (slotHash == hash) {
+
+            // 
+            // Probably ours, but make sure it's not a collision. Same as 
+            // above, an ISR can't wait for the owner to fill it in. 
+            //  
+            slotFramesCount = entry->FramesCount;
+
+            if ((slotFramesCount == 0) && (currentIrql > DISPATCH_LEVEL)) {
+
+                InterlockedIncrement(&StackCaptureDrops);
+
+                return STACK_INDEX_NONE;
+
+            }
+
+            while (slotFramesCount == 0) {
+
+                YieldProcessor();
+
+                slotFramesCount = entry->FramesCount;
+
+            }
+
+            if ((slotFramesCount == FramesCount) &&
+                (RtlEqualMemory(entry->Frames, 
+                                Frames, 
+                                FramesCount * sizeof(PVOID)))) {
+
+                return index;
+
+            }
+
+        }
+
+        index = (index + 1) & (STACK_TABLE_SIZE - 1);
+
+    }
+
+    //
+    // Only nag the user once.
+    //
+    if (StackTableFullReported == FALSE) {
+
+        DbgPrint("***Out Of Stack Table Entries. "\
+                 "No Longer Logging New Stacks***\n"); 
+
+        StackTableFullReported = TRUE;
+
+    }
+
+    return STACK_INDEX_NONE;
+
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  StackCaptureAllocateHistory
+//
+//      Allocate the CALL_HISTORY_LOG for a function the first time that it
+//      records a stack.
+//
+//  INPUTS:
+//
+//      FuncTrace - Trace entry of the function.
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      The history or NULL if we couldn't allocate it
+//
+//  IRQL:
+//
+//      IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+PCALL_HISTORY_LOG
+StackCaptureAllocateHistory(
+    PFUNC_TRACE FuncTrace) 
+{
+
+    PCALL_HISTORY_LOG callHistory;
+
+#pragma warning(suppress: 30030)
+    callHistory = (PCALL_HISTORY_LOG)ExAllocatePoolWithTag(
+                                        NonPagedPool,
+                                        sizeof(CALL_HISTORY_LOG),
+                                        'hCep');
+
+    if (callHistory == NULL) {
+
+        InterlockedIncrement(&StackCaptureDrops);
+
+        return NULL;
+
+    }
+
+    RtlZeroMemory(callHistory,
+                  sizeof(CALL_HISTORY_LOG));
+
+    callHistory->Epoch = CurrentEpoch;
+
+    // 
+    // Someone else might be doing the same thing for this function, if we 
+    // lose the race use the winner's 
+    //  
+    if (InterlockedCompareExchangePointer((PVOID volatile *)&FuncTrace->CallHistory,
+                                          callHistory,
+                                          NULL) != NULL) {
+
+        ExFreePoolWithTag(callHistory,
+                          'hCep');
+
+        callHistory = FuncTrace->CallHistory;
+
+    }
+
+    return callHistory;
+
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  StackCaptureUpdateHistory
+//
+//      Count a stack against a function's history.
+//
+//  INPUTS:
+//
+//      CallHistory - The function's history.
+//
+//      StackIndex  - Index of the stack in the unique stack table.
+//
+//      CurrentIrql - IRQL that we were called at.
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None
+//
+//  IRQL:
+//
+//      IRQL <= SynchronizeIrql
+//
+//  NOTES:
+//
+//      The history is protected by a simple spin lock that's only ever held
+//      at DISPATCH_LEVEL or above. Above DISPATCH_LEVEL we might have
+//      interrupted the holder on this processor, so we only try once and
+//      drop the stack if it's busy.
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+VOID
+StackCaptureUpdateHistory(
+    PCALL_HISTORY_LOG CallHistory,
+    ULONG             StackIndex,
+    KIRQL             CurrentIrql) 
+{
+
+    KIRQL         oldIrql = CurrentIrql;
+    LONG          epoch;
+    LONG          i;
+    PCALL_HISTORY entry;
+    PCALL_HISTORY minEntry = NULL;
+
+    if (CurrentIrql < DISPATCH_LEVEL) {
+
+        KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+
+    }
+
+    while (InterlockedCompareExchange(&CallHistory->Lock, 1, 0) != 0) {
+
+        if (CurrentIrql > DISPATCH_LEVEL) {
+
+            InterlockedIncrement(&StackCaptureDrops);
+
+            goto Exit;
+
+        }
+
+        YieldProcessor();
+
+    }
+
+    // 
+    // Start over if the debugger reset the trace since we were last here 
+    //  
+    epoch = CurrentEpoch;
+
+    if (CallHistory->Epoch != epoch) {
+
+        CallHistory->EntriesCount = 0;
+        CallHistory->Total        = 0;
+        CallHistory->Epoch        = epoch;
+
+    }
+
+    CallHistory->Total++;
+
+    for (i = 0; i < CallHistory->EntriesCount; i++) {
+
+        entry = &CallHistory->Entries[i];
+
+        if (entry->StackIndex == StackIndex) {
+
+            entry->StackSeenCount++;
+
+            goto Release;
+
+        }
+
+        if ((minEntry == NULL) ||
+            (entry->StackSeenCount < minEntry->StackSeenCount)) {
+
+            minEntry = entry;
+
+        }
+
+    }
+
+    if (CallHistory->EntriesCount < MAX_CALL_HISTORY) {
+
+        entry = &CallHistory->Entries[CallHistory->EntriesCount];
+
+        entry->StackIndex     = StackIndex;
+        entry->StackSeenCount = 1;
+        entry->Error          = 0;
+
+        CallHistory->EntriesCount++;
+
+    } else {
+
+        // 
+        // Full. Replace the least frequent stack, the new one inherits its 
+        // count. 
+        //  
+        minEntry->StackIndex = StackIndex;
+        minEntry->Error      = minEntry->StackSeenCount;
+        minEntry->StackSeenCount++;
+
+    }
+
+Release:
+
+    InterlockedExchange(&CallHistory->Lock, 0);
+
+Exit:
+
+    if (CurrentIrql < DISPATCH_LEVEL) {
+
+        KeLowerIrql(oldIrql);
+
+    }
+
+    return;
+
+}
+
+#endif
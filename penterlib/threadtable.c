@@ -34,6 +34,29 @@
 // GLOBAL DATA //
 /////////////////
 
+//
+// The thread table and the shadow stacks that go with each slot. See 
+// penterlib.h
+//
+THREAD_TABLE_ENTRY ThreadTable[THREAD_TABLE_SIZE];
+SHADOW_STACK       ShadowStacks[THREAD_TABLE_SIZE];
+
+//
+// Number of calls that were too deep to fit on a shadow stack
+//
+volatile LONG ShadowStackOverflows;
+
+//
+// Number of times a thread couldn't be tracked because all of the thread
+// table entries were in use
+//
+volatile LONG ShadowStackShortages;
+
+//
+// Number of calls that were in flight when tracing was turned off and got
+// thrown away when it was turned back on, see ThreadTableLookupEntry
+//
+volatile LONG TracingCallsDropped;
 
 //////////////////////
 // MODULE FUNCTIONS //
@@ -43,227 +66,312 @@ VOID
 ThreadTableInitialize(
     VOID) 
 {
-    RtlInitializeGenericTable(&ThreadTable,
-                              ThreadTableCompareRoutine,
-                              ThreadTableAllocateRoutine,
-                              ThreadTableFreeRoutine,
-                              NULL);
+    ULONG i;
+
+    //
+    // Each slot permanently owns the shadow stack at the same index
+    //
+    for (i = 0; i < THREAD_TABLE_SIZE; i++) {
+
+        ThreadTable[i].ShadowStack = &ShadowStacks[i];
+
+    }
+
     return;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+//
+//  ThreadTableLookupEntry
+//
+//      Find the entry for a thread that already has calls outstanding in
+//      the module. This is the path taken by every call but the outermost
+//      one on a thread, so it doesn't do any interlocked operations.
+//
+//  INPUTS:
+//
+//      Thread - The current thread.
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      The referenced entry for the thread or NULL if it has none
+//
+//  IRQL:
+//
+//      Any
+//
+//  NOTES:
+//
+//      Only ever called for the current thread. The referenced entry for the
+//      current thread can only be changed by the current thread (or a DPC or
+//      ISR that's on top of it and will be gone before we run again), so
+//      there's no race with finding it.
+//
+//      If tracing was turned off and back on since the thread's outermost
+//      frame was pushed, the exits of some of its frames may never have made
+//      it here. There's no telling which, so all of its frames are thrown
+//      away and the entry is dropped as if the thread had no calls in flight.
+//      The calls are counted in TracingCallsDropped.
+//
+///////////////////////////////////////////////////////////////////////////////
 PTHREAD_TABLE_ENTRY
 ThreadTableLookupEntry(
-    HANDLE ThreadId,
-    LOOKUP_ACTION LookupAction) 
+    PKTHREAD Thread) 
 {
 
-    KIRQL               oldIrql;
-    THREAD_TABLE_ENTRY  lookupEntry;
-    PTHREAD_TABLE_ENTRY foundEntry = NULL;
-    BOOLEAN             createdEntry;
-    BOOLEAN             lockedShared;
+    ULONG     index;
+    ULONG     probes;
+    ULONG_PTR owner;
+    ULONG_PTR referencedOwner;
 
-    lookupEntry.ThreadId = (ULONGLONG)ThreadId; 
+    referencedOwner = (ULONG_PTR)Thread | THREAD_TABLE_ENTRY_REFERENCED;
 
-    KeRaiseIrql(SynchronizeIrql, &oldIrql);
-    ExAcquireSpinLockSharedAtDpcLevel(&ThreadTableLock);
-    lockedShared = TRUE;
+    index = ThreadTableHash(Thread);
 
-    foundEntry = 
-        (PTHREAD_TABLE_ENTRY)RtlLookupElementGenericTable(&ThreadTable,
-                                                          &lookupEntry);
+    for (probes = 0; probes < THREAD_TABLE_SIZE; probes++) {
 
-    if (foundEntry != NULL) {
+        owner = ThreadTable[index].Owner;
 
-        ThreadTableEntryReference(foundEntry);
+        if (owner == referencedOwner) {
 
-        goto Exit;
+            if (ThreadTable[index].ShadowStack->Generation != TracingGeneration) {
 
-    }
+                InterlockedExchangeAdd(&TracingCallsDropped,
+                                       (LONG)ThreadTable[index].ShadowStack->Depth);
 
-    if (LookupAction == LookupActionFailIfNotFound) {
+                ThreadTable[index].ShadowStack->Depth = 0;
 
-        goto Exit;
+                ThreadTableEntryDereference(&ThreadTable[index]);
 
-    }
-    
-    RtlZeroMemory(&lookupEntry,
-                  sizeof(THREAD_TABLE_ENTRY));
+                return NULL;
 
-    //
-    // Drop shared and reacquire
-    //
-    ExReleaseSpinLockSharedFromDpcLevel(&ThreadTableLock);
-    lockedShared = FALSE;
+            }
 
-    ExAcquireSpinLockExclusiveAtDpcLevel(&ThreadTableLock);
+            return &ThreadTable[index];
 
-    // 
-    // Thread will only have ONE reference count when we return. We don't want 
-    // to be in the business of tracking the lifetime of a thread, so we'll only 
-    // keep an entry in the thread table for as long as we have outstanding 
-    // calls from the thread 
-    //  
-    // The alternative is to register a thread notify callback and tear it down 
-    // there. However, a goal of this project is to only require BUILD changes 
-    // and not any CODE changes to the driver (and we won't know to 
-    // unregister the thread callback unless they tell us) 
-    //  
-    lookupEntry.RefCount = 1;
-    lookupEntry.ThreadId = (ULONGLONG)ThreadId; 
-
-    foundEntry = 
-        (PTHREAD_TABLE_ENTRY)RtlInsertElementGenericTable(
-                                                   &ThreadTable,
-                                                   &lookupEntry,
-                                                   sizeof(THREAD_TABLE_ENTRY),
-                                                   &createdEntry);
-
-    if (createdEntry == FALSE) {
-
-        // 
-        // Someone came in and created the entry before we could (we drop the 
-        // lock shared and pick it up Ex above, so it could happen...). 
-        //  
-        // Make sure we reference this entry before returning it. 
-        //  
-        ThreadTableEntryReference(foundEntry);
+        }
 
-    }
+        if (owner == 0) {
 
-    //  
-    // Done! 
-    //  
+            // 
+            // End of the probe sequence 
+            //  
+            break;
 
-Exit:
+        }
 
-    if (lockedShared) {
-        ExReleaseSpinLockSharedFromDpcLevel(&ThreadTableLock);
-    } else {
-        ExReleaseSpinLockExclusiveFromDpcLevel(&ThreadTableLock);
-    }
+        index = (index + 1) & (THREAD_TABLE_SIZE - 1);
 
-    KeLowerIrql(oldIrql);
+    }
 
-    return foundEntry;
+    return NULL;
 
 }
 
-_Use_decl_annotations_
-RTL_GENERIC_COMPARE_RESULTS
-ThreadTableCompareRoutine(
-    PRTL_GENERIC_TABLE Table,
-    PVOID FirstStruct,
-    PVOID SecondStruct) 
+///////////////////////////////////////////////////////////////////////////////
+//
+//  ThreadTableEntryReference
+//
+//      Get a referenced entry for a thread that doesn't have one. Called on
+//      the outermost call on a thread.
+//
+//  INPUTS:
+//
+//      Thread - The current thread.
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      The referenced entry for the thread or NULL if the table is full
+//
+//  IRQL:
+//
+//      Any
+//
+//  NOTES:
+//
+//      The entry stays referenced until ThreadTableEntryDereference is 
+//      called. We don't want to be in the business of tracking the lifetime 
+//      of a thread, so we only keep an entry referenced for as long as we 
+//      have outstanding calls from the thread.
+//
+//      The alternative is to register a thread notify callback and tear it 
+//      down there. However, a goal of this project is to only require BUILD 
+//      changes and not any CODE changes to the driver (and we won't know to 
+//      unregister the thread callback unless they tell us)
+//
+///////////////////////////////////////////////////////////////////////////////
+PTHREAD_TABLE_ENTRY
+ThreadTableEntryReference(
+    PKTHREAD Thread) 
 {
 
-    PTHREAD_TABLE_ENTRY         firstEntry;
-    PTHREAD_TABLE_ENTRY         secondEntry;
-    RTL_GENERIC_COMPARE_RESULTS compareResult;
+    ULONG               index;
+    ULONG               probes;
+    ULONG_PTR           owner;
+    ULONG_PTR           referencedOwner;
+    PTHREAD_TABLE_ENTRY entry;
 
-    UNREFERENCED_PARAMETER(Table);
+    ASSERT(((ULONG_PTR)Thread & THREAD_TABLE_ENTRY_REFERENCED) == 0);
 
-    firstEntry  = (PTHREAD_TABLE_ENTRY)FirstStruct;
-    secondEntry = (PTHREAD_TABLE_ENTRY)SecondStruct;
+    referencedOwner = (ULONG_PTR)Thread | THREAD_TABLE_ENTRY_REFERENCED;
 
-    if (firstEntry->ThreadId == secondEntry->ThreadId) {
+    // 
+    // First pass. If we've been here before there's a good chance that our 
+    // old slot is still sitting there unreferenced, so try to take it back. 
+    //  
+    index = ThreadTableHash(Thread);
 
-        compareResult = GenericEqual;
+    for (probes = 0; probes < THREAD_TABLE_SIZE; probes++) {
 
-    } else if (firstEntry->ThreadId > secondEntry->ThreadId) {
+        entry = &ThreadTable[index];
+        owner = entry->Owner;
 
-        compareResult = GenericGreaterThan;
+        if (owner == referencedOwner) {
 
-    } else {
+            // 
+            // Already referenced?? Our caller just looked and anything that 
+            // came in on top of us since has dropped its reference on the 
+            // way out. 
+            //  
+            ASSERT(FALSE);
 
-        compareResult = GenericLessThan;
+            return entry;
 
-    }
+        }
 
-    return compareResult;
+        if (owner == (ULONG_PTR)Thread) {
 
-}
+            if (InterlockedCompareExchangePointer((PVOID volatile *)&entry->Owner,
+                                                  (PVOID)referencedOwner,
+                                                  (PVOID)owner) == (PVOID)owner) {
 
-_Use_decl_annotations_
-PVOID
-ThreadTableAllocateRoutine(
-    PRTL_GENERIC_TABLE Table,
-    CLONG ByteSize) 
-{
+                goto Found;
 
-    PVOID allocation;
+            }
 
-    UNREFERENCED_PARAMETER(Table);
+            // 
+            // Somebody else took it over from under us. Keep looking 
+            // 
 
-#pragma warning(suppress: 30030)
-    allocation = ExAllocatePoolWithTag(NonPagedPool, ByteSize, 'hTep');
+        }
 
-    return allocation;
-}
+        if (owner == 0) {
 
+            // 
+            // End of the probe sequence 
+            //  
+            break;
 
-_Use_decl_annotations_
-VOID
-ThreadTableFreeRoutine(
-    PRTL_GENERIC_TABLE Table,
-    PVOID Buffer) 
-{
+        }
 
-    UNREFERENCED_PARAMETER(Table);
+        index = (index + 1) & (THREAD_TABLE_SIZE - 1);
 
-    ExFreePoolWithTag(Buffer,
-                      'hTep');
+    }
 
-    return;
-}
+    // 
+    // Second pass. Take the first slot in our probe sequence that isn't 
+    // referenced, whether that's a never used one at the end or another 
+    // thread's stale one along the way. Because slots never go back to zero 
+    // this doesn't break anyone else's probe sequence. 
+    //  
+    index = ThreadTableHash(Thread);
 
-LONG
-ThreadTableEntryReference(
-    PTHREAD_TABLE_ENTRY Entry) 
-{
+    for (probes = 0; probes < THREAD_TABLE_SIZE; probes++) {
 
-    LONG refCount;
+        entry = &ThreadTable[index];
+        owner = entry->Owner;
 
-    refCount = InterlockedIncrement(&Entry->RefCount);
+        if ((owner & THREAD_TABLE_ENTRY_REFERENCED) == 0) {
 
-    ASSERT(refCount > 0);
+            if (InterlockedCompareExchangePointer((PVOID volatile *)&entry->Owner,
+                                                  (PVOID)referencedOwner,
+                                                  (PVOID)owner) == (PVOID)owner) {
 
-    return refCount;
+                goto Found;
 
-}
+            }
 
-LONG
-ThreadTableEntryDereference(
-    PTHREAD_TABLE_ENTRY Entry) 
-{
+        }
 
-    LONG refCount;
-    BOOLEAN deleted;
-    KIRQL oldIrql;
+        index = (index + 1) & (THREAD_TABLE_SIZE - 1);
 
-    KeRaiseIrql(SynchronizeIrql, &oldIrql);
-    ExAcquireSpinLockExclusiveAtDpcLevel(&ThreadTableLock);
+    }
 
-    refCount = InterlockedDecrement(&Entry->RefCount);
+    // 
+    // Too many threads in the module at once. Don't track this one. 
+    //  
+    InterlockedIncrement(&ShadowStackShortages);
 
-    ASSERT(refCount >= 0);
+    return NULL;
 
-    if (refCount != 0) {
+Found:
 
-        goto Exit;
+    // 
+    // Unreferenced entries always have an empty shadow stack 
+    //  
+    ASSERT(entry->ShadowStack->Depth == 0);
 
-    }
+    entry->ShadowStack->Generation = TracingGeneration;
 
-    deleted = RtlDeleteElementGenericTable(&ThreadTable,
-                                           Entry);
+    return entry;
 
-    ASSERT(deleted == TRUE);
+}
 
-Exit:
+///////////////////////////////////////////////////////////////////////////////
+//
+//  ThreadTableEntryDereference
+//
+//      Drop the reference taken by ThreadTableEntryReference. Called when
+//      the outermost call on a thread returns.
+//
+//  INPUTS:
+//
+//      Entry - The referenced entry for the current thread.
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None
+//
+//  IRQL:
+//
+//      Any
+//
+//  NOTES:
+//
+//      The slot keeps the thread as its owner so that the thread can get it
+//      back cheaply next time, unless somebody else takes it over first.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+ThreadTableEntryDereference(
+    PTHREAD_TABLE_ENTRY Entry) 
+{
 
-    ExReleaseSpinLockExclusiveFromDpcLevel(&ThreadTableLock);
-    KeLowerIrql(oldIrql);
+    ULONG_PTR owner;
 
-    return refCount;
+    owner = Entry->Owner;
+
+    ASSERT((owner & THREAD_TABLE_ENTRY_REFERENCED) != 0);
+    ASSERT(Entry->ShadowStack->Depth == 0);
+
+    // 
+    // Nobody else can change a referenced slot, so there's no need to loop 
+    //  
+    InterlockedExchangePointer((PVOID volatile *)&Entry->Owner,
+                               (PVOID)(owner & ~THREAD_TABLE_ENTRY_REFERENCED));
+
+    return;
 
 }
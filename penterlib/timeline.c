@@ -0,0 +1,224 @@
+//
+// Copyright 2008-2017 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+// CONSEQUENTIAL DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+// POSSIBILITY OF SUCH DAMAGE
+// 
+#include "penterlib.h"
+
+/////////////////
+// GLOBAL DATA //
+/////////////////
+
+//
+// One of the TIMELINE_MODE values, see func_trace.h. Set from the debugger.
+//
+ULONG         TimelineMode = TIMELINE_MODE_OFF;
+
+//
+// Number of events that we couldn't record because the processor had no 
+// buffer yet and we were above DISPATCH_LEVEL, or the allocation failed
+//
+volatile LONG TimelineDrops;
+
+//////////////////////
+// MODULE FUNCTIONS //
+//////////////////////
+
+static
+PTIMELINE_BUFFER
+TimelineAllocateBuffer(
+    PPER_CPU_DATA PerCpu
+    );
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  TimelineRecord
+//
+//      Append an event to the current processor's timeline.
+//
+//  INPUTS:
+//
+//      FunctionIndex - Index of the function's FUNC_TRACE, with 
+//                      TIMELINE_EVENT_EXIT set for an exit.
+//
+//      Timestamp     - Time of the event.
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None
+//
+//  IRQL:
+//
+//      IRQL <= SynchronizeIrql
+//
+//  NOTES:
+//
+//      Each buffer only ever has one processor writing to it, but that 
+//      processor can be interrupted by an instrumented DPC or ISR in the 
+//      middle of an append, and below DISPATCH_LEVEL we can be preempted 
+//      and moved. So a slot is reserved with an interlocked increment. It 
+//      never leaves the processor's cache, so it's cheap.
+//
+//      A slot is reserved before it's filled in. The debugger only looks 
+//      while the target is stopped, so at worst it sees a stale event in 
+//      the slots of calls that were in the middle of an append.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+TimelineRecord(
+    ULONG    FunctionIndex,
+    LONGLONG Timestamp) 
+{
+
+    PPER_CPU_DATA    perCpu;
+    PTIMELINE_BUFFER timeline;
+    PTIMELINE_EVENT  event;
+    LONG64           next;
+
+    perCpu   = PerCpuGetCurrent();
+    timeline = perCpu->Timeline;
+
+    if (timeline == NULL) {
+
+        timeline = TimelineAllocateBuffer(perCpu);
+
+        if (timeline == NULL) {
+
+            InterlockedIncrement(&TimelineDrops);
+
+            return;
+
+        }
+
+    }
+
+    // 
+    // In stop mode the count keeps going once we're full, the debugger 
+    // uses it to say how many events didn't make it 
+    //  
+    next = InterlockedIncrement64(&timeline->Next) - 1;
+
+    if ((TimelineMode == TIMELINE_MODE_STOP) && 
+        (next >= TIMELINE_BUFFER_SIZE)) {
+
+        return;
+
+    }
+
+    event = &timeline->Events[next & TIMELINE_BUFFER_MASK];
+
+    event->Timestamp     = Timestamp;
+    event->FunctionIndex = FunctionIndex;
+    event->ThreadId      = HandleToULong(PsGetCurrentThreadId());
+
+    return;
+
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  TimelineAllocateBuffer
+//
+//      Allocate a processor's timeline the first time that it records an
+//      event.
+//
+//  INPUTS:
+//
+//      PerCpu - The processor's data.
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      The buffer or NULL if we couldn't allocate it
+//
+//  IRQL:
+//
+//      IRQL <= SynchronizeIrql
+//
+//  NOTES:
+//
+//      We can only allocate at DISPATCH_LEVEL or below. Above that the 
+//      event is dropped, the processor will get its buffer the next time 
+//      it's called at a lower IRQL.
+//
+//      If we were preempted and moved, we might be allocating for another
+//      processor while it does the same. Loser frees.
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+PTIMELINE_BUFFER
+TimelineAllocateBuffer(
+    PPER_CPU_DATA PerCpu) 
+{
+
+    PTIMELINE_BUFFER timeline;
+    PTIMELINE_BUFFER existing;
+
+    if (KeGetCurrentIrql() > DISPATCH_LEVEL) {
+
+        return NULL;
+
+    }
+
+#pragma warning(suppress: 30030)
+    timeline = (PTIMELINE_BUFFER)ExAllocatePoolWithTag(NonPagedPool,
+                                                       sizeof(TIMELINE_BUFFER),
+                                                       'lTep');
+
+    if (timeline == NULL) {
+
+        return NULL;
+
+    }
+
+    RtlZeroMemory(timeline,
+                  sizeof(TIMELINE_BUFFER));
+
+    existing = (PTIMELINE_BUFFER)InterlockedCompareExchangePointer(
+                                            (PVOID volatile *)&PerCpu->Timeline,
+                                            timeline,
+                                            NULL);
+
+    if (existing != NULL) {
+
+        ExFreePoolWithTag(timeline, 'lTep');
+
+        return existing;
+
+    }
+
+    return timeline;
+
+}
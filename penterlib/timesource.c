@@ -0,0 +1,570 @@
+//
+// Copyright 2008-2017 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+// CONSEQUENTIAL DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+// POSSIBILITY OF SUCH DAMAGE
+// 
+#include "penterlib.h"
+#include "time_calibration.h"
+#include <intrin.h>
+
+/////////////////
+// GLOBAL DATA //
+/////////////////
+
+//
+// Time source in use and how fast it ticks. See func_trace.h
+//
+TIME_CALIBRATION TimeCalibration;
+
+//
+// Time source to use if it's available, see penterlib.h
+//
+ULONG            TimeSourcePreference = PENTER_PREFERRED_TIME_SOURCE;
+
+//
+// How long to measure the TSC against the QPC, in microseconds. Longer is
+// more accurate, but we're stalling the first call into the driver.
+//
+#define TSC_CALIBRATION_STALL_US 10000
+
+//
+// The hook overhead is measured in HOOK_OVERHEAD_ROUNDS rounds of
+// HOOK_OVERHEAD_CALLS calls each and we keep the fastest round. Anything
+// slower than that was interrupted.
+//
+#define HOOK_OVERHEAD_ROUNDS     8
+
+//////////////////////
+// MODULE FUNCTIONS //
+//////////////////////
+
+static
+BOOLEAN
+TimeSourceTscIsInvariant(
+    VOID
+    );
+
+static
+VOID
+_cdecl
+HookOverheadRounds(
+    VOID
+    );
+
+static
+ULONGLONG
+HookOverheadTime(
+    PHOOK_OVERHEAD_CALLBACK Dummy
+    );
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  TimeSourceInitialize
+//
+//      Pick the time source and figure out how fast it ticks.
+//
+//  INPUTS:
+//
+//      None.
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None
+//
+//  IRQL:
+//
+//      IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      The TSC is calibrated by stalling for a bit and seeing how far it
+//      moved compared to the QPC. Accurate enough for profiling, we're not
+//      trying to keep time here. The math is in time_calibration.h.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+TimeSourceInitialize(
+    VOID) 
+{
+
+    LARGE_INTEGER qpcFrequency;
+    LARGE_INTEGER qpcStart;
+    LARGE_INTEGER qpcEnd;
+    ULONGLONG     tscStart;
+    ULONGLONG     tscEnd;
+    ULONGLONG     tscTicksPerSecond = 0;
+    BOOLEAN       tscIsInvariant;
+
+    KeQueryPerformanceCounter(&qpcFrequency);
+
+    tscIsInvariant = TimeSourceTscIsInvariant();
+
+    if ((TimeSourcePreference == PENTER_TIME_SOURCE_TSC) &&
+        (tscIsInvariant != FALSE)) {
+
+        // 
+        // Read the two as close together as we can at both ends 
+        //  
+        qpcStart = KeQueryPerformanceCounter(NULL);
+        tscStart = __rdtsc();
+
+        KeStallExecutionProcessor(TSC_CALIBRATION_STALL_US);
+
+        qpcEnd = KeQueryPerformanceCounter(NULL);
+        tscEnd = __rdtsc();
+
+        tscTicksPerSecond = TimeCalibrationTscTicksPerSecond(tscStart,
+                                                             tscEnd,
+                                                             qpcStart.QuadPart,
+                                                             qpcEnd.QuadPart,
+                                                             qpcFrequency.QuadPart);
+
+        if (tscTicksPerSecond == 0) {
+
+            DbgPrint("OSRPENTER: TSC calibration failed. Using QPC\n");
+
+        }
+
+    }
+
+    TimeCalibrationSelect(TimeSourcePreference,
+                          tscIsInvariant,
+                          tscTicksPerSecond,
+                          qpcFrequency.QuadPart,
+                          &TimeCalibration);
+
+    DbgPrint("OSRPENTER: Using %s, %I64u ticks per second\n",
+             (TimeCalibration.TimeSource == PENTER_TIME_SOURCE_TSC) ? "TSC" : "QPC",
+             TimeCalibration.TicksPerSecond);
+
+    return;
+
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  TimeSourceTscIsInvariant
+//
+//      See if the processor has an invariant TSC.
+//
+//  INPUTS:
+//
+//      None.
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      TRUE if the TSC runs at a constant rate in all P-, C- and T-states
+//
+//  IRQL:
+//
+//      Any
+//
+//  NOTES:
+//
+//      See TimeCalibrationTscIsInvariant. Most hypervisors hide the bit 
+//      unless the TSC is safe to use in the guest.
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+BOOLEAN
+TimeSourceTscIsInvariant(
+    VOID) 
+{
+
+    int   cpuInfo[4];
+    ULONG maxExtendedLeaf;
+
+    __cpuid(cpuInfo, 0x80000000);
+
+    maxExtendedLeaf = (ULONG)cpuInfo[0];
+
+    if (maxExtendedLeaf < TSC_INVARIANT_CPUID_LEAF) {
+
+        return FALSE;
+
+    }
+
+    __cpuid(cpuInfo, TSC_INVARIANT_CPUID_LEAF);
+
+    return TimeCalibrationTscIsInvariant(maxExtendedLeaf, (ULONG)cpuInfo[3]);
+
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  HookOverheadInitialize
+//
+//      Measure what an instrumented call costs its caller, so that the
+//      debugger can take it back out of the caller's time.
+//
+//  INPUTS:
+//
+//      None.
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None
+//
+//  IRQL:
+//
+//      IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      We time real calls through the _penter and _pexit stubs, so the
+//      register saving and the time stamp reads are included. The calls 
+//      go to HookOverheadLeaf and HookOverheadNonLeaf nested inside of a 
+//      call to HookOverheadOuter, so that we time the common path: a 
+//      nested call that isn't recursive and isn't the outermost call on 
+//      the thread. On the x64 the hooks of a leaf function take a 
+//      different path than the rest, so there's one dummy for each.
+//
+//      The dummy functions get trace entries like any other, we zero them 
+//      when we're done so that they don't show up in the stats.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+HookOverheadInitialize(
+    VOID) 
+{
+
+    ULONG_PTR             dummies[3];
+    ULONG                 dummy;
+    ULONG                 i;
+    PFUNCTION_TABLE_ENTRY funcTableEntry;
+    PFUNC_TRACE           funcTrace;
+
+    dummies[0] = (ULONG_PTR)HookOverheadOuter;
+    dummies[1] = (ULONG_PTR)HookOverheadLeaf;
+    dummies[2] = HOOK_OVERHEAD_NON_LEAF_HOOKED;
+
+    // 
+    // Time the dummies' calls, whatever the user's filter says. This also 
+    // gets their trace entries allocated before we start timing. 
+    //  
+    for (dummy = 0; dummy < RTL_NUMBER_OF(dummies); dummy++) {
+
+        funcTableEntry = FunctionTableLookupEntry(dummies[dummy]);
+
+        if (funcTableEntry != NULL) {
+
+            funcTableEntry->TraceEntry->FilterState = FUNC_FILTER_TRACE;
+
+        }
+
+    }
+
+    HookOverheadOuter(HookOverheadRounds);
+
+    DbgPrint("OSRPENTER: Hook overhead %I64u ticks per %d calls, %I64u for leaf functions\n",
+             TimeCalibration.HookOverhead,
+             HOOK_OVERHEAD_CALLS,
+             TimeCalibration.HookOverheadLeaf);
+
+    // 
+    // Hide the dummy functions 
+    //  
+    for (dummy = 0; dummy < RTL_NUMBER_OF(dummies); dummy++) {
+
+        funcTableEntry = FunctionTableLookupEntry(dummies[dummy]);
+
+        if (funcTableEntry == NULL) {
+
+            continue;
+
+        }
+
+        funcTrace = funcTableEntry->TraceEntry;
+
+        for (i = 0; i < PerCpuCount; i++) {
+
+            RtlZeroMemory(FuncCountersGetShard(funcTrace, i),
+                          sizeof(FUNC_COUNTERS));
+
+        }
+
+        RtlZeroMemory((PVOID)funcTrace->IrqlStats,
+                      sizeof(FUNC_IRQL_STATS));
+
+        RtlZeroMemory((PVOID)funcTrace->Histogram,
+                      sizeof(FUNC_HISTOGRAM));
+
+        RtlZeroMemory((PVOID)funcTrace->SlowCalls,
+                      sizeof(FUNC_SLOW_CALLS));
+
+        funcTrace->MaxRecursionDepth = 0;
+
+        CallGraphClearFunction(funcTrace);
+
+        CallTreeClearFunction(funcTrace);
+
+    }
+
+    return;
+
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  HookOverheadRounds
+//
+//      Time the calls to each of the dummy functions and keep the results
+//      in TimeCalibration.
+//
+//  INPUTS:
+//
+//      None.
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None
+//
+//  IRQL:
+//
+//      IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      Called by HookOverheadOuter, so all of the calls are nested 
+//      inside of it. We're not instrumented ourselves, so the calls are
+//      its children as far as the hooks can tell.
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+VOID
+_cdecl
+HookOverheadRounds(
+    VOID) 
+{
+
+    TimeCalibration.HookOverhead     = HookOverheadTime(HookOverheadNonLeaf);
+    TimeCalibration.HookOverheadLeaf = HookOverheadTime(HookOverheadLeaf);
+
+    return;
+
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  HookOverheadTime
+//
+//      Time HOOK_OVERHEAD_ROUNDS rounds of HOOK_OVERHEAD_CALLS calls to a
+//      dummy function.
+//
+//  INPUTS:
+//
+//      Dummy - The instrumented dummy to call.
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      Ticks taken by the fastest round
+//
+//  IRQL:
+//
+//      IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+ULONGLONG
+HookOverheadTime(
+    PHOOK_OVERHEAD_CALLBACK Dummy) 
+{
+
+    LONGLONG start;
+    LONGLONG elapsed;
+    LONGLONG fastest = MAXLONGLONG;
+    ULONG    round;
+    ULONG    i;
+
+    for (round = 0; round < HOOK_OVERHEAD_ROUNDS; round++) {
+
+        start = PenterGetTimestamp();
+
+        for (i = 0; i < HOOK_OVERHEAD_CALLS; i++) {
+
+            Dummy();
+
+        }
+
+        elapsed = PenterGetTimestamp() - start;
+
+        if (elapsed < fastest) {
+
+            fastest = elapsed;
+
+        }
+
+    }
+
+    return (ULONGLONG)fastest;
+
+}
+
+#ifdef _X86_
+///////////////////////////////////////////////////////////////////////////////
+//
+//  HookOverheadOuter
+//
+//      Instrumented dummy for HookOverheadInitialize. Calls Callback, 
+//      which times calls to HookOverheadLeaf and HookOverheadNonLeaf.
+//
+//  INPUTS:
+//
+//      Callback - Function to call in between the hooks.
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None
+//
+//  IRQL:
+//
+//      IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      Naked so that the hooks come first and last, the same as the 
+//      compiler puts them with /Gh /GH. The x64 version is in 
+//      penter64.asm.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID __declspec(naked) _cdecl HookOverheadOuter(PHOOK_OVERHEAD_CALLBACK Callback) {
+    _asm {
+        call _penter      ; Log the entry
+
+        mov  eax, [esp+4] ; Time the inner calls
+        call eax
+
+        call _pexit       ; Log the exit
+
+        ret
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  HookOverheadLeaf
+//
+//      Instrumented dummy for HookOverheadInitialize. An empty function 
+//      built with /Gh /GH.
+//
+//  INPUTS:
+//
+//      None.
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None
+//
+//  IRQL:
+//
+//      IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      See HookOverheadOuter
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID __declspec(naked) _cdecl HookOverheadLeaf(VOID) {
+    _asm {
+        call _penter      ; Log the entry
+
+        call _pexit       ; Log the exit
+
+        ret
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  HookOverheadNonLeaf
+//
+//      Instrumented dummy for HookOverheadInitialize. Same as 
+//      HookOverheadLeaf.
+//
+//  INPUTS:
+//
+//      None.
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None
+//
+//  IRQL:
+//
+//      IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      Leaf functions only take a different path through the hooks on the
+//      x64. We still time both on the x86 so that both costs get filled in.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID __declspec(naked) _cdecl HookOverheadNonLeaf(VOID) {
+    _asm {
+        call _penter      ; Log the entry
+
+        call _pexit       ; Log the exit
+
+        ret
+    }
+}
+#endif
@@ -0,0 +1,499 @@
+//
+// Copyright 2008-2017 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+// CONSEQUENTIAL DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+// POSSIBILITY OF SUCH DAMAGE
+//
+// User mode benchmark of the function table lookup, scaling across
+// threads. Compares:
+//
+//  LockedTree  - A binary tree of separately allocated nodes behind a
+//                shared lock, like the library's old splay table behind
+//                FunctionTableLock. The splay table also rearranged
+//                itself on lookups, so this is the best case for it.
+//
+//  HashTable   - The open addressed table that the library uses now,
+//                lock free reads.
+//
+//  CachedHash  - The same with the per processor cache in front, which
+//                is the library's whole lookup path. Getting the current
+//                processor can cost more here than it does in the kernel.
+//
+//  functablebench [maxthreads] [functions]
+//
+// Runs each variant with 1, 2, 4... threads up to maxthreads (the number
+// of processors by default). Every thread looks up the same functions in 
+// its own order. Prints a CSV row per variant and thread count.
+//
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+//
+// Lookups made by each thread
+//
+#define BENCH_LOOKUPS        10000000
+
+//
+// Length of each thread's sequence of functions to look up. Repeats 
+// until it's made BENCH_LOOKUPS lookups.
+//
+#define BENCH_SEQUENCE_SIZE  4096
+
+//
+// Same sizes as the library, see penterlib.h
+//
+#define FUNCTION_TABLE_SHIFT 15
+#define FUNCTION_TABLE_SIZE  (1 << FUNCTION_TABLE_SHIFT)
+#define FUNCTION_CACHE_SHIFT 6
+#define FUNCTION_CACHE_SIZE  (1 << FUNCTION_CACHE_SHIFT)
+
+typedef struct DECLSPEC_ALIGN(16) _BENCH_TABLE_ENTRY {
+    volatile ULONGLONG FunctionAddress;
+    PVOID volatile     TraceEntry;
+} BENCH_TABLE_ENTRY, *PBENCH_TABLE_ENTRY;
+
+typedef struct DECLSPEC_ALIGN(64) _BENCH_PER_CPU {
+    ULONGLONG                   FunctionCacheHits;
+    ULONGLONG                   FunctionCacheMisses;
+    PBENCH_TABLE_ENTRY volatile FunctionCache[FUNCTION_CACHE_SIZE];
+} BENCH_PER_CPU, *PBENCH_PER_CPU;
+
+typedef struct _BENCH_NODE {
+    ULONGLONG           FunctionAddress;
+    PVOID               TraceEntry;
+    struct _BENCH_NODE *Left;
+    struct _BENCH_NODE *Right;
+} BENCH_NODE, *PBENCH_NODE;
+
+typedef PVOID (*PBENCH_LOOKUP)(ULONGLONG FunctionAddress);
+
+typedef struct _BENCH_VARIANT {
+    const char    *Name;
+    PBENCH_LOOKUP  Lookup;
+} BENCH_VARIANT, *PBENCH_VARIANT;
+
+typedef struct _BENCH_CONTEXT {
+    PBENCH_VARIANT Variant;
+    HANDLE         StartEvent;
+    ULONG          Seed;
+    ULONG_PTR      Checksum;
+} BENCH_CONTEXT, *PBENCH_CONTEXT;
+
+BENCH_TABLE_ENTRY FunctionTable[FUNCTION_TABLE_SIZE];
+PBENCH_PER_CPU    PerCpuData;
+ULONG             PerCpuCount;
+PBENCH_NODE       TreeRoot;
+SRWLOCK           TreeLock = SRWLOCK_INIT;
+ULONGLONG        *Functions;
+ULONG             FunctionCount = 2000;
+
+//
+// Same as PenterHash in penterlib.h
+//
+ULONG BenchHash(ULONGLONG Value, ULONG Shift) {
+
+    return (ULONG)((Value * 0x9E3779B97F4A7C15ULL) >> (64 - Shift));
+
+}
+
+//
+// BenchRandom
+//
+//  Small xorshift generator, so that every run looks up the same things
+//
+ULONG BenchRandom(ULONG *Seed) {
+
+    ULONG x = *Seed;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+
+    *Seed = x;
+
+    return x;
+
+}
+
+//
+// TreeBuild
+//
+//  Build a balanced tree out of the sorted functions, one allocation per
+//  node like the old table's allocate routine.
+//
+PBENCH_NODE TreeBuild(ULONG First, ULONG Last) {
+
+    PBENCH_NODE node;
+    ULONG       middle;
+
+    if (First >= Last) {
+        return NULL;
+    }
+
+    middle = First + ((Last - First) / 2);
+
+    node = (PBENCH_NODE)malloc(sizeof(BENCH_NODE));
+    if (node == NULL) {
+        return NULL;
+    }
+
+    node->FunctionAddress = Functions[middle];
+    node->TraceEntry      = &Functions[middle];
+    node->Left            = TreeBuild(First, middle);
+    node->Right           = TreeBuild(middle + 1, Last);
+
+    return node;
+
+}
+
+PVOID TreeLookup(ULONGLONG FunctionAddress) {
+
+    PBENCH_NODE node;
+    PVOID       traceEntry = NULL;
+
+    AcquireSRWLockShared(&TreeLock);
+
+    node = TreeRoot;
+
+    while (node != NULL) {
+
+        if (FunctionAddress == node->FunctionAddress) {
+            traceEntry = node->TraceEntry;
+            break;
+        }
+
+        node = (FunctionAddress < node->FunctionAddress) ? node->Left : node->Right;
+
+    }
+
+    ReleaseSRWLockShared(&TreeLock);
+
+    return traceEntry;
+
+}
+
+//
+// HashInsert
+//
+//  Put a function in the hash table, see FunctionTableLookupEntry.
+//  Only done before the timing, so no compare exchange needed.
+//
+void HashInsert(ULONGLONG FunctionAddress, PVOID TraceEntry) {
+
+    ULONG index;
+
+    index = BenchHash(FunctionAddress, FUNCTION_TABLE_SHIFT);
+
+    while (FunctionTable[index].FunctionAddress != 0) {
+        index = (index + 1) & (FUNCTION_TABLE_SIZE - 1);
+    }
+
+    FunctionTable[index].FunctionAddress = FunctionAddress;
+    FunctionTable[index].TraceEntry      = TraceEntry;
+
+}
+
+PBENCH_TABLE_ENTRY HashLookupEntry(ULONGLONG FunctionAddress) {
+
+    ULONG     index;
+    ULONG     probes;
+    ULONGLONG slotAddress;
+
+    index = BenchHash(FunctionAddress, FUNCTION_TABLE_SHIFT);
+
+    for (probes = 0; probes < FUNCTION_TABLE_SIZE; probes++) {
+
+        slotAddress = FunctionTable[index].FunctionAddress;
+
+        if (slotAddress == FunctionAddress) {
+            return &FunctionTable[index];
+        }
+
+        if (slotAddress == 0) {
+            return NULL;
+        }
+
+        index = (index + 1) & (FUNCTION_TABLE_SIZE - 1);
+
+    }
+
+    return NULL;
+
+}
+
+PVOID HashLookup(ULONGLONG FunctionAddress) {
+
+    PBENCH_TABLE_ENTRY entry;
+
+    entry = HashLookupEntry(FunctionAddress);
+
+    return (entry != NULL) ? entry->TraceEntry : NULL;
+
+}
+
+PVOID CachedHashLookup(ULONGLONG FunctionAddress) {
+
+    PBENCH_PER_CPU     perCpu;
+    PBENCH_TABLE_ENTRY entry;
+    ULONG              cacheIndex;
+
+    perCpu     = &PerCpuData[GetCurrentProcessorNumber() % PerCpuCount];
+    cacheIndex = BenchHash(FunctionAddress, FUNCTION_CACHE_SHIFT);
+    entry      = perCpu->FunctionCache[cacheIndex];
+
+    if ((entry != NULL) && (entry->FunctionAddress == FunctionAddress)) {
+        perCpu->FunctionCacheHits++;
+        return entry->TraceEntry;
+    }
+
+    perCpu->FunctionCacheMisses++;
+
+    entry = HashLookupEntry(FunctionAddress);
+
+    if (entry == NULL) {
+        return NULL;
+    }
+
+    perCpu->FunctionCache[cacheIndex] = entry;
+
+    return entry->TraceEntry;
+
+}
+
+BENCH_VARIANT Variants[] = {
+    { "LockedTree", TreeLookup },
+    { "HashTable",  HashLookup },
+    { "CachedHash", CachedHashLookup },
+};
+
+DWORD WINAPI BenchThread(PVOID Parameter) {
+
+    PBENCH_CONTEXT context = (PBENCH_CONTEXT)Parameter;
+    ULONGLONG     *sequence;
+    ULONG_PTR      checksum = 0;
+    ULONG          seed;
+    ULONG          i;
+
+    sequence = (ULONGLONG *)malloc(BENCH_SEQUENCE_SIZE * sizeof(ULONGLONG));
+    if (sequence == NULL) {
+        return 1;
+    }
+
+    seed = context->Seed;
+
+    for (i = 0; i < BENCH_SEQUENCE_SIZE; i++) {
+        sequence[i] = Functions[BenchRandom(&seed) % FunctionCount];
+    }
+
+    WaitForSingleObject(context->StartEvent, INFINITE);
+
+    for (i = 0; i < BENCH_LOOKUPS; i++) {
+        checksum += (ULONG_PTR)context->Variant->Lookup(
+                                    sequence[i & (BENCH_SEQUENCE_SIZE - 1)]);
+    }
+
+    //
+    // Keep the compiler from throwing the lookups away
+    //
+    context->Checksum = checksum;
+
+    free(sequence);
+
+    return 0;
+
+}
+
+//
+// RunVariant
+//
+//  Time the given number of threads doing their lookups with one of the
+//  variants. Returns the wall clock time in nanoseconds, zero on failure.
+//
+double RunVariant(PBENCH_VARIANT Variant, ULONG Threads) {
+
+    BENCH_CONTEXT contexts[MAXIMUM_WAIT_OBJECTS];
+    HANDLE        handles[MAXIMUM_WAIT_OBJECTS];
+    HANDLE        startEvent;
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER start;
+    LARGE_INTEGER end;
+    ULONG         created = 0;
+    ULONG         i;
+    double        elapsedNs = 0;
+
+    startEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (startEvent == NULL) {
+        printf("Can't create the start event\n");
+        return 0;
+    }
+
+    for (i = 0; i < Threads; i++) {
+
+        contexts[i].Variant    = Variant;
+        contexts[i].StartEvent = startEvent;
+        contexts[i].Seed       = 0x12345678 + (i * 0x9E3779B9);
+        contexts[i].Checksum   = 0;
+
+        handles[i] = CreateThread(NULL, 0, BenchThread, &contexts[i], 0, NULL);
+        if (handles[i] == NULL) {
+            printf("Can't create thread %u\n", i);
+            SetEvent(startEvent);
+            goto Exit;
+        }
+
+        created++;
+
+    }
+
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&start);
+
+    SetEvent(startEvent);
+
+    WaitForMultipleObjects(created, handles, TRUE, INFINITE);
+
+    QueryPerformanceCounter(&end);
+
+    elapsedNs = (double)(end.QuadPart - start.QuadPart) * 1e9 / 
+                                                (double)frequency.QuadPart;
+
+Exit:
+
+    if (created != 0) {
+
+        WaitForMultipleObjects(created, handles, TRUE, INFINITE);
+
+        for (i = 0; i < created; i++) {
+            CloseHandle(handles[i]);
+        }
+
+    }
+
+    CloseHandle(startEvent);
+
+    return elapsedNs;
+
+}
+
+int __cdecl main(int argc, char **argv) {
+
+    ULONG     maxThreads;
+    ULONG     threads;
+    ULONG     variant;
+    ULONG     seed = 1;
+    ULONG     i;
+    ULONGLONG address;
+    double    elapsedNs;
+
+    maxThreads = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+
+    if (argc > 1) {
+        maxThreads = strtoul(argv[1], NULL, 0);
+    }
+
+    if (argc > 2) {
+        FunctionCount = strtoul(argv[2], NULL, 0);
+    }
+
+    if (maxThreads > MAXIMUM_WAIT_OBJECTS) {
+        maxThreads = MAXIMUM_WAIT_OBJECTS;
+    }
+
+    if ((maxThreads == 0) || 
+        (FunctionCount == 0) || 
+        (FunctionCount > FUNCTION_TABLE_SIZE / 2)) {
+        printf("Usage: functablebench [maxthreads] [functions (1-%d)]\n",
+               FUNCTION_TABLE_SIZE / 2);
+        return 1;
+    }
+
+    PerCpuCount = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+    PerCpuData  = (PBENCH_PER_CPU)_aligned_malloc(PerCpuCount * sizeof(BENCH_PER_CPU), 64);
+    Functions   = (ULONGLONG *)malloc(FunctionCount * sizeof(ULONGLONG));
+
+    if ((PerCpuData == NULL) || (Functions == NULL)) {
+        printf("Out of memory\n");
+        return 1;
+    }
+
+    memset(PerCpuData, 0, PerCpuCount * sizeof(BENCH_PER_CPU));
+
+    //
+    // Functions in a made up driver image, 16 byte aligned and a few 
+    // hundred bytes apart
+    //
+    address = 0xFFFFF80012340000ULL;
+
+    for (i = 0; i < FunctionCount; i++) {
+        address     += 16 * (1 + (BenchRandom(&seed) % 64));
+        Functions[i] = address;
+        HashInsert(address, &Functions[i]);
+    }
+
+    //
+    // Already ascending, so the tree comes out balanced
+    //
+    TreeRoot = TreeBuild(0, FunctionCount);
+
+    printf("Variant,Threads,Functions,LookupsPerThread,NsPerLookup,MillionLookupsPerSecond\n");
+
+    for (variant = 0; variant < ARRAYSIZE(Variants); variant++) {
+
+        for (threads = 1; ; threads *= 2) {
+
+            //
+            // Always finish with all of the threads
+            //
+            if (threads > maxThreads) {
+                threads = maxThreads;
+            }
+
+            elapsedNs = RunVariant(&Variants[variant], threads);
+            if (elapsedNs == 0) {
+                return 1;
+            }
+
+            printf("%s,%u,%u,%u,%.1f,%.1f\n",
+                   Variants[variant].Name,
+                   threads,
+                   FunctionCount,
+                   BENCH_LOOKUPS,
+                   elapsedNs / BENCH_LOOKUPS,
+                   ((double)BENCH_LOOKUPS * threads * 1000) / elapsedNs);
+
+            if (threads == maxThreads) {
+                break;
+            }
+
+        }
+
+    }
+
+    return 0;
+
+}
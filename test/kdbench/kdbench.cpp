@@ -0,0 +1,235 @@
+//
+// Copyright 2008-2017 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+// CONSEQUENTIAL DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+// POSSIBILITY OF SUCH DAMAGE
+//
+// Times penterkd commands against a crash dump, so that one build of the
+// extension can be compared with another without a live target.
+//
+//  kdbench <dump> <extension> <repeats> <command> [arguments]
+//
+// e.g. kdbench memory.dmp c:\old\penterkd.dll 5 modulestats mydriver
+//
+// Opens the dump, loads the given extension and runs the command once to
+// get the symbols loaded. Then runs it the given number of times and 
+// prints a CSV row with the fastest and the average time. The command's
+// output is thrown away, only its size is printed, so that two builds
+// can be checked for doing the same work.
+//
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dbgeng.h>
+
+//
+// Output callbacks that count what the command prints and drop it
+//
+class NullOutputCallbacks : public IDebugOutputCallbacks {
+
+public:
+
+    ULONGLONG OutputBytes;
+
+    NullOutputCallbacks() : OutputBytes(0) {
+    }
+
+    STDMETHOD(QueryInterface)(REFIID InterfaceId, PVOID *Interface) {
+
+        if (IsEqualIID(InterfaceId, __uuidof(IUnknown)) ||
+            IsEqualIID(InterfaceId, __uuidof(IDebugOutputCallbacks))) {
+            *Interface = (IDebugOutputCallbacks *)this;
+            return S_OK;
+        }
+
+        *Interface = NULL;
+        return E_NOINTERFACE;
+
+    }
+
+    //
+    // Lives on main's stack, no reference counting needed
+    //
+    STDMETHOD_(ULONG, AddRef)(void) {
+        return 1;
+    }
+
+    STDMETHOD_(ULONG, Release)(void) {
+        return 0;
+    }
+
+    STDMETHOD(Output)(ULONG Mask, PCSTR Text) {
+
+        UNREFERENCED_PARAMETER(Mask);
+
+        OutputBytes += strlen(Text);
+
+        return S_OK;
+
+    }
+
+};
+
+int __cdecl main(int argc, char **argv) {
+
+    NullOutputCallbacks nullOutput;
+    PDEBUG_CLIENT       client = NULL;
+    PDEBUG_CONTROL      control = NULL;
+    ULONG64             extension = 0;
+    LARGE_INTEGER       frequency;
+    LARGE_INTEGER       start;
+    LARGE_INTEGER       end;
+    PCSTR               arguments = "";
+    ULONG               repeats;
+    ULONG               i;
+    double              elapsedMs;
+    double              fastestMs = 0;
+    double              totalMs = 0;
+    HRESULT             hr;
+    int                 result = 1;
+
+    if (argc < 5) {
+        printf("Usage: kdbench <dump> <extension> <repeats> <command> [arguments]\n");
+        return 1;
+    }
+
+    repeats = strtoul(argv[3], NULL, 0);
+
+    if (repeats == 0) {
+        printf("Repeats must be at least 1\n");
+        return 1;
+    }
+
+    if (argc > 5) {
+        arguments = argv[5];
+    }
+
+    hr = DebugCreate(__uuidof(IDebugClient), (PVOID *)&client);
+    if (FAILED(hr)) {
+        printf("DebugCreate failed 0x%x\n", hr);
+        goto Exit;
+    }
+
+    hr = client->QueryInterface(__uuidof(IDebugControl), (PVOID *)&control);
+    if (FAILED(hr)) {
+        printf("QueryInterface for IDebugControl failed 0x%x\n", hr);
+        goto Exit;
+    }
+
+    hr = client->OpenDumpFile(argv[1]);
+    if (FAILED(hr)) {
+        printf("Can't open dump %s 0x%x\n", argv[1], hr);
+        goto Exit;
+    }
+
+    hr = control->WaitForEvent(DEBUG_WAIT_DEFAULT, INFINITE);
+    if (FAILED(hr)) {
+        printf("Dump %s didn't load 0x%x\n", argv[1], hr);
+        goto Exit;
+    }
+
+    //
+    // Call the command through its handle so we know which build of the
+    // extension ran it
+    //
+    hr = control->AddExtension(argv[2], 0, &extension);
+    if (FAILED(hr)) {
+        printf("Can't load extension %s 0x%x\n", argv[2], hr);
+        goto Exit;
+    }
+
+    client->SetOutputCallbacks(&nullOutput);
+
+    //
+    // Once to get the symbols loaded, that would swamp the first run
+    //
+    hr = control->CallExtension(extension, argv[4], arguments);
+    if (FAILED(hr)) {
+        client->SetOutputCallbacks(NULL);
+        printf("!%s %s failed 0x%x\n", argv[4], arguments, hr);
+        goto Exit;
+    }
+
+    nullOutput.OutputBytes = 0;
+
+    QueryPerformanceFrequency(&frequency);
+
+    for (i = 0; i < repeats; i++) {
+
+        QueryPerformanceCounter(&start);
+
+        control->CallExtension(extension, argv[4], arguments);
+
+        QueryPerformanceCounter(&end);
+
+        elapsedMs = (double)(end.QuadPart - start.QuadPart) * 1000.0 / 
+                                                (double)frequency.QuadPart;
+
+        if ((i == 0) || (elapsedMs < fastestMs)) {
+            fastestMs = elapsedMs;
+        }
+
+        totalMs += elapsedMs;
+
+    }
+
+    client->SetOutputCallbacks(NULL);
+
+    printf("Extension,Command,Arguments,Repeats,FastestMs,AverageMs,OutputBytes\n");
+    printf("%s,%s,%s,%u,%.1f,%.1f,%I64u\n",
+           argv[2],
+           argv[4],
+           arguments,
+           repeats,
+           fastestMs,
+           totalMs / repeats,
+           nullOutput.OutputBytes / repeats);
+
+    result = 0;
+
+Exit:
+
+    if (extension != 0) {
+        control->RemoveExtension(extension);
+    }
+
+    if (client != NULL) {
+        client->EndSession(DEBUG_END_PASSIVE);
+    }
+
+    if (control != NULL) {
+        control->Release();
+    }
+
+    if (client != NULL) {
+        client->Release();
+    }
+
+    return result;
+
+}
@@ -0,0 +1,355 @@
+//
+// Copyright 2008-2017 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+// CONSEQUENTIAL DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+// POSSIBILITY OF SUCH DAMAGE
+//
+// User mode benchmark of where the library keeps its call frames. Compares
+// allocating a frame from a shared heap on every call and freeing it on
+// the way out, like the library used to with NonPagedPool, with pushing it
+// onto a preallocated per thread shadow stack like it does now. Both do 
+// the same bookkeeping with the frames, only where they come from differs.
+//
+//  shadowstackbench [threads] [depth]
+//
+// Every thread makes nested calls depth deep, over and over. Prints a CSV
+// row per variant with the wall clock time per call on each thread.
+//
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <intrin.h>
+
+//
+// Outermost calls made by each thread
+//
+#define BENCH_ITERATIONS 1000000
+
+//
+// Deepest that the shadow stack goes, same as the library
+//
+#define BENCH_MAX_DEPTH  64
+
+//
+// Stand in for a TIME_LOGGER, about the same size
+//
+typedef struct _BENCH_FRAME {
+    struct _BENCH_FRAME *Parent;
+    ULONGLONG            FunctionAddress;
+    ULONGLONG            StartTicks;
+    ULONGLONG            DescendantCalls;
+    LONGLONG             ChildTicks;
+    LONGLONG             InterruptTicks;
+    ULONGLONG            StartCycles;
+    ULONG                RecursionDepth;
+    ULONG                ProcessId;
+} BENCH_FRAME, *PBENCH_FRAME;
+
+//
+// A thread's frames. The heap variant links them through Parent, the 
+// shadow stack variant keeps them in Frames.
+//
+typedef struct _BENCH_THREAD {
+    PBENCH_FRAME Top;
+    ULONG        Depth;
+    ULONG        Overflows;
+    BENCH_FRAME  Frames[BENCH_MAX_DEPTH];
+} BENCH_THREAD, *PBENCH_THREAD;
+
+typedef PBENCH_FRAME (*PBENCH_PUSH)(PBENCH_THREAD Thread);
+typedef void (*PBENCH_POP)(PBENCH_THREAD Thread, PBENCH_FRAME Frame);
+
+typedef struct _BENCH_VARIANT {
+    const char  *Name;
+    PBENCH_PUSH  Push;
+    PBENCH_POP   Pop;
+} BENCH_VARIANT, *PBENCH_VARIANT;
+
+//
+// What each thread gets
+//
+typedef struct _BENCH_CONTEXT {
+    PBENCH_VARIANT Variant;
+    HANDLE         StartEvent;
+    ULONG          Depth;
+    ULONGLONG      Checksum;
+} BENCH_CONTEXT, *PBENCH_CONTEXT;
+
+//
+// HeapPush
+//
+//  The old way, a shared allocation for every call.
+//
+PBENCH_FRAME HeapPush(PBENCH_THREAD Thread) {
+
+    PBENCH_FRAME frame;
+
+    frame = (PBENCH_FRAME)HeapAlloc(GetProcessHeap(), 0, sizeof(BENCH_FRAME));
+    if (frame == NULL) {
+        Thread->Overflows++;
+        return NULL;
+    }
+
+    frame->Parent = Thread->Top;
+    Thread->Top   = frame;
+
+    return frame;
+
+}
+
+void HeapPop(PBENCH_THREAD Thread, PBENCH_FRAME Frame) {
+
+    Thread->Top = Frame->Parent;
+
+    HeapFree(GetProcessHeap(), 0, Frame);
+
+}
+
+//
+// ShadowStackPush
+//
+//  The new way, the next slot of a preallocated array. Past the end we
+//  count the overflow and don't track the call.
+//
+PBENCH_FRAME ShadowStackPush(PBENCH_THREAD Thread) {
+
+    PBENCH_FRAME frame;
+
+    if (Thread->Depth >= BENCH_MAX_DEPTH) {
+        Thread->Overflows++;
+        return NULL;
+    }
+
+    frame = &Thread->Frames[Thread->Depth];
+
+    frame->Parent = Thread->Top;
+    Thread->Top   = frame;
+    Thread->Depth++;
+
+    return frame;
+
+}
+
+void ShadowStackPop(PBENCH_THREAD Thread, PBENCH_FRAME Frame) {
+
+    Thread->Top = Frame->Parent;
+    Thread->Depth--;
+
+}
+
+BENCH_VARIANT Variants[] = {
+    { "Heap",        HeapPush,        HeapPop },
+    { "ShadowStack", ShadowStackPush, ShadowStackPop },
+};
+
+//
+// BenchCall
+//
+//  One instrumented call and the calls under it. The frame bookkeeping
+//  is the same for both variants.
+//
+__declspec(noinline)
+void BenchCall(PBENCH_VARIANT Variant, PBENCH_THREAD Thread, ULONG Depth) {
+
+    PBENCH_FRAME frame;
+    ULONGLONG    elapsed;
+
+    frame = Variant->Push(Thread);
+    if (frame == NULL) {
+        return;
+    }
+
+    frame->FunctionAddress = (ULONGLONG)(ULONG_PTR)BenchCall + Depth;
+    frame->DescendantCalls = 0;
+    frame->ChildTicks      = 0;
+    frame->InterruptTicks  = 0;
+    frame->StartCycles     = 0;
+    frame->RecursionDepth  = 0;
+    frame->ProcessId       = 0;
+    frame->StartTicks      = __rdtsc();
+
+    if (Depth > 1) {
+        BenchCall(Variant, Thread, Depth - 1);
+    }
+
+    elapsed = __rdtsc() - frame->StartTicks;
+
+    if (frame->Parent != NULL) {
+        frame->Parent->ChildTicks      += (LONGLONG)elapsed;
+        frame->Parent->DescendantCalls += frame->DescendantCalls + 1;
+    }
+
+    Variant->Pop(Thread, frame);
+
+}
+
+DWORD WINAPI BenchThread(PVOID Parameter) {
+
+    PBENCH_CONTEXT context = (PBENCH_CONTEXT)Parameter;
+    PBENCH_THREAD  thread;
+    ULONG          i;
+
+    thread = (PBENCH_THREAD)calloc(1, sizeof(BENCH_THREAD));
+    if (thread == NULL) {
+        return 1;
+    }
+
+    WaitForSingleObject(context->StartEvent, INFINITE);
+
+    for (i = 0; i < BENCH_ITERATIONS; i++) {
+        BenchCall(context->Variant, thread, context->Depth);
+    }
+
+    //
+    // Keep the compiler from throwing the work away
+    //
+    context->Checksum = thread->Overflows;
+
+    free(thread);
+
+    return 0;
+
+}
+
+//
+// RunVariant
+//
+//  Time every thread making its calls with one of the variants. Returns
+//  the wall clock nanoseconds per call on each thread, zero on failure.
+//
+double RunVariant(PBENCH_VARIANT Variant, ULONG Threads, ULONG Depth) {
+
+    PBENCH_CONTEXT contexts;
+    HANDLE        *handles;
+    HANDLE         startEvent;
+    LARGE_INTEGER  frequency;
+    LARGE_INTEGER  start;
+    LARGE_INTEGER  end;
+    ULONG          created = 0;
+    ULONG          i;
+    double         nsPerCall = 0;
+
+    contexts   = (PBENCH_CONTEXT)calloc(Threads, sizeof(BENCH_CONTEXT));
+    handles    = (HANDLE *)calloc(Threads, sizeof(HANDLE));
+    startEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+    if ((contexts == NULL) || (handles == NULL) || (startEvent == NULL)) {
+        printf("Out of memory\n");
+        goto Exit;
+    }
+
+    for (i = 0; i < Threads; i++) {
+
+        contexts[i].Variant    = Variant;
+        contexts[i].StartEvent = startEvent;
+        contexts[i].Depth      = Depth;
+
+        handles[i] = CreateThread(NULL, 0, BenchThread, &contexts[i], 0, NULL);
+        if (handles[i] == NULL) {
+            printf("Can't create thread %u\n", i);
+            SetEvent(startEvent);
+            goto Exit;
+        }
+
+        created++;
+
+    }
+
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&start);
+
+    SetEvent(startEvent);
+
+    WaitForMultipleObjects(Threads, handles, TRUE, INFINITE);
+
+    QueryPerformanceCounter(&end);
+
+    nsPerCall = ((double)(end.QuadPart - start.QuadPart) * 1e9 / 
+                                                (double)frequency.QuadPart) /
+                ((double)BENCH_ITERATIONS * Depth);
+
+Exit:
+
+    if (created != 0) {
+
+        WaitForMultipleObjects(created, handles, TRUE, INFINITE);
+
+        for (i = 0; i < created; i++) {
+            CloseHandle(handles[i]);
+        }
+
+    }
+
+    if (startEvent != NULL) {
+        CloseHandle(startEvent);
+    }
+
+    free(handles);
+    free(contexts);
+
+    return nsPerCall;
+
+}
+
+int __cdecl main(int argc, char **argv) {
+
+    ULONG threads = 1;
+    ULONG depth   = 8;
+    ULONG variant;
+
+    if (argc > 1) {
+        threads = strtoul(argv[1], NULL, 0);
+    }
+
+    if (argc > 2) {
+        depth = strtoul(argv[2], NULL, 0);
+    }
+
+    if ((threads == 0) || (threads > MAXIMUM_WAIT_OBJECTS) || 
+        (depth == 0) || (depth > BENCH_MAX_DEPTH)) {
+        printf("Usage: shadowstackbench [threads (1-%d)] [depth (1-%d)]\n", 
+               MAXIMUM_WAIT_OBJECTS,
+               BENCH_MAX_DEPTH);
+        return 1;
+    }
+
+    printf("Variant,Threads,Depth,CallsPerThread,NsPerCall\n");
+
+    for (variant = 0; variant < ARRAYSIZE(Variants); variant++) {
+
+        printf("%s,%u,%u,%u,%.1f\n",
+               Variants[variant].Name,
+               threads,
+               depth,
+               BENCH_ITERATIONS * depth,
+               RunVariant(&Variants[variant], threads, depth));
+
+    }
+
+    return 0;
+
+}
@@ -0,0 +1,218 @@
+//
+// Copyright 2008-2017 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+// CONSEQUENTIAL DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+// POSSIBILITY OF SUCH DAMAGE
+//
+// User mode test of the time source calibration math in time_calibration.h.
+// Prints each failure and exits with the number of them, zero if they all
+// passed.
+//
+#include <windows.h>
+#include <stdio.h>
+#include "time_calibration.h"
+
+//
+// Number of checks that failed
+//
+ULONG Failures;
+
+#define CHECK(Condition)                                            \
+    if (!(Condition)) {                                             \
+        printf("FAILED line %d: %s\n", __LINE__, #Condition);       \
+        Failures++;                                                 \
+    }
+
+//
+// TestTscIsInvariant
+//
+//  The invariant bit only counts if the CPU has the leaf that it's in.
+//
+void TestTscIsInvariant(void) {
+
+    CHECK(TimeCalibrationTscIsInvariant(0x80000008, 1 << 8) == TRUE);
+    CHECK(TimeCalibrationTscIsInvariant(0x80000007, 1 << 8) == TRUE);
+    CHECK(TimeCalibrationTscIsInvariant(0x80000008, 0) == FALSE);
+    CHECK(TimeCalibrationTscIsInvariant(0x80000008, ~(1 << 8)) == FALSE);
+    CHECK(TimeCalibrationTscIsInvariant(0x80000006, 1 << 8) == FALSE);
+    CHECK(TimeCalibrationTscIsInvariant(0, 0xFFFFFFFF) == FALSE);
+
+}
+
+//
+// TestTscTicksPerSecond
+//
+//  Rates from good readings, and zero from bad ones.
+//
+void TestTscTicksPerSecond(void) {
+
+    //
+    // 3GHz TSC against the usual 10MHz QPC over 10ms
+    //
+    CHECK(TimeCalibrationTscTicksPerSecond(1000, 
+                                           1000 + 30000000, 
+                                           500, 
+                                           500 + 100000, 
+                                           10000000) == 3000000000);
+
+    //
+    // Rate that doesn't divide evenly, against the ACPI PM timer
+    //
+    CHECK(TimeCalibrationTscTicksPerSecond(0, 
+                                           23999989, 
+                                           0, 
+                                           35795, 
+                                           3579545) == 2400029071);
+
+    //
+    // QPC running at the TSC's speed over a long stall. Multiplying 
+    // first would overflow.
+    //
+    CHECK(TimeCalibrationTscTicksPerSecond(0, 
+                                           30000000000, 
+                                           0, 
+                                           30000000000, 
+                                           3000000000) == 3000000000);
+
+    //
+    // Same over 3 seconds, where the remainder times the frequency no 
+    // longer fits in 64 bits
+    //
+    CHECK(TimeCalibrationTscTicksPerSecond(0, 
+                                           9000000000 + 8999999999, 
+                                           0, 
+                                           9000000000, 
+                                           3000000000) == 5999999999);
+
+    //
+    // Largest remainder and frequency there can be
+    //
+    CHECK(TimeCalibrationTscTicksPerSecond(0, 
+                                           0x7FFFFFFFFFFFFFFE, 
+                                           0, 
+                                           0x7FFFFFFFFFFFFFFF, 
+                                           0x7FFFFFFFFFFFFFFF) == 0x7FFFFFFFFFFFFFFE);
+
+    CHECK(TimeCalibrationTscTicksPerSecond(0, 
+                                           0xFFFFFFFFFFFFFFFD, 
+                                           0, 
+                                           0x7FFFFFFFFFFFFFFF, 
+                                           0x7FFFFFFFFFFFFFFF) == 0xFFFFFFFFFFFFFFFD);
+
+    //
+    // Start readings high up, only the differences matter
+    //
+    CHECK(TimeCalibrationTscTicksPerSecond(0xFFFFFFFF00000000, 
+                                           0xFFFFFFFF00000000 + 30000000, 
+                                           0x7FFFFFFF00000000, 
+                                           0x7FFFFFFF00000000 + 100000, 
+                                           10000000) == 3000000000);
+
+    //
+    // Clocks that didn't move or went backwards, and a bogus frequency
+    //
+    CHECK(TimeCalibrationTscTicksPerSecond(1000, 1000, 0, 100000, 10000000) == 0);
+    CHECK(TimeCalibrationTscTicksPerSecond(2000, 1000, 0, 100000, 10000000) == 0);
+    CHECK(TimeCalibrationTscTicksPerSecond(0, 30000000, 500, 500, 10000000) == 0);
+    CHECK(TimeCalibrationTscTicksPerSecond(0, 30000000, 600, 500, 10000000) == 0);
+    CHECK(TimeCalibrationTscTicksPerSecond(0, 30000000, 0, 100000, 0) == 0);
+    CHECK(TimeCalibrationTscTicksPerSecond(0, 30000000, 0, 100000, -1) == 0);
+
+}
+
+//
+// TestMulDiv
+//
+//  Products that don't fit in 64 bits, checked against results worked out
+//  by hand.
+//
+void TestMulDiv(void) {
+
+    CHECK(TimeCalibrationMulDiv(0, 0xFFFFFFFFFFFFFFFF, 1) == 0);
+    CHECK(TimeCalibrationMulDiv(6, 7, 8) == 5);
+    CHECK(TimeCalibrationMulDiv(0xFFFFFFFFFFFFFFFE, 
+                                0xFFFFFFFFFFFFFFFF, 
+                                0xFFFFFFFFFFFFFFFF) == 0xFFFFFFFFFFFFFFFE);
+
+    //
+    // 2^63 * 2^63 / 2^64
+    //
+    CHECK(TimeCalibrationMulDiv(0x8000000000000000, 
+                                0x8000000000000000, 
+                                0xFFFFFFFFFFFFFFFF) == 0x4000000000000000);
+
+    CHECK(TimeCalibrationMulDiv(0xFFFFFFFF, 
+                                0x100000000, 
+                                0x100000000) == 0xFFFFFFFF);
+
+}
+
+//
+// TestSelect
+//
+//  The TSC only when it's wanted, invariant and calibrated.
+//
+void TestSelect(void) {
+
+    TIME_CALIBRATION calibration;
+
+    memset(&calibration, 0xFF, sizeof(calibration));
+    TimeCalibrationSelect(PENTER_TIME_SOURCE_TSC, TRUE, 3000000000, 10000000, &calibration);
+    CHECK(calibration.TimeSource == PENTER_TIME_SOURCE_TSC);
+    CHECK(calibration.TicksPerSecond == 3000000000);
+
+    memset(&calibration, 0xFF, sizeof(calibration));
+    TimeCalibrationSelect(PENTER_TIME_SOURCE_QPC, TRUE, 3000000000, 10000000, &calibration);
+    CHECK(calibration.TimeSource == PENTER_TIME_SOURCE_QPC);
+    CHECK(calibration.TicksPerSecond == 10000000);
+
+    memset(&calibration, 0xFF, sizeof(calibration));
+    TimeCalibrationSelect(PENTER_TIME_SOURCE_TSC, FALSE, 3000000000, 10000000, &calibration);
+    CHECK(calibration.TimeSource == PENTER_TIME_SOURCE_QPC);
+    CHECK(calibration.TicksPerSecond == 10000000);
+
+    memset(&calibration, 0xFF, sizeof(calibration));
+    TimeCalibrationSelect(PENTER_TIME_SOURCE_TSC, TRUE, 0, 10000000, &calibration);
+    CHECK(calibration.TimeSource == PENTER_TIME_SOURCE_QPC);
+    CHECK(calibration.TicksPerSecond == 10000000);
+
+}
+
+int __cdecl main(void) {
+
+    TestTscIsInvariant();
+    TestMulDiv();
+    TestTscTicksPerSecond();
+    TestSelect();
+
+    if (Failures == 0) {
+        printf("All time calibration tests passed\n");
+    }
+
+    return (int)Failures;
+
+}